@@ -0,0 +1,89 @@
+#include "AddressTable.hpp"
+
+#define ADDRESS_TABLE_MIN_SIZE 64
+
+// Slots with a zero count are empty, address 0.0.0.0 never connects
+AddressTable::AddressTable() : used(0), total(0)
+{
+	Slot empty = {0, 0};
+	slots.assign(ADDRESS_TABLE_MIN_SIZE, empty);
+}
+
+static size_t hash_address(uint32_t address)
+{
+	address ^= address >> 16;
+	address *= 0x45d9f3b;
+	address ^= address >> 16;
+	return address;
+}
+
+// Slot holding `address`, or the empty slot where it would be inserted
+size_t AddressTable::index_of(uint32_t address)
+{
+	size_t mask = slots.size() - 1;
+	size_t idx = hash_address(address) & mask;
+
+	while (slots[idx].count != 0 && slots[idx].address != address)
+		idx = (idx + 1) & mask;
+	return idx;
+}
+
+void AddressTable::grow()
+{
+	std::vector<Slot> old;
+	Slot empty = {0, 0};
+
+	old.swap(slots);
+	slots.assign(old.size() * 2, empty);
+	for (size_t i = 0; i < old.size(); i++)
+		if (old[i].count != 0)
+			slots[index_of(old[i].address)] = old[i];
+}
+
+uint32_t AddressTable::get(uint32_t address)
+{
+	return slots[index_of(address)].count;
+}
+
+uint32_t AddressTable::increment(uint32_t address)
+{
+	if ((used + 1) * 2 > slots.size())
+		grow();
+
+	Slot &slot = slots[index_of(address)];
+	if (slot.count == 0)
+	{
+		slot.address = address;
+		used++;
+	}
+	total++;
+	return ++slot.count;
+}
+
+void AddressTable::decrement(uint32_t address)
+{
+	size_t mask = slots.size() - 1;
+	size_t idx = index_of(address);
+
+	if (slots[idx].count == 0)
+		return;
+	total--;
+	if (--slots[idx].count != 0)
+		return;
+
+	// Shift following entries of the probe run back into the hole
+	used--;
+	size_t hole = idx;
+	for (size_t next = (hole + 1) & mask; slots[next].count != 0; next = (next + 1) & mask)
+	{
+		size_t home = hash_address(slots[next].address) & mask;
+		if (((next - home) & mask) >= ((next - hole) & mask))
+		{
+			slots[hole] = slots[next];
+			slots[next].count = 0;
+			hole = next;
+		}
+	}
+}
+
+size_t AddressTable::get_total() { return total; }
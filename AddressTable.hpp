@@ -0,0 +1,31 @@
+#pragma once
+
+#include "IRCserver.hpp"
+
+// Open addressing hash table counting connections per IPv4 address.
+// Linear probing over a power of two array of (address, count) pairs;
+// removal uses backward shift deletion so no tombstones accumulate.
+class AddressTable
+{
+private:
+	typedef struct Slot
+	{
+		uint32_t address;
+		uint32_t count;
+	} Slot;
+
+	std::vector<Slot> slots;
+	size_t used;
+	size_t total;
+
+	size_t index_of(uint32_t address);
+	void grow();
+
+public:
+	AddressTable();
+
+	uint32_t get(uint32_t address);
+	uint32_t increment(uint32_t address);
+	void decrement(uint32_t address);
+	size_t get_total();
+};
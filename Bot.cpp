@@ -0,0 +1,133 @@
+#include "Bot.hpp"
+
+static const char *responses[] = {
+	"It is certain", "It is decidedly so", "Without a doubt",
+	"Yes definitely", "You may rely on it", "As I see it, yes",
+	"Most likely", "Outlook good", "Yes", "Signs point to yes",
+	"Reply hazy try again", "Ask again later", "Better not tell you now",
+	"Cannot predict now", "Concentrate and ask again",
+	"Don't count on it", "My reply is no", "My sources say no",
+	"Outlook not so good", "Very doubtful"};
+
+Bot::Bot() : seed(std::time(NULL)), threaded(false), stopping(false)
+{
+	pipe_fds[0] = -1;
+	pipe_fds[1] = -1;
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&cond, NULL);
+}
+
+Bot::~Bot()
+{
+	stop();
+	pthread_cond_destroy(&cond);
+	pthread_mutex_destroy(&lock);
+}
+
+void Bot::set_nickname(const std::string &nick) { nickname = nick; }
+
+bool Bot::start()
+{
+	if (pipe(pipe_fds) == -1)
+		return false;
+	for (int i = 0; i < 2; i++)
+	{
+		fcntl(pipe_fds[i], F_SETFL, O_NONBLOCK);
+		fcntl(pipe_fds[i], F_SETFD, FD_CLOEXEC);
+	}
+	stopping = false;
+	threaded = pthread_create(&thread, NULL, &Bot::worker, this) == 0;
+	return threaded;
+}
+
+void Bot::stop()
+{
+	if (threaded)
+	{
+		pthread_mutex_lock(&lock);
+		stopping = true;
+		pthread_cond_broadcast(&cond);
+		pthread_mutex_unlock(&lock);
+		pthread_join(thread, NULL);
+		threaded = false;
+	}
+	for (int i = 0; i < 2; i++)
+	{
+		if (pipe_fds[i] != -1)
+			close(pipe_fds[i]);
+		pipe_fds[i] = -1;
+	}
+}
+
+bool Bot::is_running() { return threaded; }
+int Bot::get_fd() { return pipe_fds[0]; }
+
+void *Bot::worker(void *arg)
+{
+	static_cast<Bot *>(arg)->work();
+	return NULL;
+}
+
+void Bot::work()
+{
+	while (true)
+	{
+		pthread_mutex_lock(&lock);
+		while (requests.empty() && !stopping)
+			pthread_cond_wait(&cond, &lock);
+		if (stopping)
+		{
+			pthread_mutex_unlock(&lock);
+			return;
+		}
+		BotMessage message = requests.front();
+		requests.pop_front();
+		pthread_mutex_unlock(&lock);
+
+		message.text = answer(message.text);
+
+		pthread_mutex_lock(&lock);
+		replies.push_back(message);
+		pthread_mutex_unlock(&lock);
+		char wake = 0;
+		if (write(pipe_fds[1], &wake, 1) == -1 && errno != EAGAIN)
+			std::cerr << "WARNING: bot wakeup failed" << std::endl;
+	}
+}
+
+// The bot answers when named, when messaged directly, or when sworn at
+bool Bot::addressed(const std::string &target, const std::string &text)
+{
+	return target == nickname || text.find(nickname) != std::string::npos || text.find("fuck") != std::string::npos;
+}
+
+// Only ever called from one thread at a time, the seed is the bot's own
+std::string Bot::answer(const std::string &text)
+{
+	if (text.find("fuck") != std::string::npos)
+		return "you";
+	return responses[rand_r(&seed) % (sizeof(responses) / sizeof(responses[0]))];
+}
+
+void Bot::submit(const BotMessage &message)
+{
+	pthread_mutex_lock(&lock);
+	requests.push_back(message);
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+}
+
+// Drains the wakeup pipe and returns every answer ready to be sent
+std::vector<BotMessage> Bot::collect()
+{
+	char buffer[256];
+	std::vector<BotMessage> done;
+
+	while (read(pipe_fds[0], buffer, sizeof(buffer)) > 0)
+		;
+	pthread_mutex_lock(&lock);
+	done.assign(replies.begin(), replies.end());
+	replies.clear();
+	pthread_mutex_unlock(&lock);
+	return done;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "IRCserver.hpp"
+
+#include <deque>
+#include <pthread.h>
+
+// A line the bot heard, or its answer. `target` is where the reply goes:
+// the channel it was said in, or the nickname of whoever messaged the bot.
+typedef struct BotMessage
+{
+	std::string target;
+	std::string text;
+} BotMessage;
+
+// The magic eight ball. The server hands it only the PRIVMSGs it can see
+// (channels it sits in and messages to its nickname); everything else never
+// reaches it. Answers are computed inline by default, or on a worker thread
+// that wakes the event loop through get_fd() like the resolver does.
+class Bot
+{
+private:
+	std::string nickname;
+	unsigned int seed;
+	bool threaded;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	std::deque<BotMessage> requests;
+	std::deque<BotMessage> replies;
+	bool stopping;
+	int pipe_fds[2];
+
+	static void *worker(void *arg);
+	void work();
+
+public:
+	Bot();
+	~Bot();
+
+	void set_nickname(const std::string &nick);
+	bool start();
+	void stop();
+	bool is_running();
+	int get_fd();
+
+	bool addressed(const std::string &target, const std::string &text);
+	std::string answer(const std::string &text);
+	void submit(const BotMessage &message);
+	std::vector<BotMessage> collect();
+};
@@ -0,0 +1,102 @@
+#include "Capture.hpp"
+
+#include <iterator>
+#include <sys/stat.h>
+
+#define CAPTURE_FLUSH_THRESHOLD (64 * 1024)
+
+Capture::Capture() : fd(-1), start(0) {}
+
+Capture::~Capture()
+{
+	flush();
+	if (fd != -1)
+		close(fd);
+}
+
+// A capture already at filename, say from before a restart, is kept under
+// the first free numbered suffix instead of being overwritten
+bool Capture::open(const std::string &filename)
+{
+	struct stat st;
+
+	if (stat(filename.c_str(), &st) == 0 && st.st_size > 0)
+	{
+		std::string rotated;
+		for (int n = 1; rotated.empty() || access(rotated.c_str(), F_OK) == 0; n++)
+			rotated = filename + "." + to_string(n);
+		if (rename(filename.c_str(), rotated.c_str()) == -1)
+			return false;
+		std::cout << "Previous capture moved to " << rotated << std::endl;
+	}
+	fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd == -1)
+		return false;
+	start = monotonic_us();
+	pending = CAPTURE_MAGIC;
+	return true;
+}
+
+bool Capture::is_enabled() { return fd != -1; }
+
+// Record layout: u8 type, u64 time, u32 fd, str payload
+void Capture::record(int type, int fd, const std::string &payload)
+{
+	if (this->fd == -1)
+		return;
+
+	put_u8(pending, type);
+	put_u64(pending, monotonic_us() - start);
+	put_u32(pending, fd);
+	put_str(pending, payload);
+
+	if (pending.length() >= CAPTURE_FLUSH_THRESHOLD)
+		flush();
+}
+
+void Capture::flush()
+{
+	if (fd == -1 || pending.empty())
+		return;
+
+	size_t written = 0;
+	while (written < pending.length())
+	{
+		ssize_t ret = write(fd, pending.c_str() + written, pending.length() - written);
+		if (ret <= 0)
+		{
+			if (ret == -1 && errno == EINTR)
+				continue;
+			std::cout << GREY << "WARNING: capture write failed, capture stopped" << RESET << std::endl;
+			close(fd);
+			fd = -1;
+			break;
+		}
+		written += ret;
+	}
+	pending.clear();
+}
+
+bool Capture::load(const std::string &filename, std::vector<CaptureRecord> &records)
+{
+	std::ifstream file(filename.c_str(), std::ios::binary);
+	std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	std::string magic(CAPTURE_MAGIC);
+
+	if (!file.is_open() || data.compare(0, magic.length(), magic) != 0)
+		return false;
+
+	ByteReader reader(data.c_str() + magic.length(), data.length() - magic.length());
+	while (reader.remaining() > 0)
+	{
+		CaptureRecord record;
+		record.type = reader.u8();
+		record.time = reader.u64();
+		record.fd = (int)reader.u32();
+		record.payload = reader.str();
+		if (!reader.good())
+			break; // truncated tail, the server was killed mid write
+		records.push_back(record);
+	}
+	return true;
+}
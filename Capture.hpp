@@ -0,0 +1,45 @@
+#pragma once
+
+#include "IRCserver.hpp"
+
+#define CAPTURE_MAGIC "IRCCAP01"
+
+enum
+{
+	CAPTURE_CONNECT = 1,
+	CAPTURE_DATA = 2,
+	CAPTURE_DISCONNECT = 3
+};
+
+typedef struct CaptureRecord
+{
+	int type;
+	uint64_t time;
+	int fd;
+	std::string payload;
+} CaptureRecord;
+
+// Compact binary log of inbound traffic: connects (with the peer address),
+// every complete line handed to parse_command, and disconnects, each stamped
+// with microseconds since the capture started. Lines are stored verbatim,
+// including PASS and OPER credentials, so treat capture files as secrets.
+// Opening never overwrites an earlier capture, it is moved aside first.
+class Capture
+{
+private:
+	int fd;
+	uint64_t start;
+	std::string pending;
+
+public:
+	Capture();
+	~Capture();
+
+	bool open(const std::string &filename);
+	bool is_enabled();
+
+	void record(int type, int fd, const std::string &payload);
+	void flush();
+
+	static bool load(const std::string &filename, std::vector<CaptureRecord> &records);
+};
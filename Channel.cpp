@@ -73,6 +73,8 @@ std::vector<std::string> Channel::get_who_list()
 	return list;
 }
 
+UserList &Channel::get_operators() { return operators; }
+
 int Channel::add_operator(User *user)
 {
 	operators[user->get_fd()] = user;
@@ -89,17 +91,72 @@ void Channel::remove_operator(User *user)
 	operators.erase(user->get_fd());
 }
 
+UserList &Channel::get_invited() { return invited; }
+
 void Channel::invite(User *user)
 {
 	invited[user->get_fd()] = user;
 }
 
+// A saved entry only holds for the nickname coming back from the same user@host
+static bool is_saved(const std::map<std::string, std::string> &saved, User *user)
+{
+	std::map<std::string, std::string>::const_iterator it = saved.find(user->get_nick());
+	return it != saved.end() && it->second == user->get_user() + "@" + user->get_host();
+}
+
 bool Channel::is_invited(User *user)
 {
-	return invited.find(user->get_fd()) != invited.end() || (mode & MODE_INVITEONLY) == 0;
+	return invited.find(user->get_fd()) != invited.end() || is_saved(saved_invites, user) || (mode & MODE_INVITEONLY) == 0
+		|| (!masks.empty() && !masks[2].empty() && masks[2].match(user->get_hostmask(user->get_nick())));
 }
 
 void Channel::remove_invite(User *user)
 {
 	invited.erase(user->get_fd());
+	saved_invites.erase(user->get_nick());
+}
+
+static size_t mask_index(int mode)
+{
+	return mode & MODE_EXCEPT ? 1 : mode & MODE_INVEX ? 2 : 0;
+}
+
+// MODE_BAN, MODE_EXCEPT or MODE_INVEX
+MaskList &Channel::get_masks(int mode)
+{
+	if (masks.empty())
+		masks.resize(3);
+	return masks[mask_index(mode)];
+}
+
+const std::vector<MaskList::Entry> &Channel::get_mask_entries(int mode)
+{
+	static const std::vector<MaskList::Entry> none;
+	return masks.empty() ? none : masks[mask_index(mode)].get_entries();
+}
+
+bool Channel::is_banned(User *user)
+{
+	if (masks.empty() || masks[0].empty())
+		return false;
+	std::string hostmask = user->get_hostmask(user->get_nick());
+	return masks[0].match(hostmask) && !masks[1].match(hostmask);
+}
+
+std::map<std::string, std::string> &Channel::get_saved_operators() { return saved_operators; }
+std::map<std::string, std::string> &Channel::get_saved_invites() { return saved_invites; }
+
+bool Channel::claim_operator(User *user)
+{
+	if (!is_saved(saved_operators, user))
+		return false;
+	saved_operators.erase(user->get_nick());
+	return true;
+}
+
+void Channel::forget_saved()
+{
+	saved_operators.clear();
+	saved_invites.clear();
 }
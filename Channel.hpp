@@ -1,6 +1,7 @@
 #pragma once
 
 #include "IRCserver.hpp"
+#include "MaskList.hpp"
 
 class Channel;
 class User;
@@ -12,7 +13,10 @@ enum
 	MODE_TOPIC = 1 << 1,
 	MODE_KEY = 1 << 2,
 	MODE_OPERATOR = 1 << 3,
-	MODE_LIMIT = 1 << 4
+	MODE_LIMIT = 1 << 4,
+	MODE_BAN = 1 << 5,
+	MODE_EXCEPT = 1 << 6,
+	MODE_INVEX = 1 << 7
 };
 
 class Channel
@@ -27,6 +31,15 @@ private:
 	UserList operators;
 	UserList invited;
 
+	// Ban, exception and invite exception lists, in that order. Most channels
+	// never get a mask, so they are only allocated by the first one.
+	std::vector<MaskList> masks;
+
+	// Restored from a snapshot, nickname to the user@host it was saved with,
+	// until that user shows up or the claim window closes
+	std::map<std::string, std::string> saved_operators;
+	std::map<std::string, std::string> saved_invites;
+
 public:
 	Channel();
 	Channel(const std::string &n, const std::string &k, const std::string &t);
@@ -56,11 +69,22 @@ public:
 	std::string get_users_count();
 	std::vector<std::string> get_who_list();
 
+	UserList &get_operators();
 	int add_operator(User *user);
 	bool is_operator(User *user);
 	void remove_operator(User *user);
 
+	UserList &get_invited();
 	void invite(User *user);
 	bool is_invited(User *user);
 	void remove_invite(User *user);
+
+	MaskList &get_masks(int mode);
+	const std::vector<MaskList::Entry> &get_mask_entries(int mode);
+	bool is_banned(User *user);
+
+	std::map<std::string, std::string> &get_saved_operators();
+	std::map<std::string, std::string> &get_saved_invites();
+	bool claim_operator(User *user);
+	void forget_saved();
 };
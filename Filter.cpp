@@ -0,0 +1,180 @@
+#include "Filter.hpp"
+
+#include <cctype>
+#include <deque>
+
+static const char *action_names[] = {"none", "warn", "block", "kill"};
+
+Filter::Filter() : width(1), delta(1, 0), verdicts(1, -1)
+{
+	std::memset(classes, 0, sizeof(classes));
+	std::memset(starts, 0, sizeof(starts));
+}
+
+std::string Filter::normalize(const std::string &pattern)
+{
+	std::string folded(pattern);
+
+	for (size_t i = 0; i < folded.length(); i++)
+		folded[i] = std::tolower((unsigned char)folded[i]);
+	return folded;
+}
+
+int Filter::parse_action(const std::string &name)
+{
+	std::string folded = normalize(name);
+
+	for (int action = FILTER_WARN; action <= FILTER_KILL; action++)
+		if (folded == action_names[action])
+			return action;
+	return FILTER_NONE;
+}
+
+const char *Filter::action_name(int action)
+{
+	return action_names[action >= FILTER_NONE && action <= FILTER_KILL ? action : FILTER_NONE];
+}
+
+// Expects a normalized pattern, returns false when it is already listed
+bool Filter::add(const std::string &pattern, int action, const std::string &setter, time_t time)
+{
+	for (size_t i = 0; i < entries.size(); i++)
+		if (entries[i].pattern == pattern)
+			return false;
+	Entry entry = {pattern, action, setter, time};
+	entries.push_back(entry);
+	compile();
+	return true;
+}
+
+bool Filter::remove(const std::string &pattern)
+{
+	for (size_t i = 0; i < entries.size(); i++)
+	{
+		if (entries[i].pattern != pattern)
+			continue;
+		entries.erase(entries.begin() + i);
+		compile();
+		return true;
+	}
+	return false;
+}
+
+// Takes a list from get_entries(), compiled once rather than per pattern
+void Filter::assign(const std::vector<Entry> &list)
+{
+	entries = list;
+	compile();
+}
+
+bool Filter::worse(int32_t entry, int32_t than) const
+{
+	return entry >= 0 && (than < 0 || entries[entry].action > entries[than].action);
+}
+
+// Edits are rare next to messages, the whole automaton is rebuilt. The trie
+// is laid out directly in the transition table, where 0 means no child yet
+// since the root is never anyone's child, then a breadth first pass turns it
+// into a full DFA by following the failure links for the missing edges.
+void Filter::compile()
+{
+	std::memset(classes, 0, sizeof(classes));
+	std::memset(starts, 0, sizeof(starts));
+	width = 1;
+	for (size_t i = 0; i < entries.size(); i++)
+	{
+		const std::string &pattern = entries[i].pattern;
+		for (size_t j = 0; j < pattern.length(); j++)
+		{
+			unsigned char c = pattern[j];
+			if (classes[c] == 0)
+			{
+				classes[c] = width;
+				classes[(unsigned char)std::toupper(c)] = width++;
+			}
+		}
+		unsigned char first = pattern[0];
+		starts[first] = true;
+		starts[(unsigned char)std::toupper(first)] = true;
+	}
+
+	delta.assign(width, 0);
+	verdicts.assign(1, -1);
+	for (size_t i = 0; i < entries.size(); i++)
+	{
+		const std::string &pattern = entries[i].pattern;
+		uint32_t state = 0;
+		for (size_t j = 0; j < pattern.length(); j++)
+		{
+			uint32_t &next = delta[state * width + classes[(unsigned char)pattern[j]]];
+			if (next == 0)
+			{
+				next = verdicts.size();
+				verdicts.push_back(-1);
+				delta.resize(delta.size() + width, 0);
+			}
+			state = delta[state * width + classes[(unsigned char)pattern[j]]];
+		}
+		if (worse(i, verdicts[state]))
+			verdicts[state] = i;
+	}
+
+	std::vector<uint32_t> failure(verdicts.size(), 0);
+	std::deque<uint32_t> queue;
+	for (size_t c = 1; c < width; c++)
+		if (delta[c])
+			queue.push_back(delta[c]);
+	while (!queue.empty())
+	{
+		uint32_t state = queue.front();
+		queue.pop_front();
+		if (worse(verdicts[failure[state]], verdicts[state]))
+			verdicts[state] = verdicts[failure[state]];
+		for (size_t c = 1; c < width; c++)
+		{
+			uint32_t &next = delta[state * width + c];
+			uint32_t fallback = delta[failure[state] * width + c];
+			if (next == 0)
+				next = fallback;
+			else
+			{
+				failure[next] = fallback;
+				queue.push_back(next);
+			}
+		}
+	}
+}
+
+// Stops at the first kill since nothing outranks it
+const Filter::Entry *Filter::match(const std::string &text, size_t offset) const
+{
+	const unsigned char *end = (const unsigned char *)text.data() + text.length();
+	const unsigned char *p = (const unsigned char *)text.data() + std::min(offset, text.length());
+	uint32_t state = 0;
+	int32_t found = -1;
+
+	if (entries.empty())
+		return NULL;
+	while (p < end)
+	{
+		if (state == 0)
+		{
+			while (p < end && !starts[*p])
+				p++;
+			if (p == end)
+				break;
+		}
+		state = delta[state * width + classes[*p++]];
+		if (worse(verdicts[state], found))
+		{
+			found = verdicts[state];
+			if (entries[found].action == FILTER_KILL)
+				break;
+		}
+	}
+	return found < 0 ? NULL : &entries[found];
+}
+
+bool Filter::empty() const { return entries.empty(); }
+size_t Filter::size() const { return entries.size(); }
+const std::vector<Filter::Entry> &Filter::get_entries() const { return entries; }
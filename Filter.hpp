@@ -0,0 +1,57 @@
+#pragma once
+
+#include "IRCserver.hpp"
+
+// Ordered by severity, the most severe pattern found in a message wins
+enum {
+	FILTER_NONE,
+	FILTER_WARN,
+	FILTER_BLOCK,
+	FILTER_KILL
+};
+
+// Operator managed list of forbidden substrings, matched case-insensitively
+// against message text.
+//
+// The patterns are compiled into one Aho-Corasick automaton, so a message is
+// read once whatever the number of patterns. Bytes that appear in no pattern
+// share a single input class, which keeps the transition table dense and
+// small, and while the automaton sits in its root state the scan skips ahead
+// to the next byte some pattern starts with.
+class Filter
+{
+public:
+	typedef struct Entry
+	{
+		std::string pattern;
+		int action;
+		std::string setter;
+		time_t time;
+	} Entry;
+
+private:
+	std::vector<Entry> entries;
+	unsigned char classes[256];
+	bool starts[256];
+	size_t width;
+	std::vector<uint32_t> delta;
+	std::vector<int32_t> verdicts;
+
+	void compile();
+	bool worse(int32_t entry, int32_t than) const;
+
+public:
+	Filter();
+
+	static std::string normalize(const std::string &pattern);
+	static int parse_action(const std::string &name);
+	static const char *action_name(int action);
+
+	bool add(const std::string &pattern, int action, const std::string &setter, time_t time);
+	bool remove(const std::string &pattern);
+	void assign(const std::vector<Entry> &list);
+	const Entry *match(const std::string &text, size_t offset = 0) const;
+	bool empty() const;
+	size_t size() const;
+	const std::vector<Entry> &get_entries() const;
+};
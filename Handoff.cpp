@@ -0,0 +1,146 @@
+#include "Handoff.hpp"
+
+#define HANDOFF_CHUNK 200
+
+static void set_timeouts(int sock)
+{
+	timeval tv = initialized<timeval>();
+
+	tv.tv_sec = HANDOFF_TIMEOUT;
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+static bool write_all(int sock, const char *data, size_t len)
+{
+	while (len > 0)
+	{
+		ssize_t ret = send(sock, data, len, MSG_NOSIGNAL);
+		if (ret <= 0)
+		{
+			if (ret == -1 && errno == EINTR)
+				continue;
+			return false;
+		}
+		data += ret;
+		len -= ret;
+	}
+	return true;
+}
+
+static bool read_all(int sock, char *data, size_t len)
+{
+	while (len > 0)
+	{
+		ssize_t ret = recv(sock, data, len, 0);
+		if (ret <= 0)
+		{
+			if (ret == -1 && errno == EINTR)
+				continue;
+			return false;
+		}
+		data += ret;
+		len -= ret;
+	}
+	return true;
+}
+
+static bool send_chunk(int sock, const int *fds, size_t count)
+{
+	char byte = 'F';
+	iovec iov;
+	msghdr msg = initialized<msghdr>();
+	std::vector<char> control(CMSG_SPACE(sizeof(int) * count));
+
+	iov.iov_base = &byte;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = &control[0];
+	msg.msg_controllen = control.size();
+
+	cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+	std::memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+
+	return sendmsg(sock, &msg, MSG_NOSIGNAL) == 1;
+}
+
+static bool receive_chunk(int sock, std::vector<int> &fds)
+{
+	char byte;
+	iovec iov;
+	msghdr msg = initialized<msghdr>();
+	std::vector<char> control(CMSG_SPACE(sizeof(int) * HANDOFF_CHUNK));
+
+	iov.iov_base = &byte;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = &control[0];
+	msg.msg_controllen = control.size();
+
+	if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != 1 || (msg.msg_flags & MSG_CTRUNC))
+		return false;
+	for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+	{
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		const int *data = (const int *)CMSG_DATA(cmsg);
+		fds.insert(fds.end(), data, data + count);
+	}
+	return true;
+}
+
+// Wire format: u32 fd count, fd chunks (one byte each plus SCM_RIGHTS), u64 state length, state
+bool handoff_send(int sock, const std::vector<int> &fds, const std::string &state)
+{
+	std::string header;
+
+	set_timeouts(sock);
+	put_u32(header, fds.size());
+	if (!write_all(sock, header.c_str(), header.length()))
+		return false;
+	for (size_t i = 0; i < fds.size(); i += HANDOFF_CHUNK)
+		if (!send_chunk(sock, &fds[i], std::min((size_t)HANDOFF_CHUNK, fds.size() - i)))
+			return false;
+
+	std::string length;
+	put_u64(length, state.length());
+	return write_all(sock, length.c_str(), length.length()) && write_all(sock, state.c_str(), state.length());
+}
+
+bool handoff_receive(int sock, std::vector<int> &fds, std::string &state)
+{
+	char header[8];
+
+	set_timeouts(sock);
+	if (!read_all(sock, header, 4))
+		return false;
+	uint32_t count = ByteReader(header, 4).u32();
+	while (fds.size() < count)
+		if (!receive_chunk(sock, fds))
+			return false;
+
+	if (!read_all(sock, header, 8))
+		return false;
+	uint64_t length = ByteReader(header, 8).u64();
+	state.resize(length);
+	return length == 0 || read_all(sock, &state[0], length);
+}
+
+bool handoff_ack(int sock)
+{
+	return write_all(sock, "K", 1);
+}
+
+bool handoff_wait_ack(int sock)
+{
+	char byte = 0;
+
+	set_timeouts(sock);
+	return read_all(sock, &byte, 1) && byte == 'K';
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include "IRCserver.hpp"
+
+#define HANDOFF_ENV "IRCSERV_HANDOFF_FD"
+#define HANDOFF_TIMEOUT 10
+
+// Transfer of open descriptors and a serialized state blob between the old
+// and new server process over a unix socket. Descriptors travel as
+// SCM_RIGHTS ancillary data in chunks, followed by the length prefixed blob.
+// Both calls block, with HANDOFF_TIMEOUT applied to each socket operation.
+bool handoff_send(int sock, const std::vector<int> &fds, const std::string &state);
+bool handoff_receive(int sock, std::vector<int> &fds, std::string &state);
+
+bool handoff_ack(int sock);
+bool handoff_wait_ack(int sock);
@@ -0,0 +1,369 @@
+#include "History.hpp"
+
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define HISTORY_FLUSH_THRESHOLD (64 * 1024)
+
+History::History() : segment_size(0), retention(0), fd(-1), segment(0), segment_length(0) {}
+
+History::~History()
+{
+	flush();
+	if (fd != -1)
+		close(fd);
+}
+
+std::string History::segment_path(unsigned long index)
+{
+	std::stringstream ss;
+	ss << directory << "/" << std::setw(10) << std::setfill('0') << index << ".log";
+	return ss.str();
+}
+
+std::vector<unsigned long> History::list_segments()
+{
+	std::vector<unsigned long> segments;
+	DIR *dir = opendir(directory.c_str());
+
+	if (!dir)
+		return segments;
+	while (dirent *entry = readdir(dir))
+	{
+		std::string name(entry->d_name);
+		if (name.length() != 14 || name.substr(10) != ".log")
+			continue;
+		try {
+			segments.push_back(to_number<unsigned long>(name.substr(0, 10)));
+		} catch (std::exception &e) {}
+	}
+	closedir(dir);
+	std::sort(segments.begin(), segments.end());
+	return segments;
+}
+
+// A torn record at the tail, left by a crash or a failed flush, is cut off
+// first: scan_segment stops at it and would never see what came after
+bool History::open_segment(unsigned long index)
+{
+	if (fd != -1)
+		close(fd);
+	fd = ::open(segment_path(index).c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (fd == -1)
+		return false;
+
+	struct stat st;
+	std::vector<HistoryRecord> records;
+	size_t valid = 0;
+	segment = index;
+	segment_length = fstat(fd, &st) == 0 ? st.st_size : 0;
+	if (segment_length > 0 && scan_segment(index, records, -1, "", &valid) && valid < segment_length)
+	{
+		std::cout << GREY << "WARNING: truncating torn history segment " << index << " from " << segment_length << " to " << valid << " bytes" << RESET << std::endl;
+		if (ftruncate(fd, valid) == 0)
+			segment_length = valid;
+	}
+	return true;
+}
+
+bool History::open(const std::string &dir, size_t segment_size, time_t retention)
+{
+	this->directory = dir;
+	this->segment_size = segment_size;
+	this->retention = retention;
+
+	if (mkdir(dir.c_str(), 0755) == -1 && errno != EEXIST)
+		return false;
+
+	std::vector<unsigned long> segments = list_segments();
+	if (!open_segment(segments.empty() ? 0 : segments.back()))
+		return false;
+
+	// The message index is rebuilt from what is on disk
+	tails.clear();
+	for (size_t i = 0; i < segments.size(); i++)
+	{
+		std::vector<HistoryRecord> records;
+		std::vector<size_t> offsets;
+		scan_segment(segments[i], records, HISTORY_MESSAGE, "", NULL, &offsets);
+		for (size_t r = 0; r < records.size(); r++)
+			index_message(records[r].channel, segments[i], offsets[r]);
+	}
+	return true;
+}
+
+bool History::is_enabled() { return fd != -1; }
+
+// Record layout: u32 payload length, then u8 type, u64 time, str channel, str data
+void History::append(int type, const std::string &channel, const std::string &data)
+{
+	if (fd == -1)
+		return;
+
+	std::string payload;
+	put_u8(payload, type);
+	put_u64(payload, std::time(NULL));
+	put_str(payload, channel);
+	put_str(payload, data);
+	if (type == HISTORY_MESSAGE)
+		index_message(channel, segment, segment_length + pending.length());
+	put_u32(pending, payload.length());
+	pending += payload;
+
+	if (pending.length() >= HISTORY_FLUSH_THRESHOLD)
+		flush();
+}
+
+void History::flush()
+{
+	if (fd == -1 || pending.empty())
+		return;
+
+	size_t written = 0;
+	while (written < pending.length())
+	{
+		ssize_t ret = write(fd, pending.c_str() + written, pending.length() - written);
+		if (ret <= 0)
+		{
+			if (ret == -1 && errno == EINTR)
+				continue;
+			std::cout << GREY << "WARNING: history write failed, dropping " << pending.length() - written << " bytes" << RESET << std::endl;
+			break;
+		}
+		written += ret;
+	}
+	// A short write leaves part of a record behind, the file goes back to
+	// the last record that made it whole
+	if (written < pending.length())
+	{
+		ByteReader reader(pending.c_str(), written);
+		size_t boundary = 0;
+		while (reader.remaining() >= 4)
+		{
+			uint32_t length = reader.u32();
+			if (length > reader.remaining())
+				break;
+			reader.skip(length);
+			boundary = reader.offset();
+		}
+		if (boundary < written && ftruncate(fd, segment_length + boundary) == 0)
+			written = boundary;
+		unindex_from(segment, segment_length + boundary);
+	}
+	segment_length += written;
+	pending.clear();
+
+	if (segment_length >= segment_size)
+		rotate();
+}
+
+void History::rotate()
+{
+	if (!open_segment(segment + 1))
+	{
+		std::cout << GREY << "WARNING: failed to open history segment " << segment + 1 << ", history disabled" << RESET << std::endl;
+		return;
+	}
+	expire();
+}
+
+void History::expire()
+{
+	std::vector<unsigned long> segments = list_segments();
+	time_t now = std::time(NULL);
+
+	for (size_t i = 0; i < segments.size(); i++)
+	{
+		struct stat st;
+		std::string path = segment_path(segments[i]);
+
+		if (segments[i] == segment || stat(path.c_str(), &st) == -1)
+			continue;
+		if (now - st.st_mtime > retention)
+			unlink(path.c_str());
+	}
+
+	// Positions in segments that are gone now
+	segments = list_segments();
+	unsigned long oldest = segments.empty() ? segment : segments.front();
+	for (std::map<std::string, std::deque<Position> >::iterator it = tails.begin(); it != tails.end();)
+	{
+		while (!it->second.empty() && it->second.front().segment < oldest)
+			it->second.pop_front();
+		if (it->second.empty())
+			tails.erase(it++);
+		else
+			++it;
+	}
+}
+
+// Remembers where a channel's message starts, keeping the latest HISTORY_QUERY_MAX
+void History::index_message(const std::string &channel, unsigned long index, size_t offset)
+{
+	std::deque<Position> &tail = tails[channel];
+	Position position;
+
+	position.segment = index;
+	position.offset = offset;
+	tail.push_back(position);
+	if (tail.size() > HISTORY_QUERY_MAX)
+		tail.pop_front();
+}
+
+// Forgets the messages from offset on in segment `index`, they never reached the file
+void History::unindex_from(unsigned long index, size_t offset)
+{
+	for (std::map<std::string, std::deque<Position> >::iterator it = tails.begin(); it != tails.end();)
+	{
+		while (!it->second.empty() && it->second.back().segment == index && it->second.back().offset >= offset)
+			it->second.pop_back();
+		if (it->second.empty())
+			tails.erase(it++);
+		else
+			++it;
+	}
+}
+
+// Reads one record from the segment open as sfd, `size` bytes long, or from
+// the pending buffer when it is not written yet
+bool History::read_record(const Position &position, int sfd, size_t size, HistoryRecord &record)
+{
+	std::string raw;
+
+	if (position.segment == segment && position.offset >= segment_length)
+	{
+		size_t at = position.offset - segment_length;
+		if (at + 4 > pending.length())
+			return false;
+		ByteReader reader(pending.c_str() + at, 4);
+		uint32_t length = reader.u32();
+		if (length > pending.length() - at - 4)
+			return false;
+		raw.assign(pending, at + 4, length);
+	}
+	else
+	{
+		char header[4];
+		if (sfd == -1 || position.offset + 4 > size || pread(sfd, header, 4, position.offset) != 4)
+			return false;
+		ByteReader reader(header, 4);
+		uint32_t length = reader.u32();
+		if (length == 0 || length > size - position.offset - 4)
+			return false;
+		raw.resize(length);
+		if (pread(sfd, &raw[0], length, position.offset + 4) != (ssize_t)length)
+			return false;
+	}
+
+	ByteReader payload(raw.c_str(), raw.length());
+	record.type = payload.u8();
+	record.time = payload.u64();
+	record.channel = payload.str();
+	record.data = payload.str();
+	return payload.good();
+}
+
+// A `type` of -1 matches nothing, only `valid` is filled in: the length of
+// the segment up to the end of its last whole record. `offsets` gets where
+// each returned record starts.
+bool History::scan_segment(unsigned long index, std::vector<HistoryRecord> &records, int type, const std::string &channel, size_t *valid, std::vector<size_t> *offsets)
+{
+	int sfd = ::open(segment_path(index).c_str(), O_RDONLY | O_CLOEXEC);
+	if (sfd == -1)
+		return false;
+
+	struct stat st;
+	if (fstat(sfd, &st) == -1)
+	{
+		close(sfd);
+		return false;
+	}
+	if (st.st_size == 0)
+	{
+		close(sfd);
+		return true;
+	}
+
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, sfd, 0);
+	close(sfd);
+	if (map == MAP_FAILED)
+		return false;
+
+	ByteReader reader((const char *)map, st.st_size);
+	while (reader.remaining() >= 4)
+	{
+		size_t start = reader.offset();
+		uint32_t length = reader.u32();
+		if (length > reader.remaining())
+			break; // torn write at the tail of the segment
+
+		ByteReader payload((const char *)map + reader.offset(), length);
+		reader.skip(length);
+		if (valid)
+			*valid = reader.offset();
+
+		HistoryRecord record;
+		record.type = payload.u8();
+		if (type && record.type != type)
+			continue;
+		record.time = payload.u64();
+		record.channel = payload.str();
+		if (!channel.empty() && record.channel != channel)
+			continue;
+		record.data = payload.str();
+		if (!payload.good())
+			continue;
+		records.push_back(record);
+		if (offsets)
+			offsets->push_back(start);
+	}
+	munmap(map, st.st_size);
+	return true;
+}
+
+// Returns up to `limit` most recent messages of a channel, oldest first,
+// reading only the indexed records
+std::vector<HistoryRecord> History::query(const std::string &channel, size_t limit)
+{
+	std::vector<HistoryRecord> result;
+	std::map<std::string, std::deque<Position> >::iterator it = tails.find(channel);
+
+	if (it == tails.end())
+		return result;
+	std::deque<Position> &tail = it->second;
+	int sfd = -1;
+	unsigned long opened = 0;
+	size_t size = 0;
+	for (size_t i = tail.size() - std::min(limit, tail.size()); i < tail.size(); i++)
+	{
+		bool on_disk = tail[i].segment != segment || tail[i].offset < segment_length;
+		if (on_disk && (sfd == -1 || opened != tail[i].segment))
+		{
+			if (sfd != -1)
+				close(sfd);
+			struct stat st;
+			opened = tail[i].segment;
+			sfd = ::open(segment_path(opened).c_str(), O_RDONLY | O_CLOEXEC);
+			size = sfd != -1 && fstat(sfd, &st) == 0 ? st.st_size : 0;
+		}
+		HistoryRecord record;
+		if (read_record(tail[i], sfd, size, record) && record.type == HISTORY_MESSAGE && record.channel == channel)
+			result.push_back(record);
+	}
+	if (sfd != -1)
+		close(sfd);
+	return result;
+}
+
+// Returns every channel state record in write order, later records supersede earlier ones
+std::vector<HistoryRecord> History::recover()
+{
+	std::vector<HistoryRecord> records;
+	std::vector<unsigned long> segments = list_segments();
+
+	for (size_t i = 0; i < segments.size(); i++)
+		if (!scan_segment(segments[i], records, HISTORY_STATE, ""))
+			std::cout << GREY << "WARNING: failed to read history segment " << segments[i] << RESET << std::endl;
+	return records;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "IRCserver.hpp"
+
+#include <deque>
+
+// Most messages a HISTORY query returns, and so how many each channel indexes
+#define HISTORY_QUERY_MAX 500
+
+enum
+{
+	HISTORY_MESSAGE = 1,
+	HISTORY_STATE = 2
+};
+
+typedef struct HistoryRecord
+{
+	int type;
+	time_t time;
+	std::string channel;
+	std::string data;
+} HistoryRecord;
+
+// Segmented append-only log of channel messages and state changes.
+// Writes are batched in memory and flushed once per event loop iteration,
+// segments are read back through mmap. Only the positions of each channel's
+// latest messages stay in RAM, so a query reads just the records it returns.
+class History
+{
+private:
+	typedef struct Position
+	{
+		unsigned long segment;
+		size_t offset;
+	} Position;
+
+	std::string directory;
+	size_t segment_size;
+	time_t retention;
+	int fd;
+	unsigned long segment;
+	size_t segment_length;
+	std::string pending;
+	std::map<std::string, std::deque<Position> > tails;
+
+	std::string segment_path(unsigned long index);
+	std::vector<unsigned long> list_segments();
+	bool open_segment(unsigned long index);
+	void rotate();
+	void expire();
+	bool scan_segment(unsigned long index, std::vector<HistoryRecord> &records, int type, const std::string &channel, size_t *valid = NULL, std::vector<size_t> *offsets = NULL);
+	void index_message(const std::string &channel, unsigned long index, size_t offset);
+	void unindex_from(unsigned long index, size_t offset);
+	bool read_record(const Position &position, int sfd, size_t size, HistoryRecord &record);
+
+public:
+	History();
+	~History();
+
+	bool open(const std::string &dir, size_t segment_size, time_t retention);
+	bool is_enabled();
+
+	void append(int type, const std::string &channel, const std::string &data);
+	void flush();
+
+	std::vector<HistoryRecord> query(const std::string &channel, size_t limit);
+	std::vector<HistoryRecord> recover();
+};
@@ -9,15 +9,21 @@
 #include <netdb.h>
 #include <netinet/in.h>
 #include <poll.h>
+#include <signal.h>
+#include <set>
 #include <sstream>
 #include <string>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include <vector>
 #include <cstring>
+#include <cerrno>
 #include <ctime>
 #include <fstream>
+#include <stdint.h>
 
 #include "utils.hpp"
 
@@ -67,7 +73,9 @@
 #define OPTIONAL_PCONF(prefix, x) (configs.find(#x) != configs.end() ? configs[#prefix"_"#x] : "")
 
 #define REQUIRE_CONF_NUMBER(x, type) try {conf.x = to_number<type>(configs[#x]); } catch (std::exception &e) { throw std::runtime_error(std::string(#x) + " is not a number"); }
+#define OPTIONAL_CONF_NUMBER(x, type, def) try {conf.x = configs.find(#x) != configs.end() ? to_number<type>(configs[#x]) : def; } catch (std::exception &e) { throw std::runtime_error(std::string(#x) + " is not a number"); }
 #define REQUIRE_PCONF_NUMBER(prefix, x, type) try {conf.x = to_number<type>(configs[#prefix"_"#x]); } catch (std::exception &e) { throw std::runtime_error(std::string(#x) + " is not a number"); }
+#define KEEP_CONF(x) if (conf.x != previous.x) { std::cout << GREY << "WARNING: " #x " only changes on restart" << RESET << std::endl; conf.x = previous.x; }
 
 
 
@@ -82,23 +90,46 @@ enum
 	RPL_CREATED = 3,
 	RPL_MYINFO = 4,
 	RPL_ISUPPORT = 5,
+	RPL_ENDOFSTATS = 219,
+	RPL_STATSDEBUG = 249,
+	RPL_AWAY = 301,
 	RPL_ISON = 303,
+	RPL_UNAWAY = 305,
+	RPL_NOWAWAY = 306,
+	RPL_WHOISUSER = 311,
+	RPL_WHOISSERVER = 312,
+	RPL_WHOISOPERATOR = 313,
+	RPL_WHOWASUSER = 314,
 	RPL_ENDOFWHO = 315,
+	RPL_WHOISIDLE = 317,
+	RPL_ENDOFWHOIS = 318,
+	RPL_WHOISCHANNELS = 319,
 	RPL_LISTSTART = 321,
 	RPL_LIST = 322,
 	RPL_LISTEND = 323,
 	RPL_CHANNELMODEIS = 324,
 	RPL_TOPIC = 332,
 	RPL_INVITING = 341,
+	RPL_INVITELIST = 346,
+	RPL_ENDOFINVITELIST = 347,
+	RPL_EXCEPTLIST = 348,
+	RPL_ENDOFEXCEPTLIST = 349,
 	RPL_WHOREPLY = 352,
 	RPL_NAMREPLY = 353,
 	RPL_ENDOFNAMES = 366,
+	RPL_BANLIST = 367,
+	RPL_ENDOFBANLIST = 368,
+	RPL_ENDOFWHOWAS = 369,
 	RPL_MOTD = 372,
 	RPL_STARTOFMOTD = 375,
 	RPL_ENDOFMOTD = 376,
 	RPL_YOUREOPER = 381,
 	ERR_NOSUCHNICK = 401,
 	ERR_NOSUCHCHANNEL = 403,
+	ERR_CANNOTSENDTOCHAN = 404,
+	ERR_WASNOSUCHNICK = 406,
+	ERR_TOOMANYTARGETS = 407,
+	ERR_INVALIDCAPCMD = 410,
 	ERR_UNKNOWNCOMMAND = 421,
 	ERR_ERRONEUSNICKNAME = 432,
 	ERR_NICKNAMEINUSE = 433,
@@ -112,12 +143,28 @@ enum
 	ERR_CHANNELISFULL = 471,
 	ERR_UNKNOWNMODE = 472,
 	ERR_INVITEONLYCHAN = 473,
+	ERR_BANNEDFROMCHAN = 474,
 	ERR_BADCHANNELKEY = 475,
+	ERR_BANLISTFULL = 478,
+	ERR_NOPRIVILEGES = 481,
 	ERR_CHANOPRIVSNEEDED = 482,
 	RPL_NOWOFF = 605,
+	RPL_MONONLINE = 730,
+	RPL_MONOFFLINE = 731,
+	RPL_MONLIST = 732,
+	RPL_ENDOFMONLIST = 733,
+	ERR_MONLISTFULL = 734,
 };
 
 enum {
 	OPERATOR,    
 	REGULAR
 };
+
+// IRCv3 capabilities, negotiated per connection with CAP REQ
+enum {
+	CAP_MESSAGE_TAGS = 1 << 0,
+	CAP_SERVER_TIME = 1 << 1,
+	CAP_BATCH = 1 << 2,
+	CAP_TAGS = CAP_MESSAGE_TAGS | CAP_SERVER_TIME | CAP_BATCH
+};
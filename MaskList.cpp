@@ -0,0 +1,174 @@
+#include "MaskList.hpp"
+
+#include <cctype>
+
+MaskList::MaskList() {}
+
+static std::string lowercase(const std::string &str)
+{
+	std::string folded(str);
+
+	for (size_t i = 0; i < folded.length(); i++)
+		folded[i] = std::tolower((unsigned char)folded[i]);
+	return folded;
+}
+
+static bool is_wildcard(char c)
+{
+	return c == '*' || c == '?';
+}
+
+// `nick`, `user@host` and `nick!user` are shorthands for a full mask
+std::string MaskList::normalize(const std::string &mask)
+{
+	std::string folded = lowercase(mask);
+	size_t bang = folded.find('!');
+	size_t at = folded.find('@');
+
+	if (bang == std::string::npos && at == std::string::npos)
+		return folded + "!*@*";
+	if (bang == std::string::npos)
+		return "*!" + folded;
+	if (at == std::string::npos)
+		return folded + "@*";
+	return folded;
+}
+
+// Greedy match that only ever backtracks to the last `*`, linear for the
+// masks people actually write
+bool MaskList::glob(const char *mask, const char *str)
+{
+	const char *star = NULL;
+	const char *resume = NULL;
+
+	while (*str)
+	{
+		if (*mask == '?' || (*mask == *str && *mask != '*'))
+		{
+			mask++;
+			str++;
+		}
+		else if (*mask == '*')
+		{
+			star = mask++;
+			resume = str;
+		}
+		else if (star)
+		{
+			mask = star + 1;
+			str = ++resume;
+		}
+		else
+			return false;
+	}
+	while (*mask == '*')
+		mask++;
+	return *mask == '\0';
+}
+
+size_t MaskList::insert(std::vector<Node> &trie, const std::string &key, bool reversed)
+{
+	size_t node = 0;
+
+	if (trie.empty())
+		trie.push_back(Node());
+	for (size_t i = 0; i < key.length(); i++)
+	{
+		unsigned char c = key[reversed ? key.length() - 1 - i : i];
+		std::map<unsigned char, size_t>::iterator it = trie[node].next.find(c);
+		if (it != trie[node].next.end())
+		{
+			node = it->second;
+			continue;
+		}
+		trie[node].next[c] = trie.size();
+		node = trie.size();
+		trie.push_back(Node());
+	}
+	return node;
+}
+
+void MaskList::index(size_t entry)
+{
+	const std::string &mask = entries[entry].mask;
+	size_t head = 0;
+	size_t tail = mask.length();
+
+	while (head < mask.length() && !is_wildcard(mask[head]))
+		head++;
+	while (tail > 0 && !is_wildcard(mask[tail - 1]))
+		tail--;
+	if (head > 0)
+		prefixes[insert(prefixes, mask.substr(0, head), false)].masks.push_back(entry);
+	else if (tail < mask.length())
+		suffixes[insert(suffixes, mask.substr(tail), true)].masks.push_back(entry);
+	else
+		floating.push_back(entry);
+}
+
+bool MaskList::walk(const std::vector<Node> &trie, const std::string &hostmask, bool reversed) const
+{
+	size_t node = 0;
+
+	if (trie.empty())
+		return false;
+	for (size_t i = 0; i < hostmask.length(); i++)
+	{
+		unsigned char c = hostmask[reversed ? hostmask.length() - 1 - i : i];
+		std::map<unsigned char, size_t>::const_iterator it = trie[node].next.find(c);
+		if (it == trie[node].next.end())
+			return false;
+		node = it->second;
+		const std::vector<size_t> &masks = trie[node].masks;
+		for (size_t m = 0; m < masks.size(); m++)
+			if (glob(entries[masks[m]].mask.c_str(), hostmask.c_str()))
+				return true;
+	}
+	return false;
+}
+
+// Expects a normalized mask, returns false when it is already listed
+bool MaskList::add(const std::string &mask, const std::string &setter, time_t time)
+{
+	if (!listed.insert(mask).second)
+		return false;
+	Entry entry = {mask, setter, time};
+	entries.push_back(entry);
+	index(entries.size() - 1);
+	return true;
+}
+
+// Removals are rare next to lookups, the indexes are simply rebuilt
+bool MaskList::remove(const std::string &mask)
+{
+	if (listed.erase(mask) == 0)
+		return false;
+	size_t i = 0;
+	while (entries[i].mask != mask)
+		i++;
+	entries.erase(entries.begin() + i);
+	prefixes.clear();
+	suffixes.clear();
+	floating.clear();
+	for (size_t e = 0; e < entries.size(); e++)
+		index(e);
+	return true;
+}
+
+bool MaskList::match(const std::string &hostmask) const
+{
+	if (entries.empty())
+		return false;
+
+	std::string folded = lowercase(hostmask);
+	if (walk(prefixes, folded, false) || walk(suffixes, folded, true))
+		return true;
+	for (size_t i = 0; i < floating.size(); i++)
+		if (glob(entries[floating[i]].mask.c_str(), folded.c_str()))
+			return true;
+	return false;
+}
+
+bool MaskList::empty() const { return entries.empty(); }
+size_t MaskList::size() const { return entries.size(); }
+const std::vector<MaskList::Entry> &MaskList::get_entries() const { return entries; }
@@ -0,0 +1,54 @@
+#pragma once
+
+#include "IRCserver.hpp"
+
+// A channel's ban, exception or invite exception list. Masks are kept
+// normalized to lowercase nick!user@host, `*` matching any run and `?` any
+// one character.
+//
+// Each mask is filed in a trie under the literal text it starts with, or
+// when it starts with a wildcard, in a second trie under the literal text it
+// ends with. A lookup walks the hostmask down both tries and only runs the
+// glob on the masks it meets, so a list of thousands of `*!*@host` bans costs
+// one walk of the host rather than one glob per ban. Masks with wildcards at
+// both ends are the only ones checked one by one.
+class MaskList
+{
+public:
+	typedef struct Entry
+	{
+		std::string mask;
+		std::string setter;
+		time_t time;
+	} Entry;
+
+private:
+	typedef struct Node
+	{
+		std::map<unsigned char, size_t> next;
+		std::vector<size_t> masks;
+	} Node;
+
+	std::vector<Entry> entries;
+	std::set<std::string> listed;
+	std::vector<Node> prefixes;
+	std::vector<Node> suffixes;
+	std::vector<size_t> floating;
+
+	void index(size_t entry);
+	static size_t insert(std::vector<Node> &trie, const std::string &key, bool reversed);
+	bool walk(const std::vector<Node> &trie, const std::string &hostmask, bool reversed) const;
+
+public:
+	MaskList();
+
+	static std::string normalize(const std::string &mask);
+	static bool glob(const char *mask, const char *str);
+
+	bool add(const std::string &mask, const std::string &setter, time_t time);
+	bool remove(const std::string &mask);
+	bool match(const std::string &hostmask) const;
+	bool empty() const;
+	size_t size() const;
+	const std::vector<Entry> &get_entries() const;
+};
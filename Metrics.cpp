@@ -0,0 +1,155 @@
+#include "Metrics.hpp"
+
+Histogram::Histogram() : count(0), sum(0), max(0)
+{
+	std::memset(buckets, 0, sizeof(buckets));
+}
+
+void Histogram::observe(uint64_t us)
+{
+	int idx = 0;
+
+	while (idx < BUCKETS && us > bucket_bound(idx))
+		idx++;
+	buckets[idx]++;
+	count++;
+	sum += us;
+	if (us > max)
+		max = us;
+}
+
+// Upper bound of the bucket holding the p-th percentile, in microseconds
+uint64_t Histogram::percentile(double p)
+{
+	uint64_t target = (uint64_t)(count * p);
+	uint64_t seen = 0;
+
+	if (count == 0)
+		return 0;
+	for (int i = 0; i < BUCKETS; i++)
+	{
+		seen += buckets[i];
+		if (seen > target)
+			return std::min(bucket_bound(i), max);
+	}
+	return max;
+}
+
+uint64_t Histogram::bucket_bound(int idx)
+{
+	return (uint64_t)1 << idx;
+}
+
+uint64_t &Metrics::counter(const std::string &name) { return counters[name]; }
+int64_t &Metrics::gauge(const std::string &name) { return gauges[name]; }
+Histogram &Metrics::histogram(const std::string &name) { return histograms[name]; }
+
+void Metrics::split_name(const std::string &name, std::string &base, std::string &labels)
+{
+	size_t brace = name.find('{');
+
+	base = name.substr(0, brace);
+	labels = brace == std::string::npos ? "" : name.substr(brace + 1, name.length() - brace - 2);
+}
+
+static std::string seconds(uint64_t us)
+{
+	std::stringstream ss;
+	ss << std::fixed << std::setprecision(6) << us / 1e6;
+	return ss.str();
+}
+
+std::string Metrics::render_prometheus()
+{
+	std::stringstream ss;
+	std::string base, labels, last;
+
+	for (std::map<std::string, uint64_t>::iterator it = counters.begin(); it != counters.end(); ++it)
+	{
+		split_name(it->first, base, labels);
+		if (base != last)
+			ss << "# TYPE " << base << " counter\n";
+		last = base;
+		ss << it->first << " " << it->second << "\n";
+	}
+	for (std::map<std::string, int64_t>::iterator it = gauges.begin(); it != gauges.end(); ++it)
+	{
+		split_name(it->first, base, labels);
+		if (base != last)
+			ss << "# TYPE " << base << " gauge\n";
+		last = base;
+		ss << it->first << " " << it->second << "\n";
+	}
+	for (std::map<std::string, Histogram>::iterator it = histograms.begin(); it != histograms.end(); ++it)
+	{
+		Histogram &h = it->second;
+		std::string sep;
+		uint64_t cumulative = 0;
+
+		split_name(it->first, base, labels);
+		sep = labels.empty() ? "" : ",";
+		if (base != last)
+			ss << "# TYPE " << base << " histogram\n";
+		last = base;
+		for (int i = 0; i < Histogram::BUCKETS; i++)
+		{
+			cumulative += h.buckets[i];
+			ss << base << "_bucket{" << labels << sep << "le=\"" << seconds(Histogram::bucket_bound(i)) << "\"} " << cumulative << "\n";
+		}
+		ss << base << "_bucket{" << labels << sep << "le=\"+Inf\"} " << h.count << "\n";
+		ss << base << "_sum" << (labels.empty() ? "" : "{" + labels + "}") << " " << seconds(h.sum) << "\n";
+		ss << base << "_count" << (labels.empty() ? "" : "{" + labels + "}") << " " << h.count << "\n";
+	}
+	return ss.str();
+}
+
+std::vector<std::string> Metrics::render_stats()
+{
+	std::vector<std::string> lines;
+
+	for (std::map<std::string, uint64_t>::iterator it = counters.begin(); it != counters.end(); ++it)
+		lines.push_back(it->first + " " + to_string(it->second));
+	for (std::map<std::string, int64_t>::iterator it = gauges.begin(); it != gauges.end(); ++it)
+		lines.push_back(it->first + " " + to_string(it->second));
+	for (std::map<std::string, Histogram>::iterator it = histograms.begin(); it != histograms.end(); ++it)
+	{
+		Histogram &h = it->second;
+		if (h.count == 0)
+			continue;
+		lines.push_back(it->first + " count=" + to_string(h.count) + " avg=" + to_string(h.sum / h.count) + "us p50=" + to_string(h.percentile(0.5)) + "us p99=" + to_string(h.percentile(0.99)) + "us max=" + to_string(h.max) + "us");
+	}
+	return lines;
+}
+
+SlowLog::SlowLog() : next(0), used(0) {}
+
+void SlowLog::resize(size_t capacity)
+{
+	entries.assign(capacity, SlowCommand());
+	next = 0;
+	used = 0;
+}
+
+void SlowLog::record(const SlowCommand &entry)
+{
+	if (entries.empty())
+		return;
+	entries[next] = entry;
+	next = (next + 1) % entries.size();
+	used = std::min(used + 1, entries.size());
+}
+
+static bool slower(const SlowCommand &a, const SlowCommand &b)
+{
+	return a.duration > b.duration;
+}
+
+std::vector<SlowCommand> SlowLog::worst(size_t count)
+{
+	std::vector<SlowCommand> sorted(entries.begin(), entries.begin() + used);
+
+	std::sort(sorted.begin(), sorted.end(), slower);
+	if (sorted.size() > count)
+		sorted.resize(count);
+	return sorted;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "IRCserver.hpp"
+
+// Latency histogram with power of two microsecond buckets (1us .. ~8s).
+// Anything slower lands in an extra overflow slot, which only +Inf counts.
+class Histogram
+{
+public:
+	static const int BUCKETS = 24;
+
+	uint64_t buckets[BUCKETS + 1];
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+
+	Histogram();
+
+	void observe(uint64_t us);
+	uint64_t percentile(double p);
+	static uint64_t bucket_bound(int idx);
+};
+
+// Named counters, gauges and histograms. Names may carry prometheus style
+// labels, e.g. `ircserv_messages_in_total{command="JOIN"}`. Returned
+// references stay valid for the lifetime of the registry so hot paths can
+// cache them instead of looking names up on every event.
+class Metrics
+{
+private:
+	std::map<std::string, uint64_t> counters;
+	std::map<std::string, int64_t> gauges;
+	std::map<std::string, Histogram> histograms;
+
+	static void split_name(const std::string &name, std::string &base, std::string &labels);
+
+public:
+	uint64_t &counter(const std::string &name);
+	int64_t &gauge(const std::string &name);
+	Histogram &histogram(const std::string &name);
+
+	std::string render_prometheus();
+	std::vector<std::string> render_stats();
+};
+
+typedef struct SlowCommand
+{
+	std::string command;
+	std::string nickname;
+	uint64_t duration;
+	uint64_t output_bytes;
+	time_t time;
+} SlowCommand;
+
+// Fixed size ring of commands whose handler exceeded the configured threshold
+class SlowLog
+{
+private:
+	std::vector<SlowCommand> entries;
+	size_t next;
+	size_t used;
+
+public:
+	SlowLog();
+
+	void resize(size_t capacity);
+	void record(const SlowCommand &entry);
+	std::vector<SlowCommand> worst(size_t count);
+};
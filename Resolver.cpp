@@ -0,0 +1,191 @@
+#include "Resolver.hpp"
+
+#define RESOLVER_CACHE_LIMIT 4096
+#define RESOLVER_QUEUE_LIMIT 1024
+
+Resolver::Resolver() : stopping(false), next_id(1), ttl(0)
+{
+	pipe_fds[0] = -1;
+	pipe_fds[1] = -1;
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&cond, NULL);
+}
+
+Resolver::~Resolver()
+{
+	stop();
+	pthread_cond_destroy(&cond);
+	pthread_mutex_destroy(&lock);
+}
+
+bool Resolver::start(size_t count, time_t ttl)
+{
+	this->ttl = ttl;
+	if (pipe(pipe_fds) == -1)
+		return false;
+	for (int i = 0; i < 2; i++)
+	{
+		fcntl(pipe_fds[i], F_SETFL, O_NONBLOCK);
+		fcntl(pipe_fds[i], F_SETFD, FD_CLOEXEC);
+	}
+	for (size_t i = 0; i < count; i++)
+	{
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, &Resolver::worker, this) != 0)
+			break;
+		threads.push_back(thread);
+	}
+	return !threads.empty();
+}
+
+void Resolver::stop()
+{
+	pthread_mutex_lock(&lock);
+	stopping = true;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+	for (size_t i = 0; i < threads.size(); i++)
+		pthread_join(threads[i], NULL);
+	threads.clear();
+	for (int i = 0; i < 2; i++)
+	{
+		if (pipe_fds[i] != -1)
+			close(pipe_fds[i]);
+		pipe_fds[i] = -1;
+	}
+}
+
+bool Resolver::is_running() { return !threads.empty(); }
+int Resolver::get_fd() { return pipe_fds[0]; }
+
+void *Resolver::worker(void *arg)
+{
+	static_cast<Resolver *>(arg)->work();
+	return NULL;
+}
+
+void Resolver::work()
+{
+	while (true)
+	{
+		pthread_mutex_lock(&lock);
+		while (requests.empty() && !stopping)
+			pthread_cond_wait(&cond, &lock);
+		if (stopping)
+		{
+			pthread_mutex_unlock(&lock);
+			return;
+		}
+		ResolveRequest request = requests.front();
+		requests.pop_front();
+		pthread_mutex_unlock(&lock);
+
+		char host[NI_MAXHOST];
+		ResolveResult result;
+		result.id = request.id;
+		result.ip = request.ip;
+		if (getnameinfo((sockaddr *)&request.addr, sizeof(request.addr), host, sizeof(host), NULL, 0, NI_NAMEREQD) == 0)
+			result.host = host;
+
+		pthread_mutex_lock(&lock);
+		results.push_back(result);
+		pthread_mutex_unlock(&lock);
+		char wake = 0;
+		if (write(pipe_fds[1], &wake, 1) == -1 && errno != EAGAIN)
+			std::cerr << "WARNING: resolver wakeup failed" << std::endl;
+	}
+}
+
+bool Resolver::lookup_cache(const std::string &ip, std::string &host)
+{
+	std::map<std::string, CacheEntry>::iterator it = cache.find(ip);
+
+	if (it == cache.end())
+		return false;
+	if (it->second.expires <= std::time(NULL))
+	{
+		cache.erase(it);
+		return false;
+	}
+	host = it->second.host;
+	return true;
+}
+
+// Returns the id of the lookup that will answer for ip, joining one already
+// in flight, or 0 when the queue is full and the caller should keep the
+// numeric address
+uint64_t Resolver::submit(const sockaddr_in &addr, const std::string &ip)
+{
+	std::map<std::string, uint64_t>::iterator it = in_flight.find(ip);
+	ResolveRequest request;
+
+	if (it != in_flight.end())
+		return it->second;
+	request.addr = addr;
+	request.ip = ip;
+	pthread_mutex_lock(&lock);
+	if (requests.size() >= RESOLVER_QUEUE_LIMIT)
+	{
+		pthread_mutex_unlock(&lock);
+		return 0;
+	}
+	request.id = next_id++;
+	requests.push_back(request);
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+	in_flight[ip] = request.id;
+	return request.id;
+}
+
+// Drops a lookup nobody waits for anymore. One a worker already picked up
+// still finishes and only fills the cache.
+void Resolver::cancel(uint64_t id)
+{
+	pthread_mutex_lock(&lock);
+	for (std::deque<ResolveRequest>::iterator it = requests.begin(); it != requests.end(); ++it)
+	{
+		if (it->id == id)
+		{
+			requests.erase(it);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&lock);
+	for (std::map<std::string, uint64_t>::iterator it = in_flight.begin(); it != in_flight.end(); ++it)
+	{
+		if (it->second == id)
+		{
+			in_flight.erase(it);
+			break;
+		}
+	}
+}
+
+// Drains the wakeup pipe and returns every finished lookup, caching the answers
+std::vector<ResolveResult> Resolver::collect()
+{
+	char buffer[256];
+	std::vector<ResolveResult> done;
+
+	while (read(pipe_fds[0], buffer, sizeof(buffer)) > 0)
+		;
+	pthread_mutex_lock(&lock);
+	done.assign(results.begin(), results.end());
+	results.clear();
+	pthread_mutex_unlock(&lock);
+
+	if (cache.size() > RESOLVER_CACHE_LIMIT)
+		cache.clear();
+	for (size_t i = 0; i < done.size(); i++)
+	{
+		std::map<std::string, uint64_t>::iterator it = in_flight.find(done[i].ip);
+		if (it != in_flight.end() && it->second == done[i].id)
+			in_flight.erase(it);
+
+		CacheEntry entry;
+		entry.host = done[i].host;
+		entry.expires = std::time(NULL) + ttl;
+		cache[done[i].ip] = entry;
+	}
+	return done;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "IRCserver.hpp"
+
+#include <deque>
+#include <pthread.h>
+
+typedef struct ResolveRequest
+{
+	uint64_t id;
+	sockaddr_in addr;
+	std::string ip;
+} ResolveRequest;
+
+typedef struct ResolveResult
+{
+	uint64_t id;
+	std::string ip;
+	std::string host;
+} ResolveResult;
+
+// Reverse DNS lookups on a small pool of worker threads. The event loop
+// submits requests and polls get_fd(), which becomes readable whenever
+// results are waiting to be collected. A lookup already in flight for the
+// same address is shared rather than queued twice, and the queue is bounded
+// so a connect flood cannot grow it without limit. The cache and the in
+// flight map are only touched by the event loop thread.
+class Resolver
+{
+private:
+	typedef struct CacheEntry
+	{
+		std::string host;
+		time_t expires;
+	} CacheEntry;
+
+	std::vector<pthread_t> threads;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	std::deque<ResolveRequest> requests;
+	std::deque<ResolveResult> results;
+	bool stopping;
+	int pipe_fds[2];
+	uint64_t next_id;
+	std::map<std::string, CacheEntry> cache;
+	std::map<std::string, uint64_t> in_flight;
+	time_t ttl;
+
+	static void *worker(void *arg);
+	void work();
+
+public:
+	Resolver();
+	~Resolver();
+
+	bool start(size_t count, time_t ttl);
+	void stop();
+	bool is_running();
+	int get_fd();
+
+	bool lookup_cache(const std::string &ip, std::string &host);
+	uint64_t submit(const sockaddr_in &addr, const std::string &ip);
+	void cancel(uint64_t id);
+	std::vector<ResolveResult> collect();
+};
@@ -11,6 +11,7 @@ CommandInfo Server::commands[] = {
 	{"JOIN", &Server::JOIN, true},
 	{"WHO", &Server::WHO, true},
 	{"PRIVMSG", &Server::PRIVMSG, true},
+	{"NOTICE", &Server::NOTICE, true},
 	{"ISON", &Server::ISON, true},
 	{"PART", &Server::PART, true},
 	{"PING", &Server::PING, true},
@@ -19,7 +20,16 @@ CommandInfo Server::commands[] = {
 	{"INVITE", &Server::INVITE, true},
 	{"TOPIC", &Server::TOPIC, true},
 	{"MODE", &Server::MODE, true},
-	{"CAP", &Server::IGNORED, false},
+	{"HISTORY", &Server::HISTORY, true},
+	{"STATS", &Server::STATS, true},
+	{"SLOWLOG", &Server::SLOWLOG, true},
+	{"TAGMSG", &Server::TAGMSG, true},
+	{"MONITOR", &Server::MONITOR, true},
+	{"FILTER", &Server::FILTER, true},
+	{"WHOIS", &Server::WHOIS, true},
+	{"WHOWAS", &Server::WHOWAS, true},
+	{"AWAY", &Server::AWAY, true},
+	{"CAP", &Server::CAP, false},
 	{"PROCTL", &Server::IGNORED, false},
 	{"PONG", &Server::IGNORED, false},
 };
@@ -58,7 +68,8 @@ bool Server::load_config_channel(std::ifstream &file)
 	}
 	if (name.empty())
 		return false;
-	create_channel(name, key, topic);
+	ChannelConfig channel = {name, key, topic};
+	conf.channels.push_back(channel);
 	return true;
 }
 
@@ -143,7 +154,7 @@ bool Server::verify_server_name()
 
 	std::vector<std::string> splits = split(str, '.', false);
 
-	if (str.back() == '.')
+	if (str[str.length() - 1] == '.')
 		return false;
 
 	if (splits.size() == 0)
@@ -162,12 +173,9 @@ bool Server::verify_server_name()
 }
 
 
-Server::Server(const std::string &port, const std::string &pass) : running(true), repoll(false), info(NULL)
+// Fills conf from the parsed configs map and validates it, throws on any invalid value
+void Server::configure()
 {
-	insist(load_config("irc.yaml"), false, "failed to load config");
-
-	conf.password = pass;
-	conf.port = to_number_safe<int>(port);
 	REQUIRE_PCONF(server, name);
 	REQUIRE_CONF(operator_username);
 	REQUIRE_CONF(operator_password);
@@ -183,6 +191,40 @@ Server::Server(const std::string &port, const std::string &pass) : running(true)
 	REQUIRE_CONF(bot.username);
 	REQUIRE_CONF(bot.realname);
 	REQUIRE_CONF_NUMBER(bot.fd, int);
+	OPTIONAL_CONF_NUMBER(bot.thread, int, 0);
+
+	conf.history_dir = OPTIONAL_CONF(history_dir);
+	OPTIONAL_CONF_NUMBER(history_segment_size, size_t, 16 * 1024 * 1024);
+	OPTIONAL_CONF_NUMBER(history_retention, time_t, 7 * 24 * 60 * 60);
+	OPTIONAL_CONF_NUMBER(metrics_port, int, 0);
+	OPTIONAL_CONF_NUMBER(slow_command_threshold, uint64_t, 10000);
+	OPTIONAL_CONF_NUMBER(slow_command_log_size, size_t, 128);
+	conf.capture_file = OPTIONAL_CONF(capture_file);
+	OPTIONAL_CONF_NUMBER(dns_threads, size_t, 2);
+	OPTIONAL_CONF_NUMBER(dns_timeout, time_t, 5);
+	OPTIONAL_CONF_NUMBER(dns_cache_ttl, time_t, 3600);
+	OPTIONAL_CONF_NUMBER(dns_wait_registration, int, 0);
+	OPTIONAL_CONF_NUMBER(listen_backlog, int, 69);
+	OPTIONAL_CONF_NUMBER(accept_budget, size_t, 64);
+	OPTIONAL_CONF_NUMBER(max_connections, size_t, 0);
+	OPTIONAL_CONF_NUMBER(max_connections_per_ip, size_t, 0);
+	conf.link_password = OPTIONAL_CONF(link_password);
+	OPTIONAL_CONF_NUMBER(link_port, int, 0);
+	conf.link_connect = OPTIONAL_CONF(link_connect);
+	OPTIONAL_CONF_NUMBER(link_retry, time_t, 10);
+	conf.snapshot_file = OPTIONAL_CONF(snapshot_file);
+	OPTIONAL_CONF_NUMBER(snapshot_interval, time_t, 300);
+	OPTIONAL_CONF_NUMBER(snapshot_claim_timeout, time_t, 300);
+	OPTIONAL_CONF_NUMBER(shards, size_t, 0);
+	conf.services = OPTIONAL_CONF(services);
+	OPTIONAL_CONF_NUMBER(tls_port, int, 0);
+	conf.tls_certificate = OPTIONAL_CONF(tls_certificate);
+	conf.tls_key = OPTIONAL_CONF(tls_key);
+	OPTIONAL_CONF_NUMBER(monitor_limit, size_t, 100);
+	OPTIONAL_CONF_NUMBER(max_targets, size_t, 4);
+	OPTIONAL_CONF_NUMBER(max_channel_masks, size_t, 1000);
+	OPTIONAL_CONF_NUMBER(whowas_size, size_t, 1000);
+	OPTIONAL_CONF_NUMBER(command_budget, size_t, 16);
 
 	insist(verify_server_name(), false, "invalid server name");
 	insist(verify_string(conf.password, KEY), false, "invalid password");
@@ -194,6 +236,148 @@ Server::Server(const std::string &port, const std::string &pass) : running(true)
 	insist(conf.bot.fd < 0, false, "invalid bot fd");
 	insist(conf.channel_creation == 0 || conf.channel_creation == 1, false, "invalid channel creation mode");
 	insist(conf.port > 0, false, "invalid port");
+	insist(conf.history_segment_size > 0, false, "invalid history segment size");
+	insist(conf.metrics_port >= 0 && conf.metrics_port != conf.port, false, "invalid metrics port");
+	insist(conf.dns_wait_registration == 0 || conf.dns_wait_registration == 1, false, "invalid dns wait registration mode");
+	insist(conf.listen_backlog > 0, false, "invalid listen backlog");
+	insist(conf.accept_budget > 0, false, "invalid accept budget");
+	insist(verify_string(conf.link_password, KEY), false, "invalid link password");
+	insist(conf.link_port >= 0 && conf.link_port != conf.port && (conf.link_port == 0 || conf.link_port != conf.metrics_port), false, "invalid link port");
+	insist(conf.link_retry > 0, false, "invalid link retry");
+	insist(conf.snapshot_interval > 0, false, "invalid snapshot interval");
+	insist(conf.snapshot_claim_timeout >= 0, false, "invalid snapshot claim timeout");
+	insist(conf.shards <= 64, false, "invalid shard count");
+	insist(conf.tls_port >= 0 && conf.tls_port != conf.port && (conf.tls_port == 0 || (conf.tls_port != conf.metrics_port && conf.tls_port != conf.link_port)), false, "invalid tls port");
+	insist(conf.tls_port == 0 || (!conf.tls_certificate.empty() && !conf.tls_key.empty()), false, "tls_port needs tls_certificate and tls_key");
+	insist(conf.max_targets > 0, false, "invalid max targets");
+	insist(conf.command_budget > 0, false, "invalid command budget");
+	for (size_t i = 0; i < conf.channels.size(); i++)
+	{
+		insist(verify_string(conf.channels[i].name, CHANNEL) && conf.channels[i].name.length() <= 50, false, "invalid channel name");
+		insist(verify_string(conf.channels[i].key, KEY) && conf.channels[i].key.length() <= 23, false, "invalid channel key");
+	}
+}
+
+// Returns the names of the channels that did not exist yet
+std::vector<std::string> Server::create_configured_channels()
+{
+	std::vector<std::string> created;
+
+	for (size_t i = 0; i < conf.channels.size(); i++)
+	{
+		if (channels.find(conf.channels[i].name) != channels.end())
+			continue;
+		create_channel(conf.channels[i].name, conf.channels[i].key, conf.channels[i].topic);
+		created.push_back(conf.channels[i].name);
+	}
+	return created;
+}
+
+// Re-reads irc.yaml on SIGHUP. The new values are validated as a whole and the
+// previous configuration is put back if anything is wrong with them. Settings
+// bound to sockets, files or threads opened at startup keep their old value.
+void Server::reload_config()
+{
+	Config previous = conf;
+	std::map<std::string, std::string> previous_configs = configs;
+
+	configs.clear();
+	conf.motd.clear();
+	conf.channels.clear();
+	try
+	{
+		insist(load_config("irc.yaml"), false, "failed to load config");
+		configure();
+	}
+	catch (std::exception &e)
+	{
+		std::cout << GREY << "WARNING: config reload failed: " << e.what() << RESET << std::endl;
+		conf = previous;
+		configs = previous_configs;
+		return;
+	}
+	// Linked servers and clients know the server by its name
+	KEEP_CONF(name);
+	KEEP_CONF(bot.nickname);
+	KEEP_CONF(bot.username);
+	KEEP_CONF(bot.realname);
+	KEEP_CONF(bot.fd);
+	KEEP_CONF(bot.thread);
+	KEEP_CONF(history_dir);
+	KEEP_CONF(history_segment_size);
+	KEEP_CONF(history_retention);
+	KEEP_CONF(metrics_port);
+	KEEP_CONF(capture_file);
+	KEEP_CONF(dns_threads);
+	KEEP_CONF(dns_cache_ttl);
+	KEEP_CONF(listen_backlog);
+	KEEP_CONF(link_port);
+	KEEP_CONF(shards);
+	KEEP_CONF(services);
+	KEEP_CONF(tls_port);
+	KEEP_CONF(tls_certificate);
+	KEEP_CONF(tls_key);
+	if (conf.slow_command_log_size != previous.slow_command_log_size)
+		slow_commands.resize(conf.slow_command_log_size);
+	if (conf.whowas_size != previous.whowas_size)
+		whowas.resize(conf.whowas_size);
+
+	prerender_welcome();
+
+	// The bot only joins the configured channels this reload created, not the
+	// ones users made or kicked it from
+	std::vector<std::string> created = create_configured_channels();
+	for (size_t i = 0; i < created.size() && users.find(conf.bot.fd) != users.end(); i++)
+	{
+		Channel &channel = channels[created[i]];
+		User *bot_user = users[conf.bot.fd];
+		channel.add_user(conf.bot.fd, bot_user, channel.get_key());
+		channel.add_operator(bot_user);
+		broadcast_message(channel, ":" + bot_user->get_hostmask(bot_user->get_nick()) + " JOIN :" + channel.get_name(), bot_user);
+	}
+	std::cout << "Configuration reloaded, " << created.size() << " new channels" << std::endl;
+}
+
+// A detached server loads its configuration but opens no sockets, connections
+// are then attached by the caller with add_connection (benchmarks, replay) or
+// adopted from the previous process with adopt_handoff (hot restart)
+Server::Server(const std::string &port, const std::string &pass, bool detached) : running(true), repoll(false), info(NULL), signal_fd(-1), link_fd(-1), current_link(-1), next_remote_id(-1000), link_retry_at(0), current_line(NULL), metrics_fd(-1)
+{
+	tls_fd = -1;
+	batch_sequence = 0;
+	reset_tags();
+	insist(load_config("irc.yaml"), false, "failed to load config");
+
+	conf.password = pass;
+	conf.port = to_number_safe<int>(port);
+	configure();
+	if (!conf.snapshot_file.empty())
+		load_snapshot(conf.snapshot_file);
+	snapshot_at = std::time(NULL) + conf.snapshot_interval;
+	saved_claims_until = std::time(NULL) + conf.snapshot_claim_timeout;
+	create_configured_channels();
+	prerender_welcome();
+
+	init_metrics();
+	slow_commands.resize(conf.slow_command_log_size);
+	whowas.resize(conf.whowas_size);
+	load_services();
+	if (conf.tls_port > 0)
+	{
+		std::string error;
+		bool ok = tls.init(conf.tls_certificate, conf.tls_key, error);
+		insist(ok, false, "failed to set up TLS: " + error);
+	}
+
+	if (!conf.history_dir.empty())
+	{
+		insist(history.open(conf.history_dir, conf.history_segment_size, conf.history_retention), false, "failed to open history");
+		recover_history();
+	}
+
+	server_fd = -1;
+	if (detached)
+		return;
 
 	int on = 1;
 
@@ -203,22 +387,79 @@ Server::Server(const std::string &port, const std::string &pass) : running(true)
 	addr.sin_addr.s_addr = INADDR_ANY;
 	addr.sin_port = htons(conf.port);
 
-	insist(server_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP), -1, "socket failed");
+	insist(server_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP), -1, "socket failed");
 	insist(setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, (char *)&on, sizeof(int)), -1, "setsockopt failed");
 	insist(fcntl(server_fd, F_SETFL, O_NONBLOCK), -1, "fcntl failed");
 	insist(bind(server_fd, (sockaddr *)&addr, sizeof(addr)) != 0, true, "bind failed");
-	insist(listen(server_fd, 69), -1, "listen failed");
+	insist(listen(server_fd, conf.listen_backlog), -1, "listen failed");
 
 	pfds.push_back(make_pfd(server_fd, POLLIN, 0));
+
+	start_services();
+}
+
+// Everything besides the client listener, signals are blocked before the
+// resolver threads start so that they inherit the mask
+void Server::start_services()
+{
+	open_signal_fd();
+	if (conf.metrics_port > 0 && metrics_fd == -1)
+		open_metrics_listener();
+	if (conf.link_port > 0 && !conf.link_password.empty() && link_fd == -1)
+		open_link_listener();
+	if (conf.tls_port > 0 && tls_fd == -1)
+		open_tls_listener();
+	if (conf.shards > 0)
+		start_shards();
+	if (!conf.capture_file.empty())
+		insist(capture.open(conf.capture_file), false, "failed to open capture file");
+	if (conf.dns_threads > 0)
+	{
+		insist(resolver.start(conf.dns_threads, conf.dns_cache_ttl), false, "failed to start resolver");
+		pfds.push_back(make_pfd(resolver.get_fd(), POLLIN, 0));
+	}
+	if (conf.bot.thread && users.find(conf.bot.fd) != users.end())
+	{
+		insist(bot.start(), false, "failed to start bot thread");
+		pfds.push_back(make_pfd(bot.get_fd(), POLLIN, 0));
+	}
+}
+// Workers learn the memberships that already exist, only non-empty after a hot restart
+void Server::start_shards()
+{
+	insist(shards.start(conf.shards, pfds), false, "failed to start shard workers");
+	for (ChannelList::iterator it = channels.begin(); it != channels.end(); ++it)
+		for (UserList::iterator uit = it->second.get_users().begin(); uit != it->second.get_users().end(); ++uit)
+			if (uit->first >= 0 && !uit->second->is_remote() && is_shardable(uit->first))
+				shard_join(it->second.get_name(), uit->first);
+	shards.notify();
+	std::cout << "Started " << shards.size() << " shard workers" << std::endl;
 }
+
 Server::~Server()
 {
 	if (info)
 		freeaddrinfo(info);
+	if (signal_fd != -1)
+		close(signal_fd);
+	if (link_fd != -1)
+		close(link_fd);
+	for (std::map<int, Link>::iterator it = links.begin(); it != links.end(); ++it)
+		close(it->first);
+	if (metrics_fd != -1)
+		close(metrics_fd);
+	if (tls_fd != -1)
+		close(tls_fd);
+	for (std::map<int, std::string>::iterator it = metrics_clients.begin(); it != metrics_clients.end(); ++it)
+		close(it->first);
 	for (UserList::iterator it = users.begin(); it != users.end(); ++it)
 		delete it->second;
 }
 
+UserList &Server::get_users() { return users; }
+Server::ChannelList &Server::get_channels() { return channels; }
+void Server::set_executable(const std::string &path) { executable = path; }
+
 void Server::create_channel(const std::string &name, const std::string &key, const std::string &topic)
 {
 	insist(verify_string(name, CHANNEL) && name.length() <= 50, false, "invalid channel name");
@@ -231,49 +472,143 @@ void Server::run()
 {
 	while (running)
 	{
-		insist(poll(&pfds[0], pfds.size(), -1), -1, "poll failed");
-		for (size_t i = 0; i < pfds.size(); i++) {
+		insist(poll(&pfds[0], pfds.size(), poll_timeout()), -1, "poll failed");
+		uint64_t start = monotonic_us();
+		for (size_t i = 0; running && i < pfds.size(); i++) {
 			repoll = false;
 			process_events(pfds[i].fd, pfds[i].revents);
 			if (repoll)
 				i--;
 		}
-		if (conf.bot.fd < 0)
-		{
-			if (bot_parse())
-				parse_data(conf.bot.fd);
-		}
+		if (running)
+			process_input();
+		if (!running)
+			break;
+		tick();
+		loop_latency->observe(monotonic_us() - start);
+	}
+}
+
+// Work deferred to the end of every event loop iteration
+void Server::tick()
+{
+	if (!bot_replies.empty())
+		flush_bot_replies();
+	reset_tags();
+	history.flush();
+	capture.flush();
+	expire_dns_lookups();
+	check_links();
+	flush_links();
+	if (shards.is_running() && !shards.check())
+	{
+		std::cout << GREY << "WARNING: shard worker exited, fanning out channels locally" << RESET << std::endl;
+		stop_shards();
+	}
+	shards.notify();
+	if (saved_claims_until != 0 && std::time(NULL) >= saved_claims_until)
+	{
+		saved_claims_until = 0;
+		for (ChannelList::iterator it = channels.begin(); it != channels.end(); ++it)
+			it->second.forget_saved();
 	}
+	if (!conf.snapshot_file.empty() && std::time(NULL) >= snapshot_at)
+	{
+		snapshot_at = std::time(NULL) + conf.snapshot_interval;
+		save_snapshot(conf.snapshot_file);
+	}
+}
+
+// Blocks indefinitely unless a pending deadline needs the loop to wake up
+int Server::poll_timeout()
+{
+	if (!input_queue.empty())
+		return 0;
+	// Membership records waiting for room in a worker's ring
+	if (shards.is_backlogged())
+		return 10;
+	if (!dns_lookups.empty() || !links.empty() || !conf.link_connect.empty() || !conf.snapshot_file.empty())
+		return 1000;
+	return -1;
 }
 
-void Server::accept_connections()
+// Accepts at most accept_budget connections per loop iteration, whatever is
+// left in the backlog keeps the listening socket readable for the next one.
+// Connections from the TLS listener start their handshake on the next event.
+void Server::accept_connections(int listener)
 {
 	int new_fd = 0;
 
-	while (true)
+	for (size_t accepted = 0; accepted < conf.accept_budget; accepted++)
 	{
 		sockaddr addr;
 		socklen_t len = sizeof(addr);
 
-		new_fd = accept(server_fd, &addr, &len);
+		new_fd = accept4(listener, &addr, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
 		if (new_fd == -1)
 			break;
-		fcntl(new_fd, F_SETFL, O_NONBLOCK);
+		if (listener == tls_fd && !tls.attach(new_fd))
+		{
+			close(new_fd);
+			continue;
+		}
+		if (!admit_connection(new_fd, addr))
+			continue;
 		pfds.push_back(make_pfd(new_fd, POLLIN | POLLOUT, 0));
-		users[new_fd] = new User();
-		users[new_fd]->set_fd(new_fd);
-		users[new_fd]->set_host(addr);
-		if (conf.password.empty())
-			users[new_fd]->set_auth(true);
+		add_connection(new_fd, addr);
 		std::cout << "Connection accepted on fd " << new_fd << std::endl;
 	}
 }
 
-void Server::receive_data(int fd)
+bool Server::admit_connection(int fd, sockaddr &addr)
+{
+	uint32_t address = ((sockaddr_in *)&addr)->sin_addr.s_addr;
+	std::string reason;
+
+	if (conf.max_connections > 0 && connections_per_ip.get_total() >= conf.max_connections)
+		reason = "Server is full";
+	else if (conf.max_connections_per_ip > 0 && connections_per_ip.get(address) >= conf.max_connections_per_ip)
+		reason = "Too many connections from your host";
+	if (reason.empty())
+		return true;
+
+	// No handshake has happened yet, a TLS client just sees the connection close
+	std::string error = "ERROR :Closing Link: " + reason + "\r\n";
+	if (!tls.is_tls(fd))
+		send(fd, error.c_str(), error.length(), MSG_DONTWAIT | MSG_NOSIGNAL);
+	tls.detach(fd);
+	close(fd);
+	(*connections_rejected)++;
+	std::cout << GREY << "Connection rejected on fd " << fd << ": " << reason << RESET << std::endl;
+	return false;
+}
+
+User *Server::add_connection(int fd, sockaddr &addr)
+{
+	User *user = new User();
+
+	users[fd] = user;
+	user->set_fd(fd);
+	user->set_address(((sockaddr_in *)&addr)->sin_addr.s_addr);
+	connections_per_ip.increment(user->get_address());
+	resolve_host(user, addr);
+	capture.record(CAPTURE_CONNECT, fd, inet_ntoa(((sockaddr_in *)&addr)->sin_addr));
+	if (conf.password.empty())
+		user->set_auth(true);
+	(*connections_total)++;
+	return user;
+}
+
+// Returns false once a TLS connection is closed or broken, plain connections
+// are torn down when poll reports the hangup
+bool Server::receive_data(int fd)
 {
+	if (tls.is_tls(fd))
+		return receive_tls(fd);
+
 	char buffer[1024];
 	int length;
-	while (true)
+	while (users[fd]->get_data().length() < conf.command_budget * conf.max_message_length)
 	{
 		length = recv(fd, buffer, sizeof(buffer) - 1, 0);
 		if (length <= 0)
@@ -283,16 +618,199 @@ void Server::receive_data(int fd)
 		users[fd]->append_data(std::string(buffer));
 		users[fd]->set_last_activity();
 	}
+	return true;
 }
 
-void Server::welcome(int fd)
+// Plain sockets get a single send and the rest is dropped, over TLS whatever
+// the record layer did not take stays queued for the next POLLOUT
+bool Server::flush_sendbuffer(int fd)
+{
+	std::string &buffer = users[fd]->get_sendbuffer();
+
+	if (!tls.is_tls(fd))
+	{
+		send(fd, buffer.c_str(), buffer.length(), MSG_NOSIGNAL);
+		users[fd]->clear_sendbuffer();
+		return true;
+	}
+	if (!tls.is_ready(fd))
+		return true;
+	ssize_t sent = tls.write(fd, buffer.c_str(), buffer.length());
+	if (sent > 0)
+		buffer.erase(0, sent);
+	return sent != 0;
+}
+
+static void push_welcome(std::vector<WelcomeSegment> &burst, int type, const std::string &text = "")
+{
+	if (type == WELCOME_LITERAL && !burst.empty() && burst.back().type == WELCOME_LITERAL)
+	{
+		burst.back().text += text;
+		return;
+	}
+	WelcomeSegment segment = {type, text};
+	burst.push_back(segment);
+}
+
+// Called after every config load, the MOTD and server name are baked in
+void Server::prerender_welcome()
 {
-	send_message(fd, ":" + conf.name + " " + c(RPL_WELCOME) + " " + users[fd]->get_nick() + " :kys " + users[fd]->get_nick() + "!" + users[fd]->get_user() + "@" + conf.name);
-	send_message(fd, ":" + conf.name + " " + c(RPL_ISUPPORT) + " " + users[fd]->get_nick() + " CHANMODES=k,l,it :are supported by this server");
-	send_message(fd, ":" + conf.name + " " + c(RPL_STARTOFMOTD) + " " + users[fd]->get_user() + " :- " + conf.name + " Message of the Day -");
+	std::string prefix = ":" + conf.name + " ";
+
+	welcome_burst.clear();
+	push_welcome(welcome_burst, WELCOME_LITERAL, prefix + c(RPL_WELCOME) + " ");
+	push_welcome(welcome_burst, WELCOME_NICK);
+	push_welcome(welcome_burst, WELCOME_LITERAL, " :kys ");
+	push_welcome(welcome_burst, WELCOME_NICK);
+	push_welcome(welcome_burst, WELCOME_LITERAL, "!");
+	push_welcome(welcome_burst, WELCOME_USER);
+	push_welcome(welcome_burst, WELCOME_LITERAL, "@" + conf.name + "\r\n");
+	push_welcome(welcome_burst, WELCOME_LITERAL, prefix + c(RPL_ISUPPORT) + " ");
+	push_welcome(welcome_burst, WELCOME_NICK);
+	push_welcome(welcome_burst, WELCOME_LITERAL, " CHANMODES=beI,k,l,it EXCEPTS INVEX MAXLIST=beI:" + to_string(conf.max_channel_masks) + " MONITOR=" + to_string(conf.monitor_limit) + " TARGMAX=PRIVMSG:" + to_string(conf.max_targets) + ",NOTICE:" + to_string(conf.max_targets) + ",TAGMSG:" + to_string(conf.max_targets) + " :are supported by this server\r\n");
+	push_welcome(welcome_burst, WELCOME_LITERAL, prefix + c(RPL_STARTOFMOTD) + " ");
+	push_welcome(welcome_burst, WELCOME_USER);
+	push_welcome(welcome_burst, WELCOME_LITERAL, " :- " + conf.name + " Message of the Day -\r\n");
 	for (size_t i = 0; i < conf.motd.size(); i++)
-		send_message(fd, ":" + conf.name + " " + c(RPL_MOTD) + " " + users[fd]->get_nick() + " :- " + conf.motd[i]);
-	send_message(fd, ":" + conf.name + " " + c(RPL_ENDOFMOTD) + " " + users[fd]->get_user() + " :End of /MOTD command.");
+	{
+		push_welcome(welcome_burst, WELCOME_LITERAL, prefix + c(RPL_MOTD) + " ");
+		push_welcome(welcome_burst, WELCOME_NICK);
+		push_welcome(welcome_burst, WELCOME_LITERAL, " :- " + conf.motd[i] + "\r\n");
+	}
+	push_welcome(welcome_burst, WELCOME_LITERAL, prefix + c(RPL_ENDOFMOTD) + " ");
+	push_welcome(welcome_burst, WELCOME_USER);
+	push_welcome(welcome_burst, WELCOME_LITERAL, " :End of /MOTD command.\r\n");
+	welcome_lines = conf.motd.size() + 4;
+}
+
+void Server::welcome(int fd)
+{
+	User *user = users[fd];
+	size_t length = 0;
+
+	for (size_t i = 0; i < welcome_burst.size(); i++)
+		length += welcome_burst[i].type == WELCOME_LITERAL ? welcome_burst[i].text.length() : 16;
+	std::string burst;
+	burst.reserve(length);
+	for (size_t i = 0; i < welcome_burst.size(); i++)
+	{
+		if (welcome_burst[i].type == WELCOME_NICK)
+			burst += user->get_nick();
+		else if (welcome_burst[i].type == WELCOME_USER)
+			burst += user->get_user();
+		else
+			burst += welcome_burst[i].text;
+	}
+	std::cout << GREEN << "Sending to " << RESET << fd << GREEN ": " RESET << welcome_lines << " line welcome burst" << std::endl;
+	enqueue(user, burst, welcome_lines);
+	if (!links.empty())
+		propagate(uid_line(user));
+	notify_watchers(user, true);
+}
+
+// Holds the welcome burst, and any further input, until the hostname is
+// known. A client negotiating capabilities is welcomed on CAP END instead.
+void Server::complete_registration(int fd)
+{
+	if (users[fd]->is_negotiating())
+		return;
+	if (conf.dns_wait_registration && dns_lookups.find(fd) != dns_lookups.end())
+		users[fd]->set_welcome_pending(true);
+	else
+		welcome(fd);
+}
+
+void Server::resolve_host(User *user, sockaddr &addr)
+{
+	std::string ip = inet_ntoa(((sockaddr_in *)&addr)->sin_addr);
+	std::string host;
+
+	if (!resolver.is_running())
+	{
+		user->set_host(addr);
+		return;
+	}
+	user->set_host(ip);
+	if (resolver.lookup_cache(ip, host))
+	{
+		if (!host.empty())
+			user->set_host(host);
+		return;
+	}
+	DnsLookup lookup;
+	lookup.id = resolver.submit(*(sockaddr_in *)&addr, ip);
+	if (lookup.id == 0)
+		return;
+	lookup.deadline = std::time(NULL) + conf.dns_timeout;
+	dns_lookups[user->get_fd()] = lookup;
+	dns_lookup_fds[lookup.id].insert(user->get_fd());
+}
+
+void Server::collect_dns_results()
+{
+	std::vector<ResolveResult> results = resolver.collect();
+
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		std::map<uint64_t, std::set<int> >::iterator it = dns_lookup_fds.find(results[i].id);
+		if (it == dns_lookup_fds.end())
+			continue;
+		std::set<int> fds = it->second;
+		dns_lookup_fds.erase(it);
+		for (std::set<int>::iterator fd = fds.begin(); fd != fds.end(); ++fd)
+			finish_dns_lookup(*fd, results[i].host);
+	}
+}
+
+void Server::expire_dns_lookups()
+{
+	time_t now = std::time(NULL);
+	std::vector<int> expired;
+
+	for (std::map<int, DnsLookup>::iterator it = dns_lookups.begin(); it != dns_lookups.end(); ++it)
+		if (it->second.deadline <= now)
+			expired.push_back(it->first);
+	for (size_t i = 0; i < expired.size(); i++)
+		finish_dns_lookup(expired[i], "");
+}
+
+void Server::finish_dns_lookup(int fd, const std::string &host)
+{
+	if (dns_lookups.find(fd) == dns_lookups.end())
+		return;
+	forget_dns_lookup(fd);
+	if (users.find(fd) == users.end())
+		return;
+
+	User *user = users[fd];
+	if (!host.empty())
+		user->set_host(host);
+	if (user->get_welcome_pending())
+	{
+		user->set_welcome_pending(false);
+		welcome(fd);
+		parse_data(fd);
+	}
+}
+
+// Detaches fd from its lookup, cancelling the lookup once nobody waits on it
+void Server::forget_dns_lookup(int fd)
+{
+	std::map<int, DnsLookup>::iterator lookup = dns_lookups.find(fd);
+
+	if (lookup == dns_lookups.end())
+		return;
+	std::map<uint64_t, std::set<int> >::iterator waiting = dns_lookup_fds.find(lookup->second.id);
+	if (waiting != dns_lookup_fds.end())
+	{
+		waiting->second.erase(fd);
+		if (waiting->second.empty())
+		{
+			resolver.cancel(waiting->first);
+			dns_lookup_fds.erase(waiting);
+		}
+	}
+	dns_lookups.erase(lookup);
 }
 
 void Server::PASS(int fd, User *user, std::vector<std::string> &args)
@@ -323,7 +841,7 @@ void Server::USER(int fd, User *user, std::vector<std::string> &args)
 	user->set_user(username);
 	user->set_real(realname);
 	if (user->get_registered())
-		welcome(fd);
+		complete_registration(fd);
 	return;
 }
 
@@ -342,7 +860,8 @@ void Server::NICK(int fd, User *user, std::vector<std::string> &args)
 		return;
 	}
 
-	if (find_user_by_nickname(nickname) != NULL)
+	User *owner = find_user_by_nickname(nickname);
+	if (owner != NULL && owner != user)
 	{
 		send_message(fd, ":" + conf.name + " " + c(ERR_NICKNAMEINUSE) + " " + nickname + " :" + nickname + " is already in use");
 		return;
@@ -350,14 +869,25 @@ void Server::NICK(int fd, User *user, std::vector<std::string> &args)
 
 	if (user->get_registered())
 	{
+		std::string previous = user->get_nick();
 		broadcast_user_channels(fd, ":" + user->get_hostmask(user->get_nick()) + " NICK :" + nickname);
-		user->set_nick(nickname);
+		bool online = is_online(user);
+		if (online)
+		{
+			notify_watchers(user, false);
+			remember_nickname(user);
+		}
+		set_nickname(user, nickname);
+		if (!links.empty() && is_linked_user(user))
+			propagate("NICK " + previous + " " + nickname + " " + to_string(user->get_nick_time()));
+		if (online)
+			notify_watchers(user, true);
 		return ;
 	}
-	user->set_nick(nickname);
+	set_nickname(user, nickname);
 	user->set_registered(true);
 	if (user->get_user() != "")
-		welcome(fd);
+		complete_registration(fd);
 }
 
 void Server::LIST(int fd, User *user, std::vector<std::string> &args)
@@ -410,25 +940,38 @@ void Server::JOIN(int fd, User *user, std::vector<std::string> &args)
 				&& verify_string(channel_key, KEY) && channel_key.length() <= 23
 			) {
 			create_channel(params[i], channel_key, "");
+			persist_channel(channels[params[i]]);
 			is_op = true;
 		}
 
 		if (channels.find(params[i]) != channels.end())
 		{
 			Channel &channel = channels[params[i]];
-			if (channel.is_invited(user))
+			if (channel.is_banned(user))
+				send_message(fd, ":" + conf.name + " " + c(ERR_BANNEDFROMCHAN) + " " + user->get_nick() + " " + params[i] + " :Cannot join channel (+b)");
+			else if (channel.is_invited(user))
 			{
 				if (!channel.has_mode(MODE_LIMIT) || channel.get_users().size() < channel.get_limit())
 				{
+					if (services.has_channel(SERVICE_JOIN) && service_channel(SERVICE_JOIN, fd, user, channel, args) == SERVICE_STOP)
+						continue;
 					int ret = channel.add_user(fd, user, channel_key);
 					if (ret == ERR_BADCHANNELKEY)
 						send_message(fd, ":" + conf.name + " " + c(ERR_BADCHANNELKEY) + " " + user->get_nick() + " " + params[i] + " :Cannot join channel (+k)");
 					else
 					{
 						channel.remove_invite(user);
+						if (channel.claim_operator(user))
+							is_op = true;
 						if (is_op)
 							channel.add_operator(user);
-						broadcast_message(channel, ":" + user->get_hostmask(user->get_nick()) + " JOIN :" + params[i]);
+						// The joiner's copy is sent from here to stay ahead of the NAMES reply
+						broadcast_message(channel, ":" + user->get_hostmask(user->get_nick()) + " JOIN :" + params[i], user);
+						send_message(fd, ":" + user->get_hostmask(user->get_nick()) + " JOIN :" + params[i]);
+						if (shards.is_running() && is_shardable(fd))
+							shard_join(channel.get_name(), fd);
+						if (!links.empty())
+							propagate("JOIN " + user->get_nick() + " " + params[i] + (is_op ? " o" : ""));
 						send_message(fd, ":" + conf.name + " " + c(RPL_TOPIC) + " " + user->get_nick() + " " + params[i] + " :" + channel.get_topic());
 						send_message(fd, ":" + conf.name + " " + c(RPL_NAMREPLY) + " " + user->get_nick() + " = " + params[i] + " :" + channel.get_users_list());
 						send_message(fd, ":" + conf.name + " " + c(RPL_ENDOFNAMES) + " " + user->get_nick() + " " + params[i] + " :End of /NAMES list");
@@ -459,34 +1002,158 @@ void Server::WHO(int fd, User *user, std::vector<std::string> &args)
 
 void Server::PRIVMSG(int fd, User *user, std::vector<std::string> &args)
 {
-	CHECK_ARGS(3);
+	message_targets(fd, user, args);
+}
 
-	std::string message = join(args.begin() + 2, args.end(), " ");
-	if (args[1][0] == '#')
+void Server::NOTICE(int fd, User *user, std::vector<std::string> &args)
+{
+	message_targets(fd, user, args);
+}
+
+// A message made of client tags only, delivered to recipients that negotiated message-tags
+void Server::TAGMSG(int fd, User *user, std::vector<std::string> &args)
+{
+	if (tags.received.empty())
+		return;
+	message_targets(fd, user, args);
+}
+
+// A TAGMSG is nothing but its tags, clients that did not negotiate them never see one
+static uint32_t required_capabilities(const std::string &line)
+{
+	size_t command = line.find(' ');
+
+	return command != std::string::npos && line.compare(command + 1, 7, "TAGMSG ") == 0 ? CAP_MESSAGE_TAGS : 0;
+}
+
+static bool is_channel_target(const std::string &target)
+{
+	return target[0] == '#';
+}
+
+// <command> <target>[,<target>...] :<text>, the prefix and text are built once.
+// Every recipient gets a single copy: channels go first, a member of several
+// of them only gets the copy for the first, and a nickname already reached
+// through one of them is skipped. A NOTICE never draws an error or an answer
+// from the bot. TAGMSG has no text, it goes through the same checks and hooks
+// and is not filtered.
+void Server::message_targets(int fd, User *user, std::vector<std::string> &args)
+{
+	bool notice = args[0] == "NOTICE";
+	bool tagmsg = args[0] == "TAGMSG";
+
+	CHECK_ARGS((tagmsg ? 2u : 3u));
+
+	std::vector<std::string> targets = split(args[1], ',');
+	if (targets.size() > conf.max_targets)
 	{
-		CHECK_CHANNEL(args[1]);
+		if (!notice)
+			send_message(fd, ":" + conf.name + " " + c(ERR_TOOMANYTARGETS) + " " + user->get_nick() + " " + args[1] + " :Too many recipients");
+		return;
+	}
+	std::stable_partition(targets.begin(), targets.end(), is_channel_target);
+
+	std::string message = join(args.begin() + 2, args.end(), " ");
+	if (!tagmsg && !filter_message(fd, user, args[1], message, notice))
+		return;
 
-		if (!channel.has_user(fd))
+	relay_client_tags();
+	std::string prefix = ":" + user->get_hostmask(user->get_nick()) + " " + args[0] + " ";
+	uint32_t capabilities = tagmsg ? CAP_MESSAGE_TAGS : 0;
+	std::string delivered;
+	std::vector<Channel *> reached;
+	std::set<User *> messaged;
+	for (size_t i = 0; i < targets.size(); i++)
+	{
+		if (targets[i][0] == '#')
 		{
-			not_on_channel(fd, args[1]);
-			return;
+			ChannelList::iterator it = channels.find(targets[i]);
+			if (it == channels.end() || !it->second.has_user(fd))
+			{
+				if (notice)
+					continue;
+				if (it == channels.end())
+					no_such_channel(fd, targets[i]);
+				else
+					not_on_channel(fd, targets[i]);
+				continue;
+			}
+			Channel &channel = it->second;
+			if (!channel.is_operator(user) && channel.is_banned(user))
+			{
+				if (!notice)
+					send_message(fd, ":" + conf.name + " " + c(ERR_CANNOTSENDTOCHAN) + " " + user->get_nick() + " " + targets[i] + " :Cannot send to channel");
+				continue;
+			}
+
+			if (services.has_channel(SERVICE_MESSAGE) && service_channel(SERVICE_MESSAGE, fd, user, channel, args) == SERVICE_STOP)
+				continue;
+
+			std::string line = prefix + targets[i] + (tagmsg ? "" : " " + message);
+			broadcast_message(channel, line, user, delivered, capabilities);
+			if (!tagmsg)
+				history.append(HISTORY_MESSAGE, channel.get_name(), line);
+			if (!notice && !tagmsg && fd != conf.bot.fd && channel.has_user(conf.bot.fd))
+				bot_hear(channel.get_name(), user->get_nick(), message);
+			delivered += (delivered.empty() ? "" : ",") + channel.get_name();
+			reached.push_back(&channel);
+			continue;
 		}
 
-		broadcast_message(channel, ":" + user->get_hostmask(user->get_nick()) + " PRIVMSG " + args[1] + " " + message, users[fd]);
-	}
-	else
-	{
-		User *target = find_user_by_nickname(args[1]);
+		User *target = find_user_by_nickname(targets[i]);
 		if (target == NULL)
 		{
-			no_such_nick(fd, args[1]);
-			return;
+			if (!notice)
+				no_such_nick(fd, targets[i]);
+			continue;
 		}
+		if (!messaged.insert(target).second)
+			continue;
+		bool member = false;
+		for (size_t j = 0; j < reached.size() && !member; j++)
+			member = reached[j]->has_user(target->get_fd());
+		if (member)
+			continue;
 
-		send_message(target->get_fd(), ":" + user->get_hostmask(user->get_nick()) + " PRIVMSG " + target->get_nick() + " " + message);
+		if (!notice && !tagmsg && !target->get_away().empty())
+			send_message(fd, ":" + conf.name + " " + c(RPL_AWAY) + " " + user->get_nick() + " " + target->get_nick() + " :" + target->get_away());
+		std::string line = prefix + target->get_nick() + (tagmsg ? "" : " " + message);
+		if (target->is_remote())
+			link_send(target->get_link(), link_tags() + "TO " + target->get_nick() + " :" + line);
+		else if (target->get_fd() == conf.bot.fd)
+		{
+			if (!notice && !tagmsg)
+				bot_hear(target->get_nick(), user->get_nick(), message);
+		}
+		else if ((target->get_capabilities() & capabilities) == capabilities)
+			send_message(target->get_fd(), line);
 	}
 }
 
+// Runs once per message whatever the number of targets, server operators and
+// the bot are not filtered. Every match is reported to the local operators,
+// false means the message must be dropped. A kill does not return.
+bool Server::filter_message(int fd, User *user, const std::string &targets, const std::string &text, bool notice)
+{
+	if (filter.empty() || fd == conf.bot.fd || user->is_server_operator())
+		return true;
+	const Filter::Entry *entry = filter.match(text, text[0] == ':');
+	if (entry == NULL)
+		return true;
+
+	(*filter_matches)++;
+	for (UserList::iterator it = operators.begin(); it != operators.end(); ++it)
+		if (!it->second->is_remote())
+			send_message(it->first, ":" + conf.name + " NOTICE " + it->second->get_nick() + " :Filter " + Filter::action_name(entry->action) + ": " + user->get_nick() + " to " + targets + " matched \"" + entry->pattern + "\"");
+	if (entry->action == FILTER_WARN)
+		return true;
+	if (entry->action == FILTER_KILL)
+		disconnect(fd, "Message filtered");
+	if (!notice)
+		send_message(fd, ":" + conf.name + " NOTICE " + user->get_nick() + " :Your message to " + targets + " was blocked by a server filter");
+	return false;
+}
+
 void Server::ISON(int fd, User *user, std::vector<std::string> &args)
 {
 	CHECK_ARGS(2);
@@ -498,17 +1165,17 @@ void Server::ISON(int fd, User *user, std::vector<std::string> &args)
 			send_message(fd, ":" + conf.name + " " + c(RPL_NOWOFF) + " " + user->get_nick() + " " + args[1] + " :" + args[1] + " * * 0 is offline");
 			return;
 		}
+		send_message(fd, ":" + conf.name + " " + c(RPL_ISON) + " " + user->get_nick() + " :");
+		return;
 	}
-	else
+	std::vector<std::string> online;
+	for (size_t i = 1; i < args.size(); i++)
 	{
-		User *user = find_user_by_nickname(args[1]);
-		if (user == NULL)
-		{
-			send_message(fd, ":" + conf.name + " " + c(RPL_ISON) + " " + user->get_nick() + " :" + args[1]);
-			return;
-		}
+		User *target = find_user_by_nickname(args[i][0] == ':' ? args[i].substr(1) : args[i]);
+		if (is_online(target))
+			online.push_back(target->get_nick());
 	}
-	send_message(fd, ":" + conf.name + " " + c(RPL_ISON) + " " + user->get_nick() + " :");
+	send_message(fd, ":" + conf.name + " " + c(RPL_ISON) + " " + user->get_nick() + " :" + join(online.begin(), online.end(), " "));
 }
 
 void Server::PART(int fd, User *user, std::vector<std::string> &args)
@@ -523,8 +1190,14 @@ void Server::PART(int fd, User *user, std::vector<std::string> &args)
 	}
 
 	broadcast_message(channel, ":" + user->get_hostmask(user->get_nick()) + " PART " + args[1] + " " + join(args.begin() + 2, args.end(), " "));
+	if (!links.empty())
+		propagate("PART " + user->get_nick() + " " + channel.get_name());
 
 	channel.remove_user(fd);
+	if (shards.is_running())
+		shards.part(channel.get_name(), fd);
+	if (services.has_channel(SERVICE_PART))
+		service_channel(SERVICE_PART, fd, user, channel, args);
 }
 
 void Server::PING(int fd, User *user, std::vector<std::string> &args)
@@ -576,7 +1249,10 @@ void Server::KICK(int fd, User *user, std::vector<std::string> &args)
 	if (channel.has_user(target->get_fd()))
 	{
 		broadcast_message(channel, ":" + user->get_hostmask(user->get_nick()) + " KICK " + args[1] + " " + args[2] + " :");
+		propagate("PART " + target->get_nick() + " " + channel.get_name());
 		channel.remove_user(target->get_fd());
+		if (shards.is_running())
+			shards.part(channel.get_name(), target->get_fd());
 	}
 	else
 		user_not_in_channel(fd, args[2], channel.get_name());
@@ -609,9 +1285,14 @@ void Server::INVITE(int fd, User *user, std::vector<std::string> &args)
 			send_message(fd, ":" + conf.name + " " + c(ERR_USERONCHANNEL) + " " + user->get_nick() + " " + args[1] + " " + args[2] + " :is already on channel");
 			return;
 		}
-		send_message(target->get_fd(), ":" + user->get_hostmask(user->get_nick()) + " INVITE " + target->get_nick() + " " + args[2]);
+		std::string line = ":" + user->get_hostmask(user->get_nick()) + " INVITE " + target->get_nick() + " " + args[2];
+		if (target->is_remote())
+			link_send(target->get_link(), "TO " + target->get_nick() + " :" + line);
+		else
+			send_message(target->get_fd(), line);
 		send_message(fd, ":" + conf.name + " " + c(RPL_INVITING) + " " + user->get_nick() + " " + args[1] + " " + args[2]);
 		channel.invite(target);
+		propagate("INVITE " + channel.get_name() + " " + target->get_nick());
 	}
 	else
 		channel_operator_privileges_needed(fd, channel.get_name());
@@ -638,6 +1319,7 @@ void Server::TOPIC(int fd, User *user, std::vector<std::string> &args)
 	{
 		channel.set_topic(join(args.begin() + 2, args.end(), " ").substr(1));
 		broadcast_message(channel, ":" + user->get_hostmask(user->get_nick()) + " TOPIC " + args[1] + " :" + channel.get_topic());
+		persist_channel(channel);
 	}
 	else
 		channel_operator_privileges_needed(fd, channel.get_name());
@@ -678,6 +1360,8 @@ void Server::MODE(int fd, User *user, std::vector<std::string> &args)
 		return;
 	}
 
+	if (args[2] == "b" || args[2] == "e" || args[2] == "I")
+		args[2] = "+" + args[2];
 	char operation = args[2][0];
 
 	if (operation != '+' && operation != '-')
@@ -699,6 +1383,9 @@ void Server::MODE(int fd, User *user, std::vector<std::string> &args)
 			SET_MODE_OR_ERR('o', MODE_OPERATOR);
 			SET_MODE_OR_ERR('k', MODE_KEY);
 			SET_MODE_OR_ERR('l', MODE_LIMIT);
+			SET_MODE_OR_ERR('b', MODE_BAN);
+			SET_MODE_OR_ERR('e', MODE_EXCEPT);
+			SET_MODE_OR_ERR('I', MODE_INVEX);
 		default:
 			err = true;
 			break;
@@ -718,6 +1405,7 @@ void Server::MODE(int fd, User *user, std::vector<std::string> &args)
 				else
 					channel.set_mode(channel.get_mode() & ~MODE_INVITEONLY);
 				broadcast_message(channel, ":" + user->get_hostmask(user->get_nick()) + " MODE " + args[1] + " :" + operation + "i");
+				persist_channel(channel);
 				OPER_END();
 			}
 			if (mode & MODE_OPERATOR)
@@ -734,6 +1422,7 @@ void Server::MODE(int fd, User *user, std::vector<std::string> &args)
 						else if (operation == '-')
 							channel.remove_operator(target);
 						broadcast_message(channel, ":" + conf.name + " " + c(RPL_CHANNELMODEIS) + " " + user->get_nick() + " " + args[1] + " " + operation + "o " + target->get_nick());
+						propagate("OP " + channel.get_name() + " " + operation + " " + target->get_nick());
 					}
 					else
 						user_not_in_channel(fd, args[arg_idx], channel.get_name());
@@ -751,6 +1440,7 @@ void Server::MODE(int fd, User *user, std::vector<std::string> &args)
 				else
 					channel.set_mode(channel.get_mode() & ~MODE_TOPIC);
 				broadcast_message(channel, ":" + user->get_hostmask(user->get_nick()) + " MODE " + args[1] + " :" + operation + "t");
+				persist_channel(channel);
 				OPER_END();
 			}
 			if (mode & MODE_LIMIT)
@@ -762,12 +1452,14 @@ void Server::MODE(int fd, User *user, std::vector<std::string> &args)
 					channel.set_mode(channel.get_mode() | MODE_LIMIT);
 					channel.set_limit(std::atoi(args[arg_idx].c_str()));
 					broadcast_message(channel, ":" + user->get_hostmask(user->get_nick()) + " MODE " + args[1] + " :" + operation + "l " + args[arg_idx]);
+					persist_channel(channel);
 					arg_idx++;
 				}
 				else if (operation == '-' && channel.has_mode(MODE_LIMIT))
 				{
 					channel.set_mode(channel.get_mode() & ~MODE_LIMIT);
 					broadcast_message(channel, ":" + user->get_hostmask(user->get_nick()) + " MODE " + args[1] + " :" + operation + "l");
+					persist_channel(channel);
 				}
 				OPER_END();
 			}
@@ -780,11 +1472,48 @@ void Server::MODE(int fd, User *user, std::vector<std::string> &args)
 					channel.set_mode(channel.get_mode() | MODE_KEY);
 					channel.set_key(args[arg_idx]);
 					broadcast_message(channel, ":" + user->get_hostmask(user->get_nick()) + " MODE " + args[1] + " :" + operation + "k " + channel.get_key());
+					persist_channel(channel);
 				}
 				else if (operation == '-' && channel.has_mode(MODE_KEY))
 				{
 					channel.set_mode(channel.get_mode() & ~MODE_KEY);
 					broadcast_message(channel, ":" + user->get_hostmask(user->get_nick()) + " MODE " + args[1] + " :" + operation + "k");
+					persist_channel(channel);
+				}
+				OPER_END();
+				arg_idx++;
+			}
+			// Without a mask the list is shown instead, anyone may see the bans
+			// but the exception lists are for operators only
+			if (mode & (MODE_BAN | MODE_EXCEPT | MODE_INVEX))
+			{
+				if (arg_idx >= args.size())
+				{
+					if (mode & MODE_BAN)
+						send_mask_list(fd, channel, mode);
+					else
+					{
+						OPER_START();
+						send_mask_list(fd, channel, mode);
+						OPER_END();
+					}
+					mode = 0;
+					continue;
+				}
+				OPER_START();
+				MaskList &masks = channel.get_masks(mode);
+				MaskList::Entry entry = {MaskList::normalize(args[arg_idx]), user->get_nick(), std::time(NULL)};
+				bool changed = false;
+				if (operation == '+' && masks.size() >= conf.max_channel_masks)
+					send_message(fd, ":" + conf.name + " " + c(ERR_BANLISTFULL) + " " + user->get_nick() + " " + args[1] + " " + entry.mask + " :Channel list is full");
+				else if (operation == '+')
+					changed = masks.add(entry.mask, entry.setter, entry.time);
+				else
+					changed = masks.remove(entry.mask);
+				if (changed)
+				{
+					broadcast_message(channel, ":" + user->get_hostmask(user->get_nick()) + " MODE " + args[1] + " " + operation + args[2][i] + " " + entry.mask);
+					propagate(channel_mask_line(channel, operation, mode, entry));
 				}
 				OPER_END();
 				arg_idx++;
@@ -794,44 +1523,470 @@ void Server::MODE(int fd, User *user, std::vector<std::string> &args)
 	}
 }
 
-void Server::IGNORED(int fd, User *user, std::vector<std::string> &args)
+// RPL_BANLIST, RPL_EXCEPTLIST or RPL_INVITELIST for each mask, then the end of list
+void Server::send_mask_list(int fd, Channel &channel, int mode)
 {
-	(void)fd;
-	(void)user;
-	(void)args;
+	int item = mode & MODE_EXCEPT ? RPL_EXCEPTLIST : mode & MODE_INVEX ? RPL_INVITELIST : RPL_BANLIST;
+	int end = mode & MODE_EXCEPT ? RPL_ENDOFEXCEPTLIST : mode & MODE_INVEX ? RPL_ENDOFINVITELIST : RPL_ENDOFBANLIST;
+	std::string prefix = " " + users[fd]->get_nick() + " " + channel.get_name() + " ";
+	const std::vector<MaskList::Entry> &entries = channel.get_mask_entries(mode);
+	for (size_t i = 0; i < entries.size(); i++)
+		send_message(fd, ":" + conf.name + " " + c(item) + prefix + entries[i].mask + " " + entries[i].setter + " " + to_string(entries[i].time));
+	send_message(fd, ":" + conf.name + " " + c(end) + prefix + ":End of channel list");
 }
 
-void Server::parse_command(int fd, const std::string &cmd)
+void Server::HISTORY(int fd, User *user, std::vector<std::string> &args)
 {
-	User *user = users[fd];
-	int command_idx = is_valid_command(cmd);
-
-	if (command_idx == INVALID_COMMAND)
+	// Without a history_dir there is nothing to replay, say so rather than
+	// leave the client waiting for a batch
+	if (!history.is_enabled())
 	{
-		user->get_registered() ? unknown_command(fd, cmd) : not_registered(fd);
+		send_message(fd, ":" + conf.name + " " + c(ERR_UNKNOWNCOMMAND) + " " + user->get_nick() + " HISTORY :History is disabled");
 		return;
 	}
+	CHECK_ARGS(2);
+	CHECK_CHANNEL(args[1]);
 
-	std::vector<std::string> args = split(cmd, ' ', true);
-
-	if (args.size() < 1)
+	if (!channel.has_user(fd))
+	{
+		not_on_channel(fd, args[1]);
 		return;
+	}
 
-	if (!user->get_auth())
+	size_t limit = args.size() > 2 ? to_number_safe<size_t>(args[2]) : 50;
+	std::vector<HistoryRecord> records = history.query(channel.get_name(), std::min(limit, (size_t)HISTORY_QUERY_MAX));
+
+	// Replayed lines carry the time they were logged at
+	std::string batch;
+	if (user->get_capabilities() & CAP_BATCH)
 	{
-		if (args[0] == "PASS")
-		{
-			CHECK_ARGS(2);
+		batch = next_batch_id();
+		send_message(fd, ":" + conf.name + " BATCH +" + batch + " chathistory " + channel.get_name());
+		set_tag_batch(batch);
+	}
+	for (size_t i = 0; i < records.size(); i++)
+	{
+		set_tag_time((uint64_t)records[i].time * 1000);
+		send_message(fd, records[i].data);
+	}
+	set_tag_time(0);
+	if (!batch.empty())
+	{
+		set_tag_batch("");
+		send_message(fd, ":" + conf.name + " BATCH -" + batch);
+	}
+}
 
-			if (user->get_registered())
-			{
-				already_registered(fd);
+void Server::STATS(int fd, User *user, std::vector<std::string> &args)
+{
+	(void)args;
+
+	if (!user->is_server_operator())
+	{
+		no_privileges(fd);
+		return;
+	}
+
+	update_metrics();
+	std::vector<std::string> lines = metrics.render_stats();
+	for (size_t i = 0; i < lines.size(); i++)
+		send_message(fd, ":" + conf.name + " " + c(RPL_STATSDEBUG) + " " + user->get_nick() + " :" + lines[i]);
+	send_message(fd, ":" + conf.name + " " + c(RPL_ENDOFSTATS) + " " + user->get_nick() + " m :End of /STATS report");
+}
+
+void Server::SLOWLOG(int fd, User *user, std::vector<std::string> &args)
+{
+	if (!user->is_server_operator())
+	{
+		no_privileges(fd);
+		return;
+	}
+
+	size_t count = args.size() > 1 ? to_number_safe<size_t>(args[1]) : 10;
+	std::vector<SlowCommand> worst = slow_commands.worst(count);
+
+	for (size_t i = 0; i < worst.size(); i++)
+		send_message(fd, ":" + conf.name + " " + c(RPL_STATSDEBUG) + " " + user->get_nick() + " :" + to_string(worst[i].duration) + "us " + worst[i].nickname + " " + to_string(worst[i].output_bytes) + "B " + to_string(worst[i].time) + " " + worst[i].command);
+	send_message(fd, ":" + conf.name + " " + c(RPL_ENDOFSTATS) + " " + user->get_nick() + " s :End of /SLOWLOG report");
+}
+
+static const char *capability_names[] = {"message-tags", "server-time", "batch"};
+
+static uint32_t capability_flag(const std::string &name)
+{
+	for (size_t i = 0; i < sizeof(capability_names) / sizeof(capability_names[0]); i++)
+		if (name == capability_names[i])
+			return 1 << i;
+	return 0;
+}
+
+static std::string capability_list(uint32_t capabilities)
+{
+	std::string list;
+
+	for (size_t i = 0; i < sizeof(capability_names) / sizeof(capability_names[0]); i++)
+		if (capabilities & 1 << i)
+			list += (list.empty() ? "" : " ") + std::string(capability_names[i]);
+	return list;
+}
+
+// CAP LS [version] | LIST | REQ :<capabilities> | END, accepted before PASS.
+// Starting to negotiate during registration holds the welcome until END.
+void Server::CAP(int fd, User *user, std::vector<std::string> &args)
+{
+	CHECK_ARGS(2);
+
+	std::string prefix = ":" + conf.name + " CAP " + (user->get_nick().empty() ? "*" : user->get_nick()) + " ";
+	bool registering = !user->get_registered() || user->get_user().empty();
+
+	if ((args[1] == "LS" || args[1] == "REQ") && registering)
+		user->set_negotiating(true);
+	if (args[1] == "LS")
+		send_message(fd, prefix + "LS :" + capability_list(CAP_TAGS));
+	else if (args[1] == "LIST")
+		send_message(fd, prefix + "LIST :" + capability_list(user->get_capabilities()));
+	else if (args[1] == "REQ")
+	{
+		CHECK_ARGS(3);
+
+		std::string requested = join(args.begin() + 2, args.end(), " ");
+		if (requested[0] == ':')
+			requested.erase(0, 1);
+		std::vector<std::string> names = split(requested, ' ');
+		uint32_t capabilities = user->get_capabilities();
+		bool valid = !names.empty();
+		for (size_t i = 0; valid && i < names.size(); i++)
+		{
+			bool disable = names[i][0] == '-';
+			uint32_t flag = capability_flag(names[i].substr(disable));
+			valid = flag != 0;
+			capabilities = disable ? capabilities & ~flag : capabilities | flag;
+		}
+		// All or nothing
+		if (!valid)
+		{
+			send_message(fd, prefix + "NAK :" + requested);
+			return;
+		}
+		user->set_capabilities(capabilities);
+		send_message(fd, prefix + "ACK :" + requested);
+		if (shards.is_running())
+			reshard(fd);
+	}
+	else if (args[1] == "END")
+	{
+		if (!user->is_negotiating())
+			return;
+		user->set_negotiating(false);
+		if (!registering)
+			complete_registration(fd);
+	}
+	else
+		send_message(fd, ":" + conf.name + " " + c(ERR_INVALIDCAPCMD) + " " + (user->get_nick().empty() ? "*" : user->get_nick()) + " " + args[1] + " :Invalid CAP command");
+}
+
+// Online as far as watchers are concerned, a client still registering is not
+bool Server::is_online(User *user)
+{
+	return user != NULL && !user->is_negotiating() && (user->get_fd() == conf.bot.fd || is_linked_user(user));
+}
+
+// Called when a nickname comes or goes, costs one lookup when nobody watches it
+void Server::notify_watchers(User *user, bool online)
+{
+	std::map<std::string, std::set<int>, map_string_comparator>::iterator it = watchers.find(user->get_nick());
+
+	if (it == watchers.end())
+		return;
+	std::string target = online ? user->get_hostmask(user->get_nick()) : user->get_nick();
+	for (std::set<int>::iterator fit = it->second.begin(); fit != it->second.end(); ++fit)
+		send_message(*fit, ":" + conf.name + " " + c(online ? RPL_MONONLINE : RPL_MONOFFLINE) + " " + users[*fit]->get_nick() + " :" + target);
+}
+
+// As many comma separated nicknames per line as fit in 510 bytes
+void Server::send_nick_list(int fd, int numeric, const std::vector<std::string> &nicks, const std::string &target, char delim)
+{
+	std::string prefix = ":" + conf.name + " " + c(numeric) + " " + users[fd]->get_nick() + (target.empty() ? "" : " " + target) + " :";
+	std::string list;
+
+	for (size_t i = 0; i < nicks.size(); i++)
+	{
+		if (!list.empty() && prefix.length() + list.length() + 1 + nicks[i].length() > 510)
+		{
+			send_message(fd, prefix + list);
+			list.clear();
+		}
+		if (!list.empty())
+			list += delim;
+		list += nicks[i];
+	}
+	if (!list.empty())
+		send_message(fd, prefix + list);
+}
+
+void Server::unmonitor(int fd, const std::string &nickname)
+{
+	std::map<std::string, std::set<int>, map_string_comparator>::iterator it = watchers.find(nickname);
+
+	if (it == watchers.end())
+		return;
+	it->second.erase(fd);
+	if (it->second.empty())
+		watchers.erase(it);
+	monitoring[fd].erase(nickname);
+}
+
+void Server::clear_monitor(int fd)
+{
+	std::map<int, MonitorList>::iterator it = monitoring.find(fd);
+
+	if (it == monitoring.end())
+		return;
+	MonitorList watched = it->second;
+	for (MonitorList::iterator wit = watched.begin(); wit != watched.end(); ++wit)
+		unmonitor(fd, *wit);
+	monitoring.erase(fd);
+}
+
+// MONITOR +|- <nick>[,<nick>...], C, L or S. Watching is an entry on each
+// side, the nickname's own state changes push 730/731 to its watchers.
+void Server::MONITOR(int fd, User *user, std::vector<std::string> &args)
+{
+	CHECK_ARGS(2);
+
+	if (args[1] == "+" || args[1] == "-")
+	{
+		CHECK_ARGS(3);
+
+		std::vector<std::string> targets = split(args[2][0] == ':' ? args[2].substr(1) : args[2], ',');
+		std::vector<std::string> online, offline;
+		for (size_t i = 0; i < targets.size(); i++)
+		{
+			if (args[1] == "-")
+			{
+				unmonitor(fd, targets[i]);
+				continue;
+			}
+			if (!verify_nickname(targets[i]) || monitoring[fd].count(targets[i]))
+				continue;
+			if (monitoring[fd].size() >= conf.monitor_limit)
+			{
+				send_message(fd, ":" + conf.name + " " + c(ERR_MONLISTFULL) + " " + user->get_nick() + " " + to_string(conf.monitor_limit) + " " + join(targets.begin() + i, targets.end(), ",") + " :Monitor list is full.");
+				break;
+			}
+			monitoring[fd].insert(targets[i]);
+			watchers[targets[i]].insert(fd);
+			User *target = find_user_by_nickname(targets[i]);
+			if (is_online(target))
+				online.push_back(target->get_hostmask(target->get_nick()));
+			else
+				offline.push_back(targets[i]);
+		}
+		send_nick_list(fd, RPL_MONONLINE, online);
+		send_nick_list(fd, RPL_MONOFFLINE, offline);
+	}
+	else if (args[1] == "C")
+		clear_monitor(fd);
+	else if (args[1] == "L" || args[1] == "S")
+	{
+		std::vector<std::string> listed, online, offline;
+		MonitorList &watched = monitoring[fd];
+		for (MonitorList::iterator it = watched.begin(); it != watched.end(); ++it)
+		{
+			User *target = find_user_by_nickname(*it);
+			listed.push_back(*it);
+			if (is_online(target))
+				online.push_back(target->get_hostmask(target->get_nick()));
+			else
+				offline.push_back(*it);
+		}
+		if (args[1] == "S")
+		{
+			send_nick_list(fd, RPL_MONONLINE, online);
+			send_nick_list(fd, RPL_MONOFFLINE, offline);
+			return;
+		}
+		send_nick_list(fd, RPL_MONLIST, listed);
+		send_message(fd, ":" + conf.name + " " + c(RPL_ENDOFMONLIST) + " " + user->get_nick() + " :End of MONITOR list");
+	}
+}
+
+// FILTER [LIST], FILTER ADD <warn|block|kill> :<text>, FILTER DEL :<text>
+void Server::FILTER(int fd, User *user, std::vector<std::string> &args)
+{
+	if (!user->is_server_operator())
+	{
+		no_privileges(fd);
+		return;
+	}
+
+	std::string notice = ":" + conf.name + " NOTICE " + user->get_nick() + " :";
+	std::string operation = args.size() > 1 ? Filter::normalize(args[1]) : "list";
+	if (operation == "list")
+	{
+		const std::vector<Filter::Entry> &entries = filter.get_entries();
+		for (size_t i = 0; i < entries.size(); i++)
+			send_message(fd, ":" + conf.name + " " + c(RPL_STATSDEBUG) + " " + user->get_nick() + " :" + Filter::action_name(entries[i].action) + " " + entries[i].setter + " " + to_string(entries[i].time) + " " + entries[i].pattern);
+		send_message(fd, ":" + conf.name + " " + c(RPL_ENDOFSTATS) + " " + user->get_nick() + " f :End of /FILTER list");
+		return;
+	}
+
+	size_t first = operation == "add" ? 3 : 2;
+	std::string pattern = args.size() > first ? Filter::normalize(join(args.begin() + first, args.end(), " ")) : "";
+	if (!pattern.empty() && pattern[0] == ':')
+		pattern.erase(0, 1);
+	if ((operation != "add" && operation != "del") || pattern.empty())
+	{
+		need_more_params(fd, "FILTER");
+		return;
+	}
+
+	if (operation == "del")
+	{
+		send_message(fd, notice + (filter.remove(pattern) ? "No longer filtering \"" : "Not filtering \"") + pattern + "\"");
+		return;
+	}
+	int action = Filter::parse_action(args[2]);
+	if (action == FILTER_NONE)
+		send_message(fd, notice + "Unknown filter action " + args[2] + ", expected warn, block or kill");
+	else if (!filter.add(pattern, action, user->get_nick(), time(NULL)))
+		send_message(fd, notice + "Already filtering \"" + pattern + "\"");
+	else
+		send_message(fd, notice + "Filtering \"" + pattern + "\" (" + Filter::action_name(action) + ")");
+}
+
+// WHOIS [<server>] <nick>, users do not keep a channel list so the channels
+// are asked one by one
+void Server::WHOIS(int fd, User *user, std::vector<std::string> &args)
+{
+	CHECK_ARGS(2);
+
+	std::string nickname = args.back()[0] == ':' ? args.back().substr(1) : args.back();
+	std::string prefix = ":" + conf.name + " ";
+	User *target = find_user_by_nickname(nickname);
+	if (!is_online(target))
+	{
+		no_such_nick(fd, nickname);
+		send_message(fd, prefix + c(RPL_ENDOFWHOIS) + " " + user->get_nick() + " " + nickname + " :End of /WHOIS list");
+		return;
+	}
+
+	std::string whois = " " + user->get_nick() + " " + target->get_nick();
+	send_message(fd, prefix + c(RPL_WHOISUSER) + whois + " " + target->get_user() + " " + target->get_host() + " * :" + target->get_real());
+	std::vector<std::string> joined;
+	for (ChannelList::iterator it = channels.begin(); it != channels.end(); ++it)
+		if (it->second.has_user(target->get_fd()))
+			joined.push_back((it->second.is_operator(target) ? "@" : "") + it->second.get_name());
+	send_nick_list(fd, RPL_WHOISCHANNELS, joined, target->get_nick(), ' ');
+	send_message(fd, prefix + c(RPL_WHOISSERVER) + whois + " " + server_of(target) + " :" + (target->is_remote() ? "Linked server" : "This server"));
+	if (!target->get_away().empty())
+		send_message(fd, prefix + c(RPL_AWAY) + whois + " :" + target->get_away());
+	if (target->is_server_operator())
+		send_message(fd, prefix + c(RPL_WHOISOPERATOR) + whois + " :is an IRC operator");
+	if (target->get_fd() >= 0)
+		send_message(fd, prefix + c(RPL_WHOISIDLE) + whois + " " + to_string(std::time(NULL) - target->get_last_activity()) + " :seconds idle");
+	send_message(fd, prefix + c(RPL_ENDOFWHOIS) + whois + " :End of /WHOIS list");
+}
+
+// WHOWAS <nick> [<count>], newest first, every record when count is missing or 0
+void Server::WHOWAS(int fd, User *user, std::vector<std::string> &args)
+{
+	CHECK_ARGS(2);
+
+	std::string prefix = ":" + conf.name + " ";
+	size_t count = args.size() > 2 ? to_number_safe<size_t>(args[2]) : 0;
+	std::vector<const Whowas::Record *> found;
+	if (whowas.find(args[1], found, count ? count : whowas.capacity()) == 0)
+		send_message(fd, prefix + c(ERR_WASNOSUCHNICK) + " " + user->get_nick() + " " + args[1] + " :There was no such nickname");
+	for (size_t i = 0; i < found.size(); i++)
+	{
+		char when[64];
+		tm utc;
+		gmtime_r(&found[i]->time, &utc);
+		strftime(when, sizeof(when), "%a %b %d %H:%M:%S %Y UTC", &utc);
+		std::string record = " " + user->get_nick() + " " + found[i]->nick;
+		send_message(fd, prefix + c(RPL_WHOWASUSER) + record + " " + found[i]->user + " " + found[i]->host + " * :" + found[i]->real);
+		send_message(fd, prefix + c(RPL_WHOISSERVER) + record + " " + found[i]->server + " :" + when);
+	}
+	send_message(fd, prefix + c(RPL_ENDOFWHOWAS) + " " + user->get_nick() + " " + args[1] + " :End of WHOWAS");
+}
+
+// AWAY :<message> sets the message, AWAY alone clears it
+void Server::AWAY(int fd, User *user, std::vector<std::string> &args)
+{
+	std::string message = args.size() > 1 ? join(args.begin() + 1, args.end(), " ") : "";
+	if (!message.empty() && message[0] == ':')
+		message.erase(0, 1);
+
+	user->set_away(message);
+	if (!links.empty() && is_linked_user(user))
+		propagate("AWAY " + user->get_nick() + (message.empty() ? "" : " :" + message));
+	if (message.empty())
+		send_message(fd, ":" + conf.name + " " + c(RPL_UNAWAY) + " " + user->get_nick() + " :You are no longer marked as being away");
+	else
+		send_message(fd, ":" + conf.name + " " + c(RPL_NOWAWAY) + " " + user->get_nick() + " :You have been marked as being away");
+}
+
+void Server::IGNORED(int fd, User *user, std::vector<std::string> &args)
+{
+	(void)fd;
+	(void)user;
+	(void)args;
+}
+
+// Points current_line at a command for as long as it runs and puts back the
+// enclosing one after, also when the handler throws on a terminated connection
+typedef struct LineScope
+{
+	const std::string *&line;
+	const std::string *saved;
+
+	LineScope(const std::string *&line, const std::string *current) : line(line), saved(line) { line = current; }
+	~LineScope() { line = saved; }
+} LineScope;
+
+void Server::parse_command(int fd, const std::string &line)
+{
+	User *user = users[fd];
+	uint64_t start = monotonic_us();
+	std::string untagged;
+
+	reset_tags();
+	const std::string &cmd = line[0] == '@' ? (untagged = strip_tags(line)) : line;
+	int command_idx = is_valid_command(cmd);
+
+	current_command = command_idx == INVALID_COMMAND ? command_stats.size() - 1 : command_idx;
+	(*command_stats[current_command].in)++;
+
+	if (command_idx == INVALID_COMMAND)
+	{
+		user->get_registered() ? unknown_command(fd, cmd) : not_registered(fd);
+		return;
+	}
+
+	std::vector<std::string> args = split(cmd, ' ', true);
+	parse_latency->observe(monotonic_us() - start);
+
+	if (args.size() < 1)
+		return;
+
+	if (!user->get_auth())
+	{
+		if (args[0] == "PASS")
+		{
+			CHECK_ARGS(2);
+
+			if (user->get_registered())
+			{
+				already_registered(fd);
 				return;
 			}
 
 			if (args[1] == conf.password)
 				user->set_auth(true);
 		}
+		else if (args[0] == "CAP")
+			CAP(fd, user, args);
 		else
 		{
 			not_registered(fd);
@@ -839,187 +1994,2252 @@ void Server::parse_command(int fd, const std::string &cmd)
 	}
 	else
 	{
-		if (commands[command_idx].need_registered && !user->get_registered())
-			not_registered(fd);
-		else
-			(this->*commands[command_idx].func)(fd, user, args);
+		LineScope scope(current_line, &cmd);
+		if (commands[command_idx].need_registered && !user->get_registered())
+			not_registered(fd);
+		else if (!services.has_command(command_idx) || service_command(command_idx, fd, user, args) == SERVICE_CONTINUE)
+		{
+			uint64_t queued = *bytes_queued;
+
+			start = monotonic_us();
+			(this->*commands[command_idx].func)(fd, user, args);
+			uint64_t duration = monotonic_us() - start;
+			command_stats[command_idx].dispatch->observe(duration);
+
+			if (conf.slow_command_threshold > 0 && duration >= conf.slow_command_threshold)
+			{
+				SlowCommand entry;
+				entry.command = args[0];
+				if (args.size() > 1 && args[0] != "OPER" && args[0] != "PASS")
+					entry.command += " " + args[1];
+				entry.nickname = user->get_nick();
+				entry.duration = duration;
+				entry.output_bytes = *bytes_queued - queued;
+				entry.time = std::time(NULL);
+				slow_commands.record(entry);
+				std::cout << GREY << "SLOW COMMAND: " << entry.command << " from " << entry.nickname << " took " << duration << "us, queued " << entry.output_bytes << " bytes" << RESET << std::endl;
+			}
+		}
+	}
+}
+
+// Runs at most command_budget lines. A connection that used its budget up
+// goes to the back of the input queue and carries on from there on the next
+// loop iteration, once every other connection had its turn.
+void Server::parse_data(int fd)
+{
+	std::istringstream iss(users[fd]->get_data());
+	std::string line;
+	size_t budget = conf.command_budget;
+
+	if (std::min(users[fd]->get_data().find("\r\n"), users[fd]->get_data().length()) > conf.max_message_length)
+	{
+		terminate_connection(fd);
+		return;
+	}
+
+	// std::cout << RED "PARSING DATA: " << escape(iss.str()) << RESET << std::endl;
+	// A line is only complete once its LF is in, a read may stop right after the CR
+	while (budget > 0 && !users[fd]->get_welcome_pending() && std::getline(iss, line) && !iss.eof())
+	{
+		// std::cout << YELLOW << "Received from " << RESET << fd << YELLOW ": `" RESET << escape(line) << YELLOW "`" RESET << std::endl;
+		try
+		{
+			if (line.empty() || line[line.length() - 1] != '\r')
+				users[fd]->get_data().erase(0, line.length() + 1);
+			else
+			{
+				if (fd >= 0)
+					capture.record(CAPTURE_DATA, fd, line);
+				parse_command(fd, line);
+				current_command = command_stats.size() - 1;
+				users[fd]->get_data().erase(0, line.length() + 1);
+				budget--;
+			}
+		}
+		catch (...)
+		{
+			current_command = command_stats.size() - 1;
+			return;
+		}
+	}
+	if (budget == 0)
+		queue_input(fd);
+	// std::cout << RED "AFTER PARSING DATA: " << escape(users[fd]->get_data()) << RESET << std::endl;
+}
+
+void Server::queue_input(int fd)
+{
+	if (input_queued.insert(fd).second)
+		input_queue.push_back(fd);
+}
+
+// One turn for each connection that was waiting at the start of the pass.
+// Plain sockets were read in process_events already, over TLS the record
+// layer may be holding plaintext that never shows up as POLLIN.
+void Server::process_input()
+{
+	for (size_t turns = input_queue.size(); turns > 0; turns--)
+	{
+		int fd = input_queue.front();
+		input_queue.pop_front();
+		input_queued.erase(fd);
+		if (users.find(fd) == users.end())
+			continue;
+		if (tls.is_tls(fd) && !receive_tls(fd))
+		{
+			terminate_connection(fd);
+			continue;
+		}
+		parse_data(fd);
+	}
+}
+
+int Server::is_valid_command(const std::string &line)
+{
+	for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++)
+	{
+		if (line.substr(0, commands[i].name.length() + 1) == commands[i].name + " "
+			|| line.substr(0, commands[i].name.length() + 1) == commands[i].name + "\r")
+			return i;
+	}
+	return INVALID_COMMAND;
+}
+
+void Server::process_events(int fd, int revents)
+{
+	reset_tags();
+	// std::cout << MAGENTA << "revents: " << revents << RESET << std::endl;
+	if (fd == resolver.get_fd())
+	{
+		if (revents & POLLIN)
+			collect_dns_results();
+		return;
+	}
+	if (fd == signal_fd)
+	{
+		if (revents & POLLIN)
+			handle_signals();
+		return;
+	}
+	if (fd == bot.get_fd())
+	{
+		if (revents & POLLIN)
+			collect_bot_replies();
+		return;
+	}
+	if (fd == metrics_fd)
+	{
+		if (revents & POLLIN)
+			accept_metrics_client();
+		return;
+	}
+	if (fd == link_fd)
+	{
+		if (revents & POLLIN)
+			accept_link();
+		return;
+	}
+	if (links.find(fd) != links.end())
+	{
+		process_link_events(fd, revents);
+		return;
+	}
+	if (metrics_clients.find(fd) != metrics_clients.end())
+	{
+		serve_metrics_client(fd, revents);
+		return;
+	}
+	if (revents & POLLIN)
+	{
+		if (fd == server_fd || fd == tls_fd)
+		{
+			accept_connections(fd);
+		}
+		else if (!receive_data(fd))
+		{
+			terminate_connection(fd);
+			return;
+		}
+		else if (input_queued.find(fd) == input_queued.end())
+			parse_data(fd);
+	}
+	if (revents & (POLLHUP | POLLERR))
+	{
+		terminate_connection(fd);
+		return;
+	}
+	if (revents & POLLOUT)
+	{
+		if (users.find(fd) != users.end() && users[fd]->get_sendbuffer().length() > 0 && shards.acquire(fd))
+		{
+			bool alive = flush_sendbuffer(fd);
+			shards.release(fd);
+			if (!alive)
+			{
+				terminate_connection(fd);
+				return;
+			}
+		}
+	}
+	if (fd != server_fd && users.find(fd) != users.end())
+	{
+		time_t ping = conf.activity_timeout;
+		time_t timeout = conf.ping_timeout;
+		time_t now = time(NULL);
+
+		if (now - users[fd]->get_last_activity() >= ping)
+		{
+			if (users[fd]->get_last_ping() <= users[fd]->get_last_activity())
+			{
+				send_message(fd, "PING " + to_string(now));
+				users[fd]->set_last_ping();
+			}
+			else if (now - users[fd]->get_last_ping() >= timeout)
+			{
+				terminate_connection(fd);
+				return;
+			}
+		}
+	}
+}
+
+void Server::enqueue(User *user, const std::string &ircmsg, size_t messages)
+{
+	if (user->is_remote() || user->get_fd() == conf.bot.fd)
+		return;
+	// A worker writing to the client gets the line in order with the channel
+	// traffic it fans out, such clients never negotiated tags
+	if (shards.is_running() && shards.send(user->get_fd(), ircmsg))
+	{
+		*command_stats[current_command].out += messages;
+		*bytes_queued += ircmsg.length();
+		return;
+	}
+	// Bursts of several lines go out untagged
+	if (messages == 1 && (user->get_capabilities() & CAP_TAGS))
+	{
+		const std::string &prefix = tag_prefix(user->get_capabilities());
+		user->append_sendbuffer(prefix);
+		*bytes_queued += prefix.length();
+	}
+	user->append_sendbuffer(ircmsg);
+	*command_stats[current_command].out += messages;
+	*bytes_queued += ircmsg.length();
+}
+
+static std::string server_time(uint64_t ms)
+{
+	time_t seconds = ms / 1000;
+	tm utc;
+	char buffer[32];
+
+	gmtime_r(&seconds, &utc);
+	size_t length = strftime(buffer, sizeof(buffer), "%Y-%m-%dT%H:%M:%S", &utc);
+	snprintf(buffer + length, sizeof(buffer) - length, ".%03uZ", (unsigned)(ms % 1000));
+	return buffer;
+}
+
+// Lines produced while handling one event or command share a timestamp
+void Server::reset_tags()
+{
+	tags.time = 0;
+	tags.received.clear();
+	tags.client.clear();
+	tags.batch.clear();
+	tags.built = 0;
+}
+
+const std::string &Server::tag_prefix(uint32_t capabilities)
+{
+	capabilities &= CAP_TAGS;
+	if (tags.built & 1 << capabilities)
+		return tags.prefixes[capabilities];
+
+	std::string &prefix = tags.prefixes[capabilities];
+	prefix.clear();
+	if (capabilities & CAP_SERVER_TIME)
+	{
+		if (tags.time == 0)
+		{
+			timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			tags.time = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+		}
+		prefix += ";time=" + server_time(tags.time);
+	}
+	if ((capabilities & CAP_BATCH) && !tags.batch.empty())
+		prefix += ";batch=" + tags.batch;
+	if ((capabilities & CAP_MESSAGE_TAGS) && !tags.client.empty())
+		prefix += ";" + tags.client;
+	if (!prefix.empty())
+		prefix = "@" + prefix.substr(1) + " ";
+	tags.built |= 1 << capabilities;
+	return prefix;
+}
+
+void Server::set_tag_time(uint64_t ms)
+{
+	tags.time = ms;
+	tags.built = 0;
+}
+
+void Server::set_tag_batch(const std::string &batch)
+{
+	tags.batch = batch;
+	tags.built = 0;
+}
+
+// Only PRIVMSG and TAGMSG carry the sender's client tags on to recipients
+void Server::relay_client_tags()
+{
+	tags.client = tags.received;
+	tags.built = 0;
+}
+
+// Relayed client tags go in front of the link line, the next server hands
+// them on to its own recipients
+std::string Server::link_tags()
+{
+	return tags.client.empty() ? "" : "@" + tags.client + " ";
+}
+
+// Keeps the client-only (+) tags of an incoming line and returns the rest of it
+std::string Server::strip_tags(const std::string &line)
+{
+	size_t end = line.find(' ');
+
+	if (end == std::string::npos)
+		return "\r";
+	std::vector<std::string> received = split(line.substr(1, end - 1), ';');
+	for (size_t i = 0; i < received.size(); i++)
+		if (received[i].length() > 1 && received[i][0] == '+')
+			tags.received += (tags.received.empty() ? "" : ";") + received[i];
+	return line.substr(line.find_first_not_of(' ', end));
+}
+
+std::string Server::next_batch_id()
+{
+	return to_string(++batch_sequence);
+}
+
+void Server::send_message(int fd, const std::string &message)
+{
+	std::cout << GREEN << "Sending to " << RESET << fd << GREEN ": `" RESET << escape(message) << GREEN "`" RESET << std::endl;
+	std::string ircmsg(message + "\r\n");
+	enqueue(users[fd], ircmsg);
+	// send(fd, ircmsg.c_str(), ircmsg.length(), 0);
+}
+
+// `skip` lists channels, comma separated, that already received the message;
+// their members are left out here and on the servers the message is relayed to.
+// Local members without all of `capabilities` are left out too.
+void Server::broadcast_message(Channel &channel, const std::string &message, User *except, const std::string &skip, uint32_t capabilities)
+{
+	std::cout << BLUE << "Broadcasting to " << RESET << channel.get_name() << BLUE ": `" RESET << escape(message) << BLUE "`" RESET << std::endl;
+	std::string ircmsg(message + "\r\n");
+	std::vector<int> routes;
+	std::vector<Channel *> skipped;
+	std::vector<std::string> names = split(skip, ',');
+	for (size_t i = 0; i < names.size(); i++)
+		if (channels.find(names[i]) != channels.end())
+			skipped.push_back(&channels[names[i]]);
+	// Members a worker writes to cost one record per worker, which fans it out
+	std::vector<bool> workers(shards.size(), false);
+	for (UserList::iterator it = channel.get_users().begin(); it != channel.get_users().end(); ++it)
+	{
+		bool seen = false;
+		for (size_t i = 0; i < skipped.size() && !seen; i++)
+			seen = skipped[i]->has_user(it->first);
+		if (seen)
+			continue;
+		int link = it->second->get_link();
+		if (link != -1)
+		{
+			if (link != current_link && std::find(routes.begin(), routes.end(), link) == routes.end())
+				routes.push_back(link);
+		}
+		else if (it->second == except || it->first == conf.bot.fd)
+			continue;
+		else if ((it->second->get_capabilities() & capabilities) != capabilities)
+			continue;
+		else if (!skipped.empty() || !shards.has_client(it->first))
+			enqueue(users[it->first], ircmsg);
+		else
+		{
+			workers[shards.shard_of(it->first)] = true;
+			(*command_stats[current_command].out)++;
+			*bytes_queued += ircmsg.length();
+		}
+	}
+	for (size_t i = 0; i < workers.size(); i++)
+		if (workers[i])
+			shards.broadcast(i, channel.get_name(), ircmsg, except ? except->get_fd() : -1);
+	// One copy per link that leads to members, each server fans out to its own users
+	for (size_t i = 0; i < routes.size(); i++)
+		link_send(routes[i], link_tags() + "BCAST " + channel.get_name() + (skip.empty() ? "" : " " + skip) + " :" + message);
+}
+
+void Server::server_broadcast_message(const std::string &message, User *except)
+{
+	std::cout << PURPLE << "Broadcasting to " << RESET << "Server" << PURPLE ": `" RESET << escape(message) << PURPLE "`" RESET << std::endl;
+	std::string ircmsg(message + "\r\n");
+	for (UserList::iterator it = users.begin(); it != users.end(); ++it)
+	{
+		if (it->second != except && it->second->get_registered())
+			enqueue(users[it->first], ircmsg);
+	}
+}
+
+void Server::broadcast_user_channels(int fd, const std::string &message, User *except)
+{
+	std::cout << MUSTARD << "Broadcasting to " << RESET << users[fd]->get_nick() << "'s channels" << MUSTARD ": `" RESET << escape(message) << MUSTARD "`" RESET << std::endl;
+	std::string ircmsg(message + "\r\n");
+	for (std::map<std::string, Channel>::iterator it = channels.begin(); it != channels.end(); ++it)
+		if (it->second.has_user(fd))
+			for (UserList::iterator cit = it->second.get_users().begin(); cit != it->second.get_users().end(); ++cit)
+				if (cit->second != except)
+					enqueue(users[cit->first], ircmsg);
+}
+
+pollfd Server::make_pfd(int fd, int events, int revents)
+{
+	pollfd pfd = initialized<pollfd>();
+
+	pfd.fd = fd;
+	pfd.events = events;
+	pfd.revents = revents;
+	return pfd;
+}
+
+void Server::terminate_connection(int fd, const std::string &reason)
+{
+	if (users.find(fd) == users.end())
+		return;
+	capture.record(CAPTURE_DISCONNECT, fd, "");
+	if (users[fd]->get_address() != 0)
+		connections_per_ip.decrement(users[fd]->get_address());
+	forget_dns_lookup(fd);
+	broadcast_user_channels(fd, ":" + users[fd]->get_hostmask(users[fd]->get_nick()) + " QUIT :" + reason, users[fd]);
+	if (!links.empty() && is_linked_user(users[fd]))
+		propagate("QUIT " + users[fd]->get_nick() + " :" + reason);
+	if (is_online(users[fd]))
+	{
+		notify_watchers(users[fd], false);
+		remember_nickname(users[fd]);
+	}
+	forget_nickname(users[fd]);
+	clear_monitor(fd);
+	if (input_queued.erase(fd))
+		input_queue.erase(std::find(input_queue.begin(), input_queue.end(), fd));
+	for (std::map<std::string, Channel>::iterator it = channels.begin(); it != channels.end(); ++it)
+		it->second.remove_user(fd);
+	if (shards.is_running())
+		shards.drop(fd);
+	tls.detach(fd);
+	delete users[fd];
+	users.erase(fd);
+	remove_pfd(fd);
+	close(fd);
+}
+
+void Server::remove_pfd(int fd)
+{
+	for (std::vector<pollfd>::iterator it = pfds.begin(); it != pfds.end(); ++it)
+	{
+		if (it->fd == fd)
+		{
+			pfds.erase(it);
+			break;
+		}
+	}
+	repoll = true;
+}
+
+void Server::init_metrics()
+{
+	size_t count = sizeof(commands) / sizeof(commands[0]);
+
+	for (size_t i = 0; i <= count; i++)
+	{
+		std::string label = "{command=\"" + (i < count ? commands[i].name : std::string("other")) + "\"}";
+		CommandStats stats;
+
+		stats.in = &metrics.counter("ircserv_messages_in_total" + label);
+		stats.out = &metrics.counter("ircserv_messages_out_total" + label);
+		stats.dispatch = &metrics.histogram("ircserv_dispatch_seconds" + label);
+		command_stats.push_back(stats);
+	}
+	current_command = count;
+	bytes_queued = &metrics.counter("ircserv_bytes_queued_total");
+	connections_total = &metrics.counter("ircserv_connections_total");
+	connections_rejected = &metrics.counter("ircserv_connections_rejected_total");
+	link_messages = &metrics.counter("ircserv_link_messages_total");
+	link_writes = &metrics.counter("ircserv_link_writes_total");
+	tls_handshakes = &metrics.counter("ircserv_tls_handshakes_total");
+	tls_resumed = &metrics.counter("ircserv_tls_resumed_total");
+	tls_kernel_send = &metrics.counter("ircserv_tls_kernel_send_total");
+	tls_failures = &metrics.counter("ircserv_tls_failures_total");
+	filter_matches = &metrics.counter("ircserv_filter_matches_total");
+	loop_latency = &metrics.histogram("ircserv_loop_iteration_seconds");
+	parse_latency = &metrics.histogram("ircserv_parse_seconds");
+}
+
+void Server::update_metrics()
+{
+	int64_t connections = 0, registered = 0, sendq = 0;
+
+	for (UserList::iterator it = users.begin(); it != users.end(); ++it)
+	{
+		if (it->first >= 0)
+			connections++;
+		if (it->second->get_registered())
+			registered++;
+		sendq += it->second->get_sendbuffer().length();
+	}
+	metrics.gauge("ircserv_connections") = connections;
+	metrics.gauge("ircserv_registered_users") = registered;
+	metrics.gauge("ircserv_channels") = channels.size();
+	metrics.gauge("ircserv_sendq_bytes") = sendq;
+	metrics.gauge("ircserv_links") = links.size();
+	metrics.gauge("ircserv_input_queue") = input_queue.size();
+	metrics.gauge("ircserv_shard_backlog_bytes") = shards.get_backlog_bytes();
+}
+
+void Server::open_tls_listener()
+{
+	int on = 1;
+	sockaddr_in addr = initialized<sockaddr_in>();
+
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = INADDR_ANY;
+	addr.sin_port = htons(conf.tls_port);
+
+	insist(tls_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP), -1, "tls socket failed");
+	insist(setsockopt(tls_fd, SOL_SOCKET, SO_REUSEADDR, (char *)&on, sizeof(int)), -1, "tls setsockopt failed");
+	insist(fcntl(tls_fd, F_SETFL, O_NONBLOCK), -1, "tls fcntl failed");
+	insist(bind(tls_fd, (sockaddr *)&addr, sizeof(addr)) != 0, true, "tls bind failed");
+	insist(listen(tls_fd, conf.listen_backlog), -1, "tls listen failed");
+
+	pfds.push_back(make_pfd(tls_fd, POLLIN, 0));
+}
+
+// Counts the outcome once, a connection whose handshake fails is dropped
+bool Server::tls_handshake(int fd)
+{
+	int ret = tls.handshake(fd);
+
+	if (ret == TLS_WANT)
+		return true;
+	if (ret == TLS_FAILED)
+	{
+		(*tls_failures)++;
+		return false;
+	}
+	(*tls_handshakes)++;
+	if (tls.is_resumed(fd))
+		(*tls_resumed)++;
+	if (tls.is_kernel_send(fd))
+		(*tls_kernel_send)++;
+	return true;
+}
+
+// Records that arrived with the end of the handshake are already decrypted
+// and buffered by OpenSSL, poll would not report them again so they are read
+// right away
+bool Server::receive_tls(int fd)
+{
+	char buffer[4096];
+	// Stays -1, still open, when the buffer is already full and nothing is read
+	ssize_t length = -1;
+
+	if (!tls.is_ready(fd))
+	{
+		if (!tls_handshake(fd))
+			return false;
+		if (!tls.is_ready(fd))
+			return true;
+	}
+	while (users[fd]->get_data().length() < conf.command_budget * conf.max_message_length && (length = tls.read(fd, buffer, sizeof(buffer))) > 0)
+	{
+		users[fd]->append_data(std::string(buffer, length));
+		users[fd]->set_last_activity();
+	}
+	return length != 0;
+}
+
+// Shard workers write the same plaintext to every member, which rules out
+// TLS unless the kernel encrypts the records, and clients that negotiated tags
+bool Server::is_shardable(int fd)
+{
+	return (!tls.is_tls(fd) || tls.is_kernel_send(fd)) && !(users[fd]->get_capabilities() & CAP_TAGS);
+}
+
+// Capabilities changed after joining, moves the client between worker and
+// front process fan-out
+void Server::reshard(int fd)
+{
+	shards.drop(fd);
+	if (!is_shardable(fd))
+		return;
+	for (ChannelList::iterator it = channels.begin(); it != channels.end(); ++it)
+		if (it->second.has_user(fd))
+			shard_join(it->second.get_name(), fd);
+}
+
+// Lines the workers never read go out from here, in the order they were
+// queued, before the front process takes every client back. A plain
+// connection that cannot take all of them at once is closed rather than
+// left with a gap.
+void Server::stop_shards()
+{
+	std::vector<ShardLine> lines = shards.halt();
+	std::set<int> replayed;
+
+	for (size_t i = 0; i < lines.size(); i++)
+	{
+		ShardLine &line = lines[i];
+		if (line.channel.empty())
+		{
+			if (users.find(line.fd) != users.end())
+			{
+				users[line.fd]->append_sendbuffer(line.message);
+				replayed.insert(line.fd);
+			}
+			continue;
+		}
+		ChannelList::iterator it = channels.find(line.channel);
+		if (it == channels.end())
+			continue;
+		for (UserList::iterator uit = it->second.get_users().begin(); uit != it->second.get_users().end(); ++uit)
+			if (uit->first != line.fd && shards.has_client(uit->first) && shards.shard_of(uit->first) == line.shard)
+			{
+				uit->second->append_sendbuffer(line.message);
+				replayed.insert(uit->first);
+			}
+	}
+	shards.stop();
+	for (std::set<int>::iterator it = replayed.begin(); it != replayed.end(); ++it)
+	{
+		if (users.find(*it) == users.end() || tls.is_tls(*it))
+			continue;
+		std::string &buffer = users[*it]->get_sendbuffer();
+		ssize_t sent = send(*it, buffer.c_str(), buffer.length(), MSG_NOSIGNAL | MSG_DONTWAIT);
+		bool complete = sent == (ssize_t)buffer.length();
+		users[*it]->clear_sendbuffer();
+		if (!complete)
+			terminate_connection(*it, "SendQ exceeded");
+	}
+}
+
+// Whatever the front process still had queued for a client it hands over
+// goes first, the worker is the only one writing to it from then on
+void Server::shard_join(const std::string &channel, int fd)
+{
+	bool handed_over = !shards.has_client(fd);
+
+	shards.join(channel, fd);
+	std::string &pending = users[fd]->get_sendbuffer();
+	if (handed_over && !pending.empty() && shards.send(fd, pending))
+		users[fd]->clear_sendbuffer();
+}
+
+void Server::open_metrics_listener()
+{
+	int on = 1;
+	sockaddr_in addr = initialized<sockaddr_in>();
+
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(conf.metrics_port);
+
+	insist(metrics_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP), -1, "metrics socket failed");
+	insist(setsockopt(metrics_fd, SOL_SOCKET, SO_REUSEADDR, (char *)&on, sizeof(int)), -1, "metrics setsockopt failed");
+	insist(fcntl(metrics_fd, F_SETFL, O_NONBLOCK), -1, "metrics fcntl failed");
+	insist(bind(metrics_fd, (sockaddr *)&addr, sizeof(addr)) != 0, true, "metrics bind failed");
+	insist(listen(metrics_fd, 16), -1, "metrics listen failed");
+
+	pfds.push_back(make_pfd(metrics_fd, POLLIN, 0));
+}
+
+void Server::accept_metrics_client()
+{
+	int client_fd;
+
+	while ((client_fd = accept4(metrics_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1)
+	{
+		pfds.push_back(make_pfd(client_fd, POLLIN | POLLOUT, 0));
+		metrics_clients[client_fd] = "";
+	}
+}
+
+// Answers any request with the prometheus text exposition, sent over as many
+// POLLOUTs as the socket needs, and closes the connection once it is out
+void Server::serve_metrics_client(int fd, int revents)
+{
+	std::string &response = metrics_clients[fd];
+
+	if (response.empty())
+	{
+		if (!(revents & (POLLIN | POLLHUP | POLLERR)))
+			return;
+		char buffer[1024];
+		while (recv(fd, buffer, sizeof(buffer), 0) > 0)
+			;
+		update_metrics();
+		std::string body = metrics.render_prometheus();
+		response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " + to_string(body.length()) + "\r\nConnection: close\r\n\r\n" + body;
+	}
+	ssize_t sent = send(fd, response.c_str(), response.length(), MSG_NOSIGNAL | MSG_DONTWAIT);
+	if (sent > 0)
+		response.erase(0, sent);
+	if (response.empty() || (sent == -1 && errno != EAGAIN && errno != EWOULDBLOCK))
+		close_metrics_client(fd);
+}
+
+void Server::close_metrics_client(int fd)
+{
+	metrics_clients.erase(fd);
+	remove_pfd(fd);
+	close(fd);
+}
+
+static sigset_t handled_signals()
+{
+	sigset_t mask;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGUSR2);
+	sigaddset(&mask, SIGHUP);
+	return mask;
+}
+
+void Server::open_signal_fd()
+{
+	sigset_t mask = handled_signals();
+
+	insist(sigprocmask(SIG_BLOCK, &mask, NULL), -1, "sigprocmask failed");
+	insist(signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC), -1, "signalfd failed");
+	pfds.push_back(make_pfd(signal_fd, POLLIN, 0));
+}
+
+void Server::handle_signals()
+{
+	signalfd_siginfo info;
+
+	while (read(signal_fd, &info, sizeof(info)) == sizeof(info))
+	{
+		if (info.ssi_signo == SIGUSR2)
+			hot_restart();
+		else if (info.ssi_signo == SIGHUP)
+			reload_config();
+	}
+}
+
+// Starts the new binary with one end of a socketpair, hands it every socket
+// and the state that goes with them, and stops serving once it acknowledges.
+// On any failure the child is killed and this process carries on as before,
+// except for the TLS clients, which are gone by then.
+void Server::hot_restart()
+{
+	int sv[2];
+
+	if (executable.empty() || socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1)
+	{
+		std::cout << GREY << "WARNING: hot restart unavailable" << RESET << std::endl;
+		return;
+	}
+	fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+	history.flush();
+	capture.flush();
+	snapshot_writer.wait();
+
+	// Built before forking, the child only makes async-signal-safe calls
+	std::string port = to_string(conf.port);
+	std::string handoff = std::string(HANDOFF_ENV) + "=" + to_string(sv[1]);
+	std::vector<char *> argv, envp;
+	argv.push_back(const_cast<char *>(executable.c_str()));
+	argv.push_back(const_cast<char *>(port.c_str()));
+	argv.push_back(const_cast<char *>(conf.password.c_str()));
+	argv.push_back(NULL);
+	for (char **env = environ; *env; env++)
+		if (std::strncmp(*env, HANDOFF_ENV "=", std::strlen(HANDOFF_ENV "=")) != 0)
+			envp.push_back(*env);
+	envp.push_back(const_cast<char *>(handoff.c_str()));
+	envp.push_back(NULL);
+	sigset_t mask = handled_signals();
+
+	pid_t pid = fork();
+	if (pid == 0)
+	{
+		sigprocmask(SIG_UNBLOCK, &mask, NULL);
+		close(sv[0]);
+		execve(argv[0], &argv[0], &envp[0]);
+		_exit(EXIT_FAILURE);
+	}
+	close(sv[1]);
+
+	// TLS sessions cannot be handed over, those clients quit here like any
+	// closed connection so their channels and linked servers hear of it
+	if (pid != -1)
+	{
+		std::vector<int> secure;
+		for (UserList::iterator it = users.begin(); it != users.end(); ++it)
+			if (it->first >= 0 && tls.is_tls(it->first))
+				secure.push_back(it->first);
+		for (size_t i = 0; i < secure.size(); i++)
+		{
+			send_closing_error(secure[i], "Server restarting");
+			terminate_connection(secure[i], "Server restarting");
+		}
+		flush_links();
+		shards.notify();
+	}
+
+	std::vector<int> fds;
+	std::string state = serialize_state(fds);
+	if (pid == -1 || !handoff_send(sv[0], fds, state) || !handoff_wait_ack(sv[0]))
+	{
+		std::cout << GREY << "WARNING: hot restart failed, still serving" << RESET << std::endl;
+		close(sv[0]);
+		if (pid != -1)
+		{
+			kill(pid, SIGKILL);
+			waitpid(pid, NULL, 0);
+		}
+		return;
+	}
+	close(sv[0]);
+	std::cout << "Handed off " << fds.size() << " sockets to pid " << pid << std::endl;
+	running = false;
+}
+
+// Ban, exception and invite exception lists: u32 count, then mask, setter and time
+static void put_masks(std::string &out, Channel &channel)
+{
+	for (int mode = MODE_BAN; mode <= MODE_INVEX; mode <<= 1)
+	{
+		const std::vector<MaskList::Entry> &entries = channel.get_mask_entries(mode);
+		put_u32(out, entries.size());
+		for (size_t i = 0; i < entries.size(); i++)
+		{
+			put_str(out, entries[i].mask);
+			put_str(out, entries[i].setter);
+			put_u64(out, entries[i].time);
+		}
+	}
+}
+
+static void read_masks(ByteReader &reader, Channel &channel)
+{
+	for (int mode = MODE_BAN; mode <= MODE_INVEX; mode <<= 1)
+	{
+		uint32_t count = reader.u32();
+		for (uint32_t i = 0; i < count && reader.good(); i++)
+		{
+			std::string mask = reader.str();
+			std::string setter = reader.str();
+			time_t time = reader.u64();
+			if (reader.good())
+				channel.get_masks(mode).add(mask, setter, time);
+		}
+	}
+}
+
+// Sockets are referenced by their descriptor number in this process, the
+// receiver maps them through the order in which they were passed. TLS
+// sessions live in this process's OpenSSL state and cannot be passed on,
+// hot_restart has already quit those clients and they come back with a
+// ticket the successor accepts since it inherits the ticket keys.
+std::string Server::serialize_state(std::vector<int> &fds)
+{
+	std::string state;
+
+	int listeners[] = {server_fd, metrics_fd, link_fd};
+	for (size_t i = 0; i < 3; i++)
+		if (listeners[i] != -1)
+			fds.push_back(listeners[i]);
+	if (tls_fd != -1)
+		fds.push_back(tls_fd);
+	size_t listener_count = fds.size();
+	for (UserList::iterator it = users.begin(); it != users.end(); ++it)
+		if (it->first >= 0 && !tls.is_tls(it->first))
+			fds.push_back(it->first);
+
+	put_u32(state, fds.size());
+	for (size_t i = 0; i < fds.size(); i++)
+		put_u32(state, fds[i]);
+	for (size_t i = 0; i < 3; i++)
+		put_u32(state, listeners[i]);
+
+	put_u32(state, fds.size() - listener_count);
+	for (UserList::iterator it = users.begin(); it != users.end(); ++it)
+	{
+		User *user = it->second;
+		if (it->first < 0 || tls.is_tls(it->first))
+			continue;
+		put_u32(state, it->first);
+		put_str(state, user->get_nick());
+		put_str(state, user->get_user());
+		put_str(state, user->get_host());
+		put_str(state, user->get_real());
+		put_str(state, user->get_data());
+		put_str(state, user->get_sendbuffer());
+		put_u8(state, user->get_registered() << 0 | user->get_auth() << 1 | user->is_server_operator() << 2
+			| user->get_welcome_pending() << 3 | (dns_lookups.find(it->first) != dns_lookups.end()) << 4);
+		put_u32(state, user->get_address());
+		put_u64(state, user->get_last_activity());
+		put_u64(state, user->get_last_ping());
+	}
+
+	std::vector<int> opers;
+	for (UserList::iterator it = operators.begin(); it != operators.end(); ++it)
+		if (it->first >= 0)
+			opers.push_back(it->first);
+	put_u32(state, opers.size());
+	for (size_t i = 0; i < opers.size(); i++)
+		put_u32(state, opers[i]);
+
+	put_u32(state, channels.size());
+	for (ChannelList::iterator it = channels.begin(); it != channels.end(); ++it)
+	{
+		Channel &channel = it->second;
+		UserList *lists[3] = {&channel.get_users(), &channel.get_operators(), &channel.get_invited()};
+
+		put_str(state, channel.get_name());
+		put_str(state, channel.get_key());
+		put_str(state, channel.get_topic());
+		put_u32(state, channel.get_mode());
+		put_u64(state, channel.get_limit());
+		for (size_t i = 0; i < 3; i++)
+		{
+			std::vector<int> members;
+			for (UserList::iterator uit = lists[i]->begin(); uit != lists[i]->end(); ++uit)
+				if (uit->first >= 0)
+					members.push_back(uit->first);
+			put_u32(state, members.size());
+			for (size_t j = 0; j < members.size(); j++)
+				put_u32(state, members[j]);
+		}
+	}
+
+	// Last so that the state of a build without them still restores
+	put_u32(state, tls_fd);
+	put_str(state, tls.get_ticket_keys());
+
+	std::vector<int> negotiated;
+	for (UserList::iterator it = users.begin(); it != users.end(); ++it)
+		if (it->first >= 0 && !tls.is_tls(it->first) && (it->second->get_capabilities() || it->second->is_negotiating()))
+			negotiated.push_back(it->first);
+	put_u32(state, negotiated.size());
+	for (size_t i = 0; i < negotiated.size(); i++)
+	{
+		put_u32(state, negotiated[i]);
+		put_u32(state, users[negotiated[i]]->get_capabilities());
+		put_u8(state, users[negotiated[i]]->is_negotiating());
+	}
+
+	std::vector<int> watching;
+	for (std::map<int, MonitorList>::iterator it = monitoring.begin(); it != monitoring.end(); ++it)
+		if (!it->second.empty() && !tls.is_tls(it->first))
+			watching.push_back(it->first);
+	put_u32(state, watching.size());
+	for (size_t i = 0; i < watching.size(); i++)
+	{
+		std::vector<std::string> watched(monitoring[watching[i]].begin(), monitoring[watching[i]].end());
+		put_u32(state, watching[i]);
+		put_str(state, join(watched.begin(), watched.end(), ","));
+	}
+
+	std::vector<Channel *> masked;
+	for (ChannelList::iterator it = channels.begin(); it != channels.end(); ++it)
+		if (!it->second.get_mask_entries(MODE_BAN).empty() || !it->second.get_mask_entries(MODE_EXCEPT).empty() || !it->second.get_mask_entries(MODE_INVEX).empty())
+			masked.push_back(&it->second);
+	put_u32(state, masked.size());
+	for (size_t i = 0; i < masked.size(); i++)
+	{
+		put_str(state, masked[i]->get_name());
+		put_masks(state, *masked[i]);
+	}
+
+	const std::vector<Filter::Entry> &filters = filter.get_entries();
+	put_u32(state, filters.size());
+	for (size_t i = 0; i < filters.size(); i++)
+	{
+		put_str(state, filters[i].pattern);
+		put_u8(state, filters[i].action);
+		put_str(state, filters[i].setter);
+		put_u64(state, filters[i].time);
+	}
+
+	std::vector<int> away;
+	for (UserList::iterator it = users.begin(); it != users.end(); ++it)
+		if (it->first >= 0 && !tls.is_tls(it->first) && !it->second->get_away().empty())
+			away.push_back(it->first);
+	put_u32(state, away.size());
+	for (size_t i = 0; i < away.size(); i++)
+	{
+		put_u32(state, away[i]);
+		put_str(state, users[away[i]]->get_away());
+	}
+
+	std::vector<const Whowas::Record *> gone;
+	whowas.oldest_first(gone);
+	put_u32(state, gone.size());
+	for (size_t i = 0; i < gone.size(); i++)
+	{
+		put_str(state, gone[i]->nick);
+		put_str(state, gone[i]->user);
+		put_str(state, gone[i]->host);
+		put_str(state, gone[i]->real);
+		put_str(state, gone[i]->server);
+		put_u64(state, gone[i]->time);
+	}
+
+	// Nick times settle collisions once the links come back
+	std::vector<int> named;
+	for (UserList::iterator it = users.begin(); it != users.end(); ++it)
+		if (it->first >= 0 && !tls.is_tls(it->first))
+			named.push_back(it->first);
+	put_u32(state, named.size());
+	for (size_t i = 0; i < named.size(); i++)
+	{
+		put_u32(state, named[i]);
+		put_u64(state, users[named[i]]->get_nick_time());
+	}
+	return state;
+}
+
+// Returns the connections whose hostname lookup was still in flight
+std::vector<int> Server::restore_state(const std::string &state, const std::vector<int> &fds)
+{
+	ByteReader reader(state.c_str(), state.length());
+	std::map<int, int> fd_map;
+	std::vector<int> pending;
+
+	uint32_t count = reader.u32();
+	for (uint32_t i = 0; i < count && reader.good(); i++)
+	{
+		int old_fd = reader.u32();
+		if (i < fds.size())
+			fd_map[old_fd] = fds[i];
+	}
+	insist(reader.good() && fd_map.size() == fds.size(), false, "corrupt handoff state");
+
+	int *listeners[] = {&server_fd, &metrics_fd, &link_fd};
+	for (size_t i = 0; i < 3; i++)
+	{
+		int old_fd = reader.u32();
+		if (old_fd == -1 || fd_map.find(old_fd) == fd_map.end())
+			continue;
+		*listeners[i] = fd_map[old_fd];
+		pfds.push_back(make_pfd(*listeners[i], POLLIN, 0));
+	}
+	insist(server_fd, -1, "corrupt handoff state");
+
+	count = reader.u32();
+	for (uint32_t i = 0; i < count && reader.good(); i++)
+	{
+		int fd = fd_map[reader.u32()];
+		User *user = new User();
+
+		users[fd] = user;
+		user->set_fd(fd);
+		set_nickname(user, reader.str());
+		user->set_user(reader.str());
+		user->set_host(reader.str());
+		user->set_real(reader.str());
+		user->append_data(reader.str());
+		user->set_sendbuffer(reader.str());
+		uint8_t flags = reader.u8();
+		user->set_registered(flags & 1 << 0);
+		user->set_auth(flags & 1 << 1);
+		user->set_server_operator(flags & 1 << 2);
+		user->set_welcome_pending(flags & 1 << 3);
+		user->set_address(reader.u32());
+		user->set_last_activity(reader.u64());
+		user->set_last_ping(reader.u64());
+		if (flags & 1 << 4)
+			pending.push_back(fd);
+		if (user->get_address() != 0)
+			connections_per_ip.increment(user->get_address());
+		pfds.push_back(make_pfd(fd, POLLIN | POLLOUT, 0));
+		if (!user->get_data().empty())
+			queue_input(fd);
+	}
+
+	count = reader.u32();
+	for (uint32_t i = 0; i < count && reader.good(); i++)
+	{
+		int fd = fd_map[reader.u32()];
+		if (users.find(fd) != users.end())
+			operators[fd] = users[fd];
+	}
+
+	count = reader.u32();
+	for (uint32_t i = 0; i < count && reader.good(); i++)
+	{
+		std::string name = reader.str();
+		std::string key = reader.str();
+		std::string topic = reader.str();
+		Channel &channel = channels[name] = Channel(name, key, topic);
+		channel.set_mode(reader.u32());
+		channel.set_limit(reader.u64());
+		UserList *lists[3] = {&channel.get_users(), &channel.get_operators(), &channel.get_invited()};
+		for (size_t l = 0; l < 3; l++)
+		{
+			uint32_t members = reader.u32();
+			for (uint32_t j = 0; j < members && reader.good(); j++)
+			{
+				int fd = fd_map[reader.u32()];
+				if (users.find(fd) != users.end())
+					(*lists[l])[fd] = users[fd];
+			}
+		}
+	}
+
+	if (reader.good() && reader.remaining() > 0)
+	{
+		int old_fd = reader.u32();
+		std::string keys = reader.str();
+		if (old_fd != -1 && fd_map.find(old_fd) != fd_map.end())
+		{
+			tls_fd = fd_map[old_fd];
+			if (tls.is_enabled())
+				pfds.push_back(make_pfd(tls_fd, POLLIN, 0));
+			else
+			{
+				close(tls_fd);
+				tls_fd = -1;
+			}
+		}
+		tls.set_ticket_keys(keys);
+	}
+	if (reader.good() && reader.remaining() > 0)
+	{
+		count = reader.u32();
+		for (uint32_t i = 0; i < count && reader.good(); i++)
+		{
+			int fd = fd_map[reader.u32()];
+			uint32_t capabilities = reader.u32();
+			bool negotiating = reader.u8();
+			if (users.find(fd) == users.end())
+				continue;
+			users[fd]->set_capabilities(capabilities);
+			users[fd]->set_negotiating(negotiating);
+		}
+	}
+	if (reader.good() && reader.remaining() > 0)
+	{
+		count = reader.u32();
+		for (uint32_t i = 0; i < count && reader.good(); i++)
+		{
+			int fd = fd_map[reader.u32()];
+			std::vector<std::string> watched = split(reader.str(), ',');
+			if (users.find(fd) == users.end())
+				continue;
+			for (size_t j = 0; j < watched.size(); j++)
+			{
+				monitoring[fd].insert(watched[j]);
+				watchers[watched[j]].insert(fd);
+			}
+		}
+	}
+	if (reader.good() && reader.remaining() > 0)
+	{
+		count = reader.u32();
+		for (uint32_t i = 0; i < count && reader.good(); i++)
+		{
+			std::string name = reader.str();
+			Channel scratch;
+			read_masks(reader, channels.find(name) != channels.end() ? channels[name] : scratch);
+		}
+	}
+	if (reader.good() && reader.remaining() > 0)
+	{
+		std::vector<Filter::Entry> filters;
+		count = reader.u32();
+		for (uint32_t i = 0; i < count && reader.good(); i++)
+		{
+			Filter::Entry entry;
+			entry.pattern = reader.str();
+			entry.action = reader.u8();
+			entry.setter = reader.str();
+			entry.time = reader.u64();
+			if (!entry.pattern.empty())
+				filters.push_back(entry);
+		}
+		if (reader.good())
+			filter.assign(filters);
+	}
+	if (reader.good() && reader.remaining() > 0)
+	{
+		count = reader.u32();
+		for (uint32_t i = 0; i < count && reader.good(); i++)
+		{
+			int fd = fd_map[reader.u32()];
+			std::string away = reader.str();
+			if (reader.good() && users.find(fd) != users.end())
+				users[fd]->set_away(away);
+		}
+	}
+	if (reader.good() && reader.remaining() > 0)
+	{
+		count = reader.u32();
+		for (uint32_t i = 0; i < count && reader.good(); i++)
+		{
+			std::string nick = reader.str();
+			std::string user = reader.str();
+			std::string host = reader.str();
+			std::string real = reader.str();
+			std::string server = reader.str();
+			time_t time = reader.u64();
+			if (reader.good())
+				whowas.add(nick, user, host, real, server, time);
+		}
+	}
+	if (reader.good() && reader.remaining() > 0)
+	{
+		count = reader.u32();
+		for (uint32_t i = 0; i < count && reader.good(); i++)
+		{
+			int fd = fd_map[reader.u32()];
+			time_t time = reader.u64();
+			if (reader.good() && users.find(fd) != users.end())
+				users[fd]->set_nick_time(time);
+		}
+	}
+	insist(reader.good(), false, "corrupt handoff state");
+	return pending;
+}
+
+// Takes over from the process that exec'd us, the handoff socket is closed
+// once the state is restored and the previous process told to exit
+void Server::adopt_handoff(int sock)
+{
+	std::vector<int> fds;
+	std::string state;
+
+	insist(handoff_receive(sock, fds, state), false, "failed to receive handoff");
+	std::vector<int> pending = restore_state(state, fds);
+	start_services();
+	for (size_t i = 0; i < pending.size(); i++)
+	{
+		sockaddr_in addr = initialized<sockaddr_in>();
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = users[pending[i]]->get_address();
+		resolve_host(users[pending[i]], *(sockaddr *)&addr);
+	}
+	insist(handoff_ack(sock), false, "failed to acknowledge handoff");
+	close(sock);
+	std::cout << "Adopted " << users.size() << " connections and " << channels.size() << " channels" << std::endl;
+}
+
+LinkCommandInfo Server::link_commands[] = {
+	{"SERVER", &Server::LINK_SERVER},
+	{"SERVERS", &Server::LINK_SERVERS},
+	{"SQUIT", &Server::LINK_SQUIT},
+	{"BURST", &Server::LINK_BURST},
+	{"ENDBURST", &Server::LINK_ENDBURST},
+	{"UID", &Server::LINK_UID},
+	{"NICK", &Server::LINK_NICK},
+	{"QUIT", &Server::LINK_QUIT},
+	{"CHAN", &Server::LINK_CHAN},
+	{"JOIN", &Server::LINK_JOIN},
+	{"PART", &Server::LINK_PART},
+	{"OP", &Server::LINK_OP},
+	{"INVITE", &Server::LINK_INVITE},
+	{"BCAST", &Server::LINK_BCAST},
+	{"MASK", &Server::LINK_MASK},
+	{"AWAY", &Server::LINK_AWAY},
+	{"TO", &Server::LINK_TO},
+	{"ERROR", &Server::LINK_ERROR},
+};
+
+#define LINK_SENDQ_MAX (16 * 1024 * 1024)
+#define LINK_HANDSHAKE_TIMEOUT 30
+
+void Server::open_link_listener()
+{
+	int on = 1;
+	sockaddr_in addr = initialized<sockaddr_in>();
+
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = INADDR_ANY;
+	addr.sin_port = htons(conf.link_port);
+
+	insist(link_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP), -1, "link socket failed");
+	insist(setsockopt(link_fd, SOL_SOCKET, SO_REUSEADDR, (char *)&on, sizeof(int)), -1, "link setsockopt failed");
+	insist(fcntl(link_fd, F_SETFL, O_NONBLOCK), -1, "link fcntl failed");
+	insist(bind(link_fd, (sockaddr *)&addr, sizeof(addr)) != 0, true, "link bind failed");
+	insist(listen(link_fd, 16), -1, "link listen failed");
+
+	pfds.push_back(make_pfd(link_fd, POLLIN, 0));
+}
+
+static Link make_link(bool outgoing)
+{
+	Link link;
+
+	link.outgoing = outgoing;
+	link.connected = !outgoing;
+	link.registered = false;
+	link.bursting = false;
+	link.deadline = std::time(NULL) + LINK_HANDSHAKE_TIMEOUT;
+	return link;
+}
+
+void Server::accept_link()
+{
+	int fd;
+
+	while ((fd = accept4(link_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1)
+	{
+		links[fd] = make_link(false);
+		pfds.push_back(make_pfd(fd, POLLIN | POLLOUT, 0));
+		std::cout << "Link connection accepted on fd " << fd << std::endl;
+	}
+}
+
+// link_connect is "<host> <port>", the connection completes asynchronously
+void Server::connect_link()
+{
+	std::vector<std::string> target = split(conf.link_connect, ' ');
+	addrinfo hints = initialized<addrinfo>();
+	addrinfo *result = NULL;
+
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if (target.size() != 2 || getaddrinfo(target[0].c_str(), target[1].c_str(), &hints, &result) != 0)
+	{
+		std::cout << GREY << "WARNING: cannot resolve link target " << conf.link_connect << RESET << std::endl;
+		return;
+	}
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+	if (fd != -1 && connect(fd, result->ai_addr, result->ai_addrlen) == -1 && errno != EINPROGRESS)
+	{
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(result);
+	if (fd == -1)
+		return;
+	links[fd] = make_link(true);
+	pfds.push_back(make_pfd(fd, POLLIN | POLLOUT, 0));
+	std::cout << "Connecting link to " << conf.link_connect << " on fd " << fd << std::endl;
+}
+
+// Drops stuck links and redials the configured uplink
+void Server::check_links()
+{
+	time_t now = std::time(NULL);
+	bool uplink = false;
+	std::vector<std::pair<int, std::string> > doomed;
+
+	for (std::map<int, Link>::iterator it = links.begin(); it != links.end(); ++it)
+	{
+		if (it->second.outgoing)
+			uplink = true;
+		if (!it->second.registered && now >= it->second.deadline)
+			doomed.push_back(std::make_pair(it->first, std::string("Handshake timeout")));
+		else if (it->second.outbuf.length() > LINK_SENDQ_MAX)
+			doomed.push_back(std::make_pair(it->first, std::string("SendQ exceeded")));
+	}
+	for (size_t i = 0; i < doomed.size(); i++)
+		close_link(doomed[i].first, doomed[i].second);
+	if (!uplink && !conf.link_connect.empty() && !conf.link_password.empty() && now >= link_retry_at)
+	{
+		link_retry_at = now + conf.link_retry;
+		connect_link();
+	}
+}
+
+void Server::process_link_events(int fd, int revents)
+{
+	Link &link = links[fd];
+
+	if (!link.connected)
+	{
+		if (!(revents & (POLLOUT | POLLERR | POLLHUP)))
+			return;
+		int err = 0;
+		socklen_t len = sizeof(err);
+		getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+		if (err != 0)
+		{
+			close_link(fd, std::strerror(err));
+			return;
+		}
+		link.connected = true;
+		link_send(fd, "SERVER " + conf.name + " " + conf.link_password + " :" + known_servers(fd));
+		return;
+	}
+	if (revents & POLLIN)
+	{
+		receive_link(fd);
+		if (links.find(fd) == links.end())
+			return;
+	}
+	if (revents & (POLLHUP | POLLERR))
+	{
+		close_link(fd, "Connection closed");
+		return;
+	}
+	if (revents & POLLOUT)
+		flush_link(fd);
+}
+
+void Server::receive_link(int fd)
+{
+	char buffer[4096];
+	ssize_t length;
+
+	while ((length = recv(fd, buffer, sizeof(buffer), 0)) > 0)
+		links[fd].inbuf.append(buffer, length);
+	if (length == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+	{
+		close_link(fd, "Connection closed");
+		return;
+	}
+
+	size_t start = 0, end;
+	current_link = fd;
+	while (links.find(fd) != links.end() && (end = links[fd].inbuf.find('\n', start)) != std::string::npos)
+	{
+		std::string line = links[fd].inbuf.substr(start, end - start);
+		start = end + 1;
+		if (!line.empty() && line[line.length() - 1] == '\r')
+			line.erase(line.length() - 1);
+		if (!line.empty())
+			parse_link_line(fd, line);
+	}
+	current_link = -1;
+	if (links.find(fd) != links.end())
+		links[fd].inbuf.erase(0, start);
+}
+
+void Server::flush_link(int fd)
+{
+	std::string &outbuf = links[fd].outbuf;
+
+	if (outbuf.empty() || !links[fd].connected)
+		return;
+	ssize_t sent = send(fd, outbuf.c_str(), outbuf.length(), MSG_NOSIGNAL);
+	if (sent > 0)
+	{
+		outbuf.erase(0, sent);
+		(*link_writes)++;
+	}
+}
+
+// Called once per loop iteration, everything queued for a link since the
+// last one goes out in a single write
+void Server::flush_links()
+{
+	for (std::map<int, Link>::iterator it = links.begin(); it != links.end(); ++it)
+		flush_link(it->first);
+}
+
+// Queued only, see flush_links
+void Server::link_send(int fd, const std::string &line)
+{
+	links[fd].outbuf += line + "\r\n";
+	(*link_messages)++;
+}
+
+// Sends to every established link except the one the current line came from
+void Server::propagate(const std::string &line)
+{
+	for (std::map<int, Link>::iterator it = links.begin(); it != links.end(); ++it)
+		if (it->second.registered && it->first != current_link)
+			link_send(it->first, line);
+}
+
+// Everything reachable through the link is gone: its users quit with the
+// usual "<local> <remote>" netsplit reason and the other links are told
+void Server::close_link(int fd, const std::string &reason)
+{
+	Link &link = links[fd];
+
+	std::cout << GREY << "Link " << (link.name.empty() ? to_string(fd) : link.name) << " closed: " << reason << RESET << std::endl;
+	if (link.connected)
+	{
+		std::string error = link.outbuf + "ERROR :" + reason + "\r\n";
+		send(fd, error.c_str(), error.length(), MSG_DONTWAIT | MSG_NOSIGNAL);
+	}
+	if (link.registered)
+	{
+		int previous = current_link;
+		link.registered = false;
+		current_link = fd;
+		std::set<int> split_users = link.users;
+		std::set<int> watchers = netsplit_watchers(split_users);
+		std::string batch = watchers.empty() ? "" : next_batch_id();
+		for (std::set<int>::iterator it = watchers.begin(); it != watchers.end(); ++it)
+			send_message(*it, ":" + conf.name + " BATCH +" + batch + " netsplit " + conf.name + " " + link.name);
+		set_tag_batch(batch);
+		for (std::set<int>::iterator it = split_users.begin(); it != split_users.end(); ++it)
+			if (users.find(*it) != users.end())
+				remove_remote_user(users[*it], conf.name + " " + link.name);
+		set_tag_batch("");
+		for (std::set<int>::iterator it = watchers.begin(); it != watchers.end(); ++it)
+			send_message(*it, ":" + conf.name + " BATCH -" + batch);
+		std::vector<std::string> names(link.servers.begin(), link.servers.end());
+		propagate("SQUIT :" + join(names.begin(), names.end(), " "));
+		current_link = previous;
+	}
+	links.erase(fd);
+	remove_pfd(fd);
+	close(fd);
+}
+
+// Local clients that negotiated batch and share a channel with someone
+// behind the link, they get the QUITs wrapped in one netsplit batch
+std::set<int> Server::netsplit_watchers(const std::set<int> &split_users)
+{
+	std::set<int> watchers;
+
+	for (ChannelList::iterator it = channels.begin(); it != channels.end(); ++it)
+	{
+		UserList &members = it->second.get_users();
+		bool split = false;
+		for (std::set<int>::iterator sit = split_users.begin(); !split && sit != split_users.end(); ++sit)
+			split = members.find(*sit) != members.end();
+		for (UserList::iterator uit = members.begin(); split && uit != members.end(); ++uit)
+			if (uit->first >= 0 && (uit->second->get_capabilities() & CAP_BATCH))
+				watchers.insert(uit->first);
+	}
+	return watchers;
+}
+
+static std::vector<std::string> split_link_line(const std::string &line)
+{
+	std::vector<std::string> args;
+	size_t pos = 0;
+
+	while (pos < line.length())
+	{
+		if (line[pos] == ':' && !args.empty())
+		{
+			args.push_back(line.substr(pos + 1));
+			break;
+		}
+		size_t end = line.find(' ', pos);
+		if (end == std::string::npos)
+			end = line.length();
+		if (end > pos)
+			args.push_back(line.substr(pos, end - pos));
+		pos = end + 1;
+	}
+	return args;
+}
+
+void Server::parse_link_line(int fd, const std::string &line)
+{
+	std::string untagged;
+
+	reset_tags();
+	if (line[0] == '@')
+	{
+		untagged = strip_tags(line);
+		relay_client_tags();
+	}
+	std::vector<std::string> args = split_link_line(line[0] == '@' ? untagged : line);
+
+	if (args.empty())
+		return;
+	if (!links[fd].registered && args[0] != "SERVER" && args[0] != "ERROR")
+	{
+		close_link(fd, "Not registered");
+		return;
+	}
+	for (size_t i = 0; i < sizeof(link_commands) / sizeof(link_commands[0]); i++)
+	{
+		if (link_commands[i].name == args[0])
+		{
+			(this->*link_commands[i].func)(fd, args);
+			return;
+		}
+	}
+	std::cout << GREY << "WARNING: unknown link command from " << links[fd].name << ": " << escape(line) << RESET << std::endl;
+}
+
+// Users that the rest of the network knows about, the bot exists on every server
+bool Server::is_linked_user(User *user)
+{
+	return user->get_fd() != conf.bot.fd && user->get_registered() && !user->get_user().empty() && !user->get_welcome_pending();
+}
+
+bool Server::is_known_server(const std::string &name)
+{
+	if (name == conf.name)
+		return true;
+	for (std::map<int, Link>::iterator it = links.begin(); it != links.end(); ++it)
+		if (it->second.registered && it->second.servers.count(name))
+			return true;
+	return false;
+}
+
+std::string Server::known_servers(int except)
+{
+	std::vector<std::string> names;
+
+	for (std::map<int, Link>::iterator it = links.begin(); it != links.end(); ++it)
+		if (it->first != except && it->second.registered)
+			names.insert(names.end(), it->second.servers.begin(), it->second.servers.end());
+	return join(names.begin(), names.end(), " ");
+}
+
+std::string Server::uid_line(User *user)
+{
+	return "UID " + user->get_nick() + " " + user->get_user() + " " + user->get_host() + " " + (user->is_server_operator() ? "o" : "-") + " " + to_string(user->get_nick_time()) + " :" + user->get_real();
+}
+
+// MASK <channel> <+|-><b|e|I> <mask> <setter> <time>
+std::string Server::channel_mask_line(Channel &channel, char operation, int mode, const MaskList::Entry &entry)
+{
+	char letter = mode & MODE_EXCEPT ? 'e' : mode & MODE_INVEX ? 'I' : 'b';
+	return "MASK " + channel.get_name() + " " + operation + letter + " " + entry.mask + " " + entry.setter + " " + to_string(entry.time);
+}
+
+std::string Server::channel_state_line(Channel &channel)
+{
+	std::string key = channel.get_key();
+	return "CHAN " + channel.get_name() + " " + to_string(channel.get_mode()) + " " + to_string(channel.get_limit()) + " " + (key.empty() ? "*" : key) + " :" + channel.get_topic();
+}
+
+// Everything this side knows that the peer does not, users first so that
+// memberships can refer to them
+void Server::send_burst(int fd)
+{
+	link_send(fd, "BURST");
+	for (UserList::iterator it = users.begin(); it != users.end(); ++it)
+	{
+		if (!is_linked_user(it->second) || it->second->get_link() == fd)
+			continue;
+		link_send(fd, uid_line(it->second));
+		if (!it->second->get_away().empty())
+			link_send(fd, "AWAY " + it->second->get_nick() + " :" + it->second->get_away());
+	}
+	for (ChannelList::iterator it = channels.begin(); it != channels.end(); ++it)
+	{
+		Channel &channel = it->second;
+		link_send(fd, channel_state_line(channel));
+		for (int mode = MODE_BAN; mode <= MODE_INVEX; mode <<= 1)
+		{
+			const std::vector<MaskList::Entry> &entries = channel.get_mask_entries(mode);
+			for (size_t i = 0; i < entries.size(); i++)
+				link_send(fd, channel_mask_line(channel, '+', mode, entries[i]));
+		}
+		for (UserList::iterator uit = channel.get_users().begin(); uit != channel.get_users().end(); ++uit)
+			if (is_linked_user(uit->second) && uit->second->get_link() != fd)
+				link_send(fd, "JOIN " + uit->second->get_nick() + " " + channel.get_name() + (channel.is_operator(uit->second) ? " o" : ""));
+	}
+	link_send(fd, "ENDBURST");
+}
+
+void Server::remove_remote_user(User *user, const std::string &reason)
+{
+	int id = user->get_fd();
+
+	broadcast_user_channels(id, ":" + user->get_hostmask(user->get_nick()) + " QUIT :" + reason, user);
+	propagate("QUIT " + user->get_nick() + " :" + reason);
+	notify_watchers(user, false);
+	remember_nickname(user);
+	forget_nickname(user);
+	for (ChannelList::iterator it = channels.begin(); it != channels.end(); ++it)
+	{
+		it->second.remove_user(id);
+		it->second.remove_operator(user);
+		it->second.remove_invite(user);
+	}
+	if (links.find(user->get_link()) != links.end())
+		links[user->get_link()].users.erase(id);
+	operators.erase(id);
+	delete user;
+	users.erase(id);
+}
+
+// SERVER <name> <password> :<servers behind the peer>
+void Server::LINK_SERVER(int fd, std::vector<std::string> &args)
+{
+	Link &link = links[fd];
+
+	if (link.registered)
+		return;
+	if (args.size() < 3 || conf.link_password.empty() || args[2] != conf.link_password)
+	{
+		close_link(fd, "Bad link password");
+		return;
+	}
+	std::vector<std::string> names;
+	if (args.size() > 3)
+		names = split(args[3], ' ');
+	names.push_back(args[1]);
+	for (size_t i = 0; i < names.size(); i++)
+	{
+		if (is_known_server(names[i]))
+		{
+			close_link(fd, "Server " + names[i] + " already linked");
+			return;
+		}
+	}
+
+	link.name = args[1];
+	link.servers.insert(names.begin(), names.end());
+	link.registered = true;
+	if (!link.outgoing)
+		link_send(fd, "SERVER " + conf.name + " " + conf.link_password + " :" + known_servers(fd));
+	propagate("SERVERS :" + join(names.begin(), names.end(), " "));
+	send_burst(fd);
+	std::cout << "Link established with " << link.name << " on fd " << fd << std::endl;
+}
+
+void Server::LINK_SERVERS(int fd, std::vector<std::string> &args)
+{
+	if (args.size() < 2)
+		return;
+	std::vector<std::string> names = split(args[1], ' ');
+	links[fd].servers.insert(names.begin(), names.end());
+	propagate("SERVERS :" + args[1]);
+}
+
+void Server::LINK_SQUIT(int fd, std::vector<std::string> &args)
+{
+	if (args.size() < 2)
+		return;
+	std::vector<std::string> names = split(args[1], ' ');
+	for (size_t i = 0; i < names.size(); i++)
+		links[fd].servers.erase(names[i]);
+	propagate("SQUIT :" + args[1]);
+}
+
+void Server::LINK_BURST(int fd, std::vector<std::string> &args)
+{
+	(void)args;
+	links[fd].bursting = true;
+}
+
+void Server::LINK_ENDBURST(int fd, std::vector<std::string> &args)
+{
+	(void)args;
+	links[fd].bursting = false;
+	std::cout << "Burst from " << links[fd].name << " complete, " << links[fd].users.size() << " users" << std::endl;
+}
+
+// A nick taken on two servers at once goes to whoever has held it longest,
+// then to the lower user@host, and when both match nobody keeps it. Every
+// server applies the rule to the same UID and NICK lines, so the two sides of
+// a burst agree on the survivor without a word about it. The loser is killed
+// on its own server and dropped everywhere else. Returns whether the
+// newcomer may take the nick, the holder is gone by then.
+bool Server::resolve_collision(User *holder, time_t time, const std::string &userhost)
+{
+	if (holder->get_fd() == conf.bot.fd)
+		return false;
+
+	std::string held_by = holder->get_user() + "@" + holder->get_host();
+	int order = holder->get_nick_time() != time ? (holder->get_nick_time() < time ? -1 : 1) : held_by.compare(userhost);
+	if (order < 0)
+		return false;
+	if (holder->is_remote())
+		remove_remote_user(holder, "Nick collision");
+	else
+	{
+		send_closing_error(holder->get_fd(), "Nick collision");
+		terminate_connection(holder->get_fd(), "Nick collision");
 	}
+	return order > 0;
 }
 
-void Server::parse_data(int fd)
+// UID <nick> <user> <host> <flags> <nick time> :<realname>
+void Server::LINK_UID(int fd, std::vector<std::string> &args)
 {
-	std::istringstream iss(users[fd]->get_data());
-	std::string line;
+	if (args.size() < 7)
+		return;
+	time_t time = to_number_safe<time_t>(args[5]);
+	User *holder = find_user_by_nickname(args[1]);
+	if (holder != NULL && !resolve_collision(holder, time, args[2] + "@" + args[3]))
+		return;
+
+	User *user = new User();
+	while (next_remote_id == conf.bot.fd || users.find(next_remote_id) != users.end())
+		next_remote_id--;
+	int id = next_remote_id--;
+
+	users[id] = user;
+	user->set_fd(id);
+	user->set_link(fd);
+	set_nickname(user, args[1]);
+	user->set_nick_time(time);
+	user->set_user(args[2]);
+	user->set_host(args[3]);
+	user->set_real(args[6]);
+	user->set_auth(true);
+	user->set_registered(true);
+	user->set_server_operator(args[4].find('o') != std::string::npos);
+	links[fd].users.insert(id);
+	propagate(uid_line(user));
+	notify_watchers(user, true);
+}
 
-	if (users[fd]->get_data().length() > conf.max_message_length)
+// NICK <old> <new> <nick time>
+void Server::LINK_NICK(int fd, std::vector<std::string> &args)
+{
+	if (args.size() < 4)
+		return;
+	User *user = find_user_by_nickname(args[1]);
+	if (user == NULL || user->get_link() != fd)
+		return;
+	time_t time = to_number_safe<time_t>(args[3]);
+	User *holder = find_user_by_nickname(args[2]);
+	if (holder != NULL && holder != user && !resolve_collision(holder, time, user->get_user() + "@" + user->get_host()))
 	{
-		terminate_connection(fd);
+		remove_remote_user(user, "Nick collision");
 		return;
 	}
+	broadcast_user_channels(user->get_fd(), ":" + user->get_hostmask(user->get_nick()) + " NICK :" + args[2], user);
+	notify_watchers(user, false);
+	remember_nickname(user);
+	set_nickname(user, args[2]);
+	user->set_nick_time(time);
+	notify_watchers(user, true);
+	propagate("NICK " + args[1] + " " + args[2] + " " + args[3]);
+}
 
-	// std::cout << RED "PARSING DATA: " << escape(iss.str()) << RESET << std::endl;
-	while (std::getline(iss, line))
+void Server::LINK_QUIT(int fd, std::vector<std::string> &args)
+{
+	if (args.size() < 2)
+		return;
+	User *user = find_user_by_nickname(args[1]);
+	if (user != NULL && user->get_link() == fd)
+		remove_remote_user(user, args.size() > 2 ? args[2] : "Quit");
+}
+
+// CHAN <name> <mode> <limit> <key|*> :<topic>, the accepting side keeps its
+// own state for channels both sides had before the link came up
+void Server::LINK_CHAN(int fd, std::vector<std::string> &args)
+{
+	if (args.size() < 6)
+		return;
+	bool exists = channels.find(args[1]) != channels.end();
+	if (exists && links[fd].bursting && !links[fd].outgoing)
+		return;
+	if (!exists)
+		channels[args[1]] = Channel(args[1], "", "");
+	Channel &channel = channels[args[1]];
+	channel.set_mode(to_number_safe<int>(args[2]));
+	channel.set_limit(to_number_safe<size_t>(args[3]));
+	channel.set_key(args[4] == "*" ? "" : args[4]);
+	channel.set_topic(args[5]);
+	persist_channel(channel);
+}
+
+void Server::LINK_JOIN(int fd, std::vector<std::string> &args)
+{
+	if (args.size() < 3)
+		return;
+	User *user = find_user_by_nickname(args[1]);
+	if (user == NULL || user->get_link() != fd)
+		return;
+	if (channels.find(args[2]) == channels.end())
+		channels[args[2]] = Channel(args[2], "", "");
+	Channel &channel = channels[args[2]];
+	bool joined = !channel.has_user(user->get_fd());
+	channel.get_users()[user->get_fd()] = user;
+	channel.remove_invite(user);
+	if (args.size() > 3 && args[3] == "o")
+		channel.add_operator(user);
+	// A live join reaches members through the joiner's BCAST, a burst has
+	// none, so members see the netjoin from here
+	if (joined && links[fd].bursting)
 	{
-		// std::cout << YELLOW << "Received from " << RESET << fd << YELLOW ": `" RESET << escape(line) << YELLOW "`" RESET << std::endl;
-		try
-		{
-			if (line.substr(line.length() - 1) == "\r")
-			{
-				parse_command(fd, line);
-				users[fd]->get_data().erase(0, line.length() + 1);
-			}
-			else
-				break;
-		}
-		catch (...)
-		{
-			return;
-		}
+		broadcast_message(channel, ":" + user->get_hostmask(user->get_nick()) + " JOIN :" + channel.get_name(), user);
+		if (channel.is_operator(user))
+			broadcast_message(channel, ":" + conf.name + " MODE " + channel.get_name() + " +o " + user->get_nick(), user);
 	}
-	// std::cout << RED "AFTER PARSING DATA: " << escape(users[fd]->get_data()) << RESET << std::endl;
+	propagate("JOIN " + args[1] + " " + args[2] + (args.size() > 3 ? " " + args[3] : ""));
 }
 
-int Server::is_valid_command(const std::string &line)
+void Server::LINK_PART(int fd, std::vector<std::string> &args)
 {
-	for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++)
+	if (args.size() < 3 || channels.find(args[2]) == channels.end())
+		return;
+	User *user = find_user_by_nickname(args[1]);
+	if (user == NULL || user->get_link() != fd)
+		return;
+	channels[args[2]].remove_user(user->get_fd());
+	channels[args[2]].remove_operator(user);
+	propagate("PART " + args[1] + " " + args[2]);
+}
+
+// OP <channel> <+|-> <nick>
+void Server::LINK_OP(int fd, std::vector<std::string> &args)
+{
+	(void)fd;
+	if (args.size() < 4 || channels.find(args[1]) == channels.end())
+		return;
+	User *user = find_user_by_nickname(args[3]);
+	if (user == NULL)
+		return;
+	if (args[2] == "+")
+		channels[args[1]].add_operator(user);
+	else
+		channels[args[1]].remove_operator(user);
+	propagate("OP " + args[1] + " " + args[2] + " " + args[3]);
+}
+
+void Server::LINK_MASK(int fd, std::vector<std::string> &args)
+{
+	(void)fd;
+	if (args.size() < 6 || args[2].length() != 2 || channels.find(args[1]) == channels.end())
+		return;
+	int mode = args[2][1] == 'e' ? MODE_EXCEPT : args[2][1] == 'I' ? MODE_INVEX : MODE_BAN;
+	MaskList &masks = channels[args[1]].get_masks(mode);
+	bool changed = args[2][0] == '+' ? masks.add(args[3], args[4], to_number_safe<time_t>(args[5])) : masks.remove(args[3]);
+	if (changed)
+		propagate("MASK " + args[1] + " " + args[2] + " " + args[3] + " " + args[4] + " " + args[5]);
+}
+
+// AWAY <nick> [:<message>], no message means back
+void Server::LINK_AWAY(int fd, std::vector<std::string> &args)
+{
+	if (args.size() < 2)
+		return;
+	User *user = find_user_by_nickname(args[1]);
+	if (user == NULL || user->get_link() != fd)
+		return;
+	user->set_away(args.size() > 2 ? args[2] : "");
+	propagate("AWAY " + args[1] + (user->get_away().empty() ? "" : " :" + user->get_away()));
+}
+
+void Server::LINK_INVITE(int fd, std::vector<std::string> &args)
+{
+	(void)fd;
+	if (args.size() < 3 || channels.find(args[1]) == channels.end())
+		return;
+	User *user = find_user_by_nickname(args[2]);
+	if (user == NULL)
+		return;
+	channels[args[1]].invite(user);
+	propagate("INVITE " + args[1] + " " + args[2]);
+}
+
+// BCAST <channel> [<skip>] :<line>, shown to local members and routed on
+// towards links with members, less the members of the `skip` channels. The
+// local bot does not see it, the bot of the origin server already answered.
+void Server::LINK_BCAST(int fd, std::vector<std::string> &args)
+{
+	(void)fd;
+	if (args.size() < 3 || channels.find(args[1]) == channels.end())
+		return;
+	User *bot = users.find(conf.bot.fd) != users.end() ? users[conf.bot.fd] : NULL;
+	if (args.size() > 3)
+		broadcast_message(channels[args[1]], args[3], bot, args[2], required_capabilities(args[3]));
+	else
+		broadcast_message(channels[args[1]], args[2], bot, "", required_capabilities(args[2]));
+}
+
+// TO <nick> :<line>, routed towards the server the user is on
+void Server::LINK_TO(int fd, std::vector<std::string> &args)
+{
+	(void)fd;
+	if (args.size() < 3)
+		return;
+	User *user = find_user_by_nickname(args[1]);
+	if (user == NULL)
+		return;
+	uint32_t capabilities = required_capabilities(args[2]);
+	if (!user->is_remote())
 	{
-		if (line.substr(0, commands[i].name.length() + 1) == commands[i].name + " "
-			|| line.substr(0, commands[i].name.length() + 1) == commands[i].name + "\r")
-			return i;
+		if ((user->get_capabilities() & capabilities) == capabilities)
+			send_message(user->get_fd(), args[2]);
 	}
-	return INVALID_COMMAND;
+	else if (user->get_link() != current_link)
+		link_send(user->get_link(), link_tags() + "TO " + args[1] + " :" + args[2]);
 }
 
-void Server::process_events(int fd, int revents)
+void Server::LINK_ERROR(int fd, std::vector<std::string> &args)
 {
-	// std::cout << MAGENTA << "revents: " << revents << RESET << std::endl;
-	if (revents & POLLIN)
+	close_link(fd, "Remote error: " + (args.size() > 1 ? args[1] : std::string("unknown")));
+}
+
+// Local users in `list` plus those still waiting to be claimed, nickname to user@host
+static std::map<std::string, std::string> snapshot_entries(UserList &list, std::map<std::string, std::string> &saved, int bot_fd)
+{
+	std::map<std::string, std::string> entries(saved);
+
+	for (UserList::iterator it = list.begin(); it != list.end(); ++it)
+		if (it->first >= 0 && it->first != bot_fd && !it->second->is_remote() && !it->second->get_nick().empty())
+			entries[it->second->get_nick()] = it->second->get_user() + "@" + it->second->get_host();
+	return entries;
+}
+
+// Version 3 body: u32 channel count, then per channel its name, key, topic,
+// mode, limit, invited users, operators and mask lists. Users are a u32
+// count of nickname and user@host pairs. Version 2 had bare nicknames, which
+// are not restored since whoever took the nickname first would claim them,
+// and version 1 had no mask lists either.
+std::string Server::encode_snapshot()
+{
+	std::string body;
+
+	body.reserve(channels.size() * 64);
+	put_u32(body, channels.size());
+	for (ChannelList::iterator it = channels.begin(); it != channels.end(); ++it)
 	{
-		if (fd == server_fd)
-		{
-			accept_connections();
-		}
-		else
+		Channel &channel = it->second;
+		put_str(body, channel.get_name());
+		put_str(body, channel.get_key());
+		put_str(body, channel.get_topic());
+		put_u32(body, channel.get_mode());
+		put_u64(body, channel.get_limit());
+
+		std::map<std::string, std::string> lists[2] = {
+			snapshot_entries(channel.get_invited(), channel.get_saved_invites(), conf.bot.fd),
+			snapshot_entries(channel.get_operators(), channel.get_saved_operators(), conf.bot.fd)};
+		for (size_t l = 0; l < 2; l++)
 		{
-			receive_data(fd);
-			parse_data(fd);
+			put_u32(body, lists[l].size());
+			for (std::map<std::string, std::string>::iterator it = lists[l].begin(); it != lists[l].end(); ++it)
+			{
+				put_str(body, it->first);
+				put_str(body, it->second);
+			}
 		}
+		put_masks(body, channel);
 	}
-	if (revents & (POLLHUP | POLLERR))
-	{
-		terminate_connection(fd);
-		return;
-	}
-	if (revents & POLLOUT)
+	return body;
+}
+
+// Only the encoding happens here, the writer thread does the write and fsync
+bool Server::save_snapshot(const std::string &path)
+{
+	std::string body = encode_snapshot();
+
+	return snapshot_writer.queue(path, body);
+}
+
+void Server::wait_snapshot() { snapshot_writer.wait(); }
+
+bool Server::load_snapshot(const std::string &path)
+{
+	uint64_t start = monotonic_us();
+	Snapshot snapshot;
+
+	if (!snapshot.open(path))
 	{
-		if (users.find(fd) != users.end() && users[fd]->get_sendbuffer().length() > 0)
-		{
-			send(fd, users[fd]->get_sendbuffer().c_str(), users[fd]->get_sendbuffer().length(), 0);
-			users[fd]->clear_sendbuffer();
-		}
+		if (access(path.c_str(), F_OK) == 0)
+			std::cout << GREY << "WARNING: ignoring unreadable snapshot " << path << RESET << std::endl;
+		return false;
 	}
-	if (fd != server_fd && users.find(fd) != users.end())
-	{
-		time_t ping = conf.activity_timeout;
-		time_t timeout = conf.ping_timeout;
-		time_t now = time(NULL);
 
-		if (now - users[fd]->get_last_activity() >= ping)
+	// Channels were written in map order, hinting at the end keeps each insert constant time
+	ByteReader reader = snapshot.body();
+	uint32_t count = reader.u32();
+	uint32_t loaded = 0;
+	ChannelList::iterator hint = channels.end();
+	for (; loaded < count && reader.good(); loaded++)
+	{
+		std::string name = reader.str();
+		std::string key = reader.str();
+		std::string topic = reader.str();
+		int mode = reader.u32();
+		size_t limit = reader.u64();
+
+		std::map<std::string, std::string> lists[2];
+		for (size_t l = 0; l < 2; l++)
 		{
-			if (users[fd]->get_last_ping() <= users[fd]->get_last_activity())
-			{
-				send_message(fd, "PING " + to_string(now));
-				users[fd]->set_last_ping();
-			}
-			else if (now - users[fd]->get_last_ping() >= timeout)
+			uint32_t n = reader.u32();
+			for (uint32_t i = 0; i < n && reader.good(); i++)
 			{
-				terminate_connection(fd);
-				return;
+				std::string nick = reader.str();
+				if (snapshot.get_version() >= 3)
+					lists[l].insert(lists[l].end(), std::make_pair(nick, reader.str()));
 			}
 		}
+		if (!reader.good())
+			break;
+
+		hint = channels.insert(hint, std::make_pair(name, Channel()));
+		Channel &channel = hint->second;
+		channel.set_name(name);
+		channel.set_key(key);
+		channel.set_topic(topic);
+		channel.set_mode(mode);
+		channel.set_limit(limit);
+		channel.get_saved_invites().swap(lists[0]);
+		channel.get_saved_operators().swap(lists[1]);
+		if (snapshot.get_version() >= 2)
+			read_masks(reader, channel);
+		if (!reader.good())
+			break;
 	}
+	if (loaded != count)
+		std::cout << GREY << "WARNING: snapshot " << path << " is truncated" << RESET << std::endl;
+	std::cout << "Loaded " << loaded << " channels from " << path << " in " << (monotonic_us() - start) << "us" << std::endl;
+	return loaded == count;
 }
 
-void Server::send_message(int fd, const std::string &message)
+void Server::load_services()
 {
-	std::cout << GREEN << "Sending to " << RESET << fd << GREEN ": `" RESET << escape(message) << GREEN "`" RESET << std::endl;
-	std::string ircmsg(message + "\r\n");
-	users[fd]->append_sendbuffer(ircmsg);
-	// send(fd, ircmsg.c_str(), ircmsg.length(), 0);
-}
+	std::vector<std::string> names;
+	for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++)
+		names.push_back(commands[i].name);
+	services.set_commands(names);
 
-void Server::broadcast_message(Channel &channel, const std::string &message, User *except)
-{
-	std::cout << BLUE << "Broadcasting to " << RESET << channel.get_name() << BLUE ": `" RESET << escape(message) << BLUE "`" RESET << std::endl;
-	std::string ircmsg(message + "\r\n");
-	for (UserList::iterator it = channel.get_users().begin(); it != channel.get_users().end(); ++it)
+	std::vector<std::string> paths = split(conf.services, ' ');
+	for (size_t i = 0; i < paths.size(); i++)
 	{
-		if (it->second != except)
-			users[it->first]->append_sendbuffer(ircmsg);
+		std::string error;
+		if (paths[i].empty())
+			continue;
+		bool ok = services.load(paths[i], error);
+		insist(ok, false, "failed to load service: " + error);
+		std::cout << "Loaded service " << paths[i] << std::endl;
 	}
 }
 
-void Server::server_broadcast_message(const std::string &message, User *except)
+int Server::service_command(int command, int fd, User *user, std::vector<std::string> &args)
 {
-	std::cout << PURPLE << "Broadcasting to " << RESET << "Server" << PURPLE ": `" RESET << escape(message) << PURPLE "`" RESET << std::endl;
-	std::string ircmsg(message + "\r\n");
-	for (UserList::iterator it = users.begin(); it != users.end(); ++it)
-	{
-		if (it->second != except && it->second->get_registered())
-			users[it->first]->append_sendbuffer(ircmsg);
-	}
+	ServiceReply reply(conf.name, user->get_nick());
+	int verdict = services.command(command, ServiceMessage(fd, user->get_nick(), *current_line, args), reply);
+
+	if (!reply.empty())
+		apply_service_reply(fd, NULL, reply);
+	return verdict;
 }
 
-void Server::broadcast_user_channels(int fd, const std::string &message, User *except)
+int Server::service_channel(int event, int fd, User *user, Channel &channel, std::vector<std::string> &args)
 {
-	std::cout << MUSTARD << "Broadcasting to " << RESET << users[fd]->get_nick() << "'s channels" << MUSTARD ": `" RESET << escape(message) << MUSTARD "`" RESET << std::endl;
-	std::string ircmsg(message + "\r\n");
-	for (std::map<std::string, Channel>::iterator it = channels.begin(); it != channels.end(); ++it)
-		if (it->second.has_user(fd))
-			for (UserList::iterator cit = it->second.get_users().begin(); cit != it->second.get_users().end(); ++cit)
-				if (cit->second != except)
-					users[cit->first]->append_sendbuffer(ircmsg);
+	static const std::string none;
+	ServiceReply reply(conf.name, user->get_nick());
+	int verdict = services.channel(event, ServiceMessage(fd, user->get_nick(), current_line ? *current_line : none, args, &channel.get_name()), reply);
+
+	if (!reply.empty())
+		apply_service_reply(fd, &channel, reply);
+	return verdict;
 }
 
-pollfd Server::make_pfd(int fd, int events, int revents)
+void Server::apply_service_reply(int fd, Channel *channel, ServiceReply &reply)
 {
-	pollfd pfd = initialized<pollfd>();
+	for (size_t i = 0; i < reply.get_sender_lines().size(); i++)
+		send_message(fd, reply.get_sender_lines()[i]);
+	for (size_t i = 0; channel && i < reply.get_channel_lines().size(); i++)
+		broadcast_message(*channel, reply.get_channel_lines()[i]);
+	if (!reply.get_quit_reason().empty())
+		disconnect(fd, reply.get_quit_reason());
+}
 
-	pfd.fd = fd;
-	pfd.events = events;
-	pfd.revents = revents;
-	return pfd;
+// Unwinds the command like QUIT does, after the queued output and the closing
+// error have been written out
+void Server::disconnect(int fd, const std::string &reason)
+{
+	if (fd < 0 || users.find(fd) == users.end())
+		return;
+
+	send_closing_error(fd, reason);
+	terminate_connection(fd);
+	throw std::runtime_error("connection terminated");
 }
 
-void Server::terminate_connection(int fd)
+// Written out right away, the connection is about to be closed
+void Server::send_closing_error(int fd, const std::string &reason)
 {
-	if (users.find(fd) == users.end())
+	std::string error("ERROR :Closing Link: " + reason + "\r\n");
+
+	if (shards.send(fd, error))
 		return;
-	broadcast_user_channels(fd, ":" + users[fd]->get_hostmask(users[fd]->get_nick()) + " QUIT :Client closed connection", users[fd]);
-	for (std::map<std::string, Channel>::iterator it = channels.begin(); it != channels.end(); ++it)
-		it->second.remove_user(fd);
-	delete users[fd];
-	users.erase(fd);
-	for (std::vector<pollfd>::iterator it = pfds.begin(); it != pfds.end(); ++it)
+	users[fd]->append_sendbuffer(error);
+	if (shards.acquire(fd))
 	{
-		if (it->fd == fd)
+		flush_sendbuffer(fd);
+		shards.release(fd);
+	}
+}
+
+// Every channel state change ends up here, linked servers get the new state too
+void Server::persist_channel(Channel &channel)
+{
+	std::string state;
+
+	if (!links.empty())
+		propagate(channel_state_line(channel));
+	if (!history.is_enabled())
+		return;
+	put_str(state, channel.get_key());
+	put_str(state, channel.get_topic());
+	put_u32(state, channel.get_mode());
+	put_u64(state, channel.get_limit());
+	history.append(HISTORY_STATE, channel.get_name(), state);
+}
+
+void Server::recover_history()
+{
+	std::vector<HistoryRecord> records = history.recover();
+
+	for (size_t i = 0; i < records.size(); i++)
+	{
+		ByteReader reader(records[i].data.c_str(), records[i].data.length());
+		std::string key = reader.str();
+		std::string topic = reader.str();
+		int mode = reader.u32();
+		size_t limit = reader.u64();
+
+		if (!reader.good())
+			continue;
+		if (channels.find(records[i].channel) == channels.end())
 		{
-			pfds.erase(it);
-			break;
+			try {
+				create_channel(records[i].channel, key, topic);
+			} catch (std::exception &e) {
+				std::cout << GREY << "WARNING: skipping recovered channel " << records[i].channel << ": " << e.what() << RESET << std::endl;
+				continue;
+			}
 		}
+		Channel &channel = channels[records[i].channel];
+		channel.set_key(key);
+		channel.set_topic(topic);
+		channel.set_mode(mode);
+		channel.set_limit(limit);
 	}
-	close(fd);
-	repoll = true;
+	std::cout << "Recovered " << records.size() << " channel states from history" << std::endl;
 }
 
 User *Server::find_user_by_nickname(const std::string &nickname)
 {
-	for (UserList::iterator it = users.begin(); it != users.end(); ++it)
-	{
-		if (it->second->get_nick() == nickname)
-			return it->second;
-	}
-	return NULL;
+	NickList::iterator it = nicknames.find(nickname);
+	return it == nicknames.end() ? NULL : it->second;
+}
+
+// Every nick change goes through here so the index stays in step with the users
+void Server::set_nickname(User *user, const std::string &nickname)
+{
+	forget_nickname(user);
+	user->set_nick(nickname);
+	user->set_nick_time(std::time(NULL));
+	if (!nickname.empty())
+		nicknames[nickname] = user;
+}
+
+void Server::forget_nickname(User *user)
+{
+	NickList::iterator it = nicknames.find(user->get_nick());
+	if (it != nicknames.end() && it->second == user)
+		nicknames.erase(it);
+}
+
+// Called with the nickname about to go away, for WHOWAS
+void Server::remember_nickname(User *user)
+{
+	whowas.add(user->get_nick(), user->get_user(), user->get_host(), user->get_real(), server_of(user), std::time(NULL));
+}
+
+// Remote users are reported on the server their link leads to
+std::string Server::server_of(User *user)
+{
+	std::map<int, Link>::iterator it = user->is_remote() ? links.find(user->get_link()) : links.end();
+	return it == links.end() ? conf.name : it->second.name;
 }
 
 void Server::need_more_params(int fd, const std::string &command)
@@ -1027,6 +4247,11 @@ void Server::need_more_params(int fd, const std::string &command)
 	send_message(fd, ":" + conf.name + " " + c(ERR_NEEDMOREPARAMS) + " " + users[fd]->get_nick() + " " + command + " :Not enough parameters");
 }
 
+void Server::no_privileges(int fd)
+{
+	send_message(fd, ":" + conf.name + " " + c(ERR_NOPRIVILEGES) + " " + users[fd]->get_nick() + " :Permission Denied- You're not an IRC operator");
+}
+
 void Server::no_such_channel(int fd, const std::string &channel)
 {
 	send_message(fd, ":" + conf.name + " " + c(ERR_NOSUCHCHANNEL) + " " + users[fd]->get_nick() + " " + channel + " :No such channel");
@@ -1091,13 +4316,14 @@ void Server::initialize_bot()
 {
 	users[conf.bot.fd] = new User();
 	users[conf.bot.fd]->set_fd(conf.bot.fd);
-	users[conf.bot.fd]->set_nick(conf.bot.nickname);
+	set_nickname(users[conf.bot.fd], conf.bot.nickname);
 	users[conf.bot.fd]->set_user(conf.bot.username);
 	users[conf.bot.fd]->set_real(conf.bot.realname);
 	users[conf.bot.fd]->set_host("0.0.0.0");
 	users[conf.bot.fd]->set_auth(true);
 	users[conf.bot.fd]->set_registered(true);
 	users[conf.bot.fd]->set_server_operator(true);
+	bot.set_nickname(conf.bot.nickname);
 
 	for (std::map<std::string, Channel>::iterator it = channels.begin(); it != channels.end(); it++)
 	{
@@ -1106,71 +4332,52 @@ void Server::initialize_bot()
 	}
 }
 
-bool Server::bot_parse()
+// Called from PRIVMSG for every line the bot can see, anything not meant for
+// it is dropped after a substring search
+void Server::bot_hear(const std::string &target, const std::string &sender, const std::string &text)
 {
-	int fd = conf.bot.fd;
-	if (users[fd]->get_sendbuffer().find("\r") == std::string::npos)
-		return false;
-
-	std::istringstream iss(users[fd]->get_sendbuffer());
-	std::string line;
-
-	std::cout << ORANGE "BOT PARSING DATA: " << escape(iss.str()) << RESET << std::endl;
+	if (!bot.addressed(target, text))
+		return;
 
-	while (std::getline(iss, line))
+	BotMessage message;
+	message.target = target == conf.bot.nickname ? sender : target;
+	message.text = text;
+	if (bot.is_running())
+		bot.submit(message);
+	else
 	{
-		std::cout << MUSTARD << "BOT RECEIVED : `" << RESET << escape(line) << MUSTARD "`" RESET << std::endl;
-		if (line.substr(line.length() - 1) == "\r")
-		{
-			bot_response(line);
-			users[fd]->get_sendbuffer().erase(0, line.length() + 1);
-		}
-		else
-			return false;
+		message.text = bot.answer(text);
+		bot_replies.push_back(message);
 	}
-
-	std::cout << ORANGE "AFTER PARSING BOT DATA: " << escape(users[fd]->get_sendbuffer()) << RESET << std::endl;
-
-	return true;
 }
 
-std::string get_nickname_from_hostmask(std::string hostmask)
+// Replies take the same path as a client's PRIVMSG
+void Server::bot_reply(const BotMessage &reply)
 {
-	std::vector<std::string> args = split(hostmask, '!');
-	return args[0].substr(1);
+	if (users.find(conf.bot.fd) == users.end())
+		return;
+	std::cout << MUSTARD << "BOT REPLYING to " << RESET << reply.target << MUSTARD ": `" RESET << escape(reply.text) << MUSTARD "`" RESET << std::endl;
+	parse_command(conf.bot.fd, "PRIVMSG " + reply.target + " :" + reply.text + "\r");
 }
 
-void Server::bot_response(std::string message)
+void Server::collect_bot_replies()
 {
-	std::vector<std::string> args = split(message, ' ');
-	static std::string all_responses[] = {
-		"It is certain", "It is decidedly so", "Without a doubt",
-		"Yes definitely", "You may rely on it", "As I see it, yes",
-		"Most likely", "Outlook good", "Yes", "Signs point to yes",
-		"Reply hazy try again", "Ask again later", "Better not tell you now",
-		"Cannot predict now", "Concentrate and ask again",
-		"Don't count on it", "My reply is no", "My sources say no",
-		"Outlook not so good", "Very doubtful"};
+	std::vector<BotMessage> replies = bot.collect();
 
-	if (args.size() < 3)
-		return;
-
-	if (args[1] == "PRIVMSG")
-	{
-		std::srand(time(NULL));
-
-		std::string received_message = join(args.begin() + 3, args.end(), " ");
-		int random_idx = std::rand() % sizeof(all_responses) / sizeof(std::string);
-		bool forced_response = received_message.find("fuck") != std::string::npos;
-		std::string direction = get_nickname_from_hostmask(args[0]);
-		std::string response = forced_response ? "you" : all_responses[random_idx];
+	bot_replies.insert(bot_replies.end(), replies.begin(), replies.end());
+	flush_bot_replies();
+}
 
-		if (args[2] != conf.bot.nickname)
-			direction = args[2];
+// Inline answers wait here until the command that drew them is done, a
+// reply never runs inside another command's handler
+void Server::flush_bot_replies()
+{
+	std::vector<BotMessage> replies;
 
-		if (received_message.find(conf.bot.nickname) != std::string::npos || args[2] == conf.bot.nickname || forced_response)
-			users[conf.bot.fd]->append_data("PRIVMSG " + direction + " :" + response + "\r\n");
-	}
+	replies.swap(bot_replies);
+	for (size_t i = 0; i < replies.size(); i++)
+		bot_reply(replies[i]);
+	current_command = command_stats.size() - 1;
 }
 
 bool Server::map_string_comparator::operator()(const std::string &s1, const std::string &s2) const
@@ -1,6 +1,22 @@
 #pragma once
 
 #include "IRCserver.hpp"
+#include "History.hpp"
+#include "Metrics.hpp"
+#include "Capture.hpp"
+#include "Resolver.hpp"
+#include "AddressTable.hpp"
+#include "Handoff.hpp"
+#include "Snapshot.hpp"
+#include "Shard.hpp"
+#include "Bot.hpp"
+#include "Service.hpp"
+#include "Tls.hpp"
+#include "MaskList.hpp"
+#include "Filter.hpp"
+#include "Whowas.hpp"
+
+#include <deque>
 
 #define INVALID_COMMAND -1
 
@@ -15,6 +31,70 @@ typedef struct CommandInfo
 	bool need_registered;
 } CommandInfo;
 
+typedef struct ChannelConfig
+{
+	std::string name;
+	std::string key;
+	std::string topic;
+} ChannelConfig;
+
+// Registration burst rendered once per config load, only the nick and
+// username differ between clients
+enum {
+	WELCOME_LITERAL,
+	WELCOME_NICK,
+	WELCOME_USER
+};
+
+typedef struct WelcomeSegment
+{
+	int type;
+	std::string text;
+} WelcomeSegment;
+
+// Peer server connection. Users introduced over a link live in the regular
+// user list on synthetic negative ids and are removed when the link drops.
+typedef struct Link
+{
+	std::string name;
+	bool outgoing;
+	bool connected;
+	bool registered;
+	bool bursting;
+	time_t deadline;
+	std::string inbuf;
+	std::string outbuf;
+	std::set<std::string> servers;
+	std::set<int> users;
+} Link;
+
+typedef struct LinkCommandInfo
+{
+	std::string name;
+	void (Server::*func)(int, std::vector<std::string> &);
+} LinkCommandInfo;
+
+// IRCv3 tags of the line being sent. Recipients get the prefix matching the
+// capabilities they negotiated, each variant is serialized at most once per
+// message. `time` is 0 until a prefix needs it, `received` holds the client
+// tags of the command being handled and `client` those relayed on this line.
+typedef struct MessageTags
+{
+	uint64_t time;
+	std::string received;
+	std::string client;
+	std::string batch;
+	std::string prefixes[CAP_TAGS + 1];
+	unsigned built;
+} MessageTags;
+
+typedef struct CommandStats
+{
+	uint64_t *in;
+	uint64_t *out;
+	Histogram *dispatch;
+} CommandStats;
+
 enum {
 	LETTER = 1 << 0,
 	SPECIAL = 1 << 1,
@@ -28,14 +108,17 @@ enum {
 
 class Server
 {
-private:
-
+public:
 	struct map_string_comparator : std::binary_function<std::string, std::string, bool>
 	{
 		bool operator()(const std::string &s1, const std::string &s2) const;
 	};
+	typedef std::map<std::string, Channel, map_string_comparator> ChannelList;
+	typedef std::map<std::string, User *, map_string_comparator> NickList;
+	typedef std::set<std::string, map_string_comparator> MonitorList;
 
-	struct
+private:
+	struct Config
 	{
 		int port;
 		std::string name;
@@ -43,6 +126,7 @@ private:
 		std::string operator_username;
 		std::string operator_password;
 		std::vector<std::string> motd;
+		std::vector<ChannelConfig> channels;
 		time_t activity_timeout;
 		time_t ping_timeout;
 		size_t max_message_length;
@@ -50,6 +134,38 @@ private:
 		size_t max_server_name_length;
 		size_t max_channel_name_length;
 		int channel_creation;
+		std::string history_dir;
+		size_t history_segment_size;
+		time_t history_retention;
+		int metrics_port;
+		uint64_t slow_command_threshold;
+		size_t slow_command_log_size;
+		std::string capture_file;
+		size_t dns_threads;
+		time_t dns_timeout;
+		time_t dns_cache_ttl;
+		int dns_wait_registration;
+		int listen_backlog;
+		size_t accept_budget;
+		size_t max_connections;
+		size_t max_connections_per_ip;
+		std::string link_password;
+		int link_port;
+		std::string link_connect;
+		time_t link_retry;
+		std::string snapshot_file;
+		time_t snapshot_interval;
+		time_t snapshot_claim_timeout;
+		size_t shards;
+		std::string services;
+		int tls_port;
+		std::string tls_certificate;
+		std::string tls_key;
+		size_t monitor_limit;
+		size_t max_targets;
+		size_t max_channel_masks;
+		size_t whowas_size;
+		size_t command_budget;
 
 		struct
 		{
@@ -57,38 +173,139 @@ private:
 			std::string username;
 			std::string realname;
 			int fd;
+			int thread;
 		} bot;
-	} conf;
+	};
+	Config conf;
 	bool running;
 	bool repoll;
+	std::string executable;
 
 	// TCP stuff
 	addrinfo *info;
 	int server_fd;
+	int signal_fd;
 	std::vector<pollfd> pfds;
 
+	// Connections that used up their command budget with input left, in turn order
+	std::deque<int> input_queue;
+	std::set<int> input_queued;
+	AddressTable connections_per_ip;
+	Tls tls;
+	int tls_fd;
+
+	// Server links
+	static LinkCommandInfo link_commands[];
+	std::map<int, Link> links;
+	int link_fd;
+	int current_link;
+	int next_remote_id;
+	time_t link_retry_at;
+
+	// Channel fan-out workers
+	ShardSet shards;
+
 	// IRC stuff
 	static CommandInfo commands[];
 	UserList users;
 	UserList operators;
-	std::map<std::string, Channel, map_string_comparator> channels;
+	NickList nicknames;
+	ChannelList channels;
 	std::map<std::string, std::string> configs;
+	std::vector<WelcomeSegment> welcome_burst;
+	size_t welcome_lines;
+	History history;
+	Whowas whowas;
+	Capture capture;
+	MessageTags tags;
+	uint64_t batch_sequence;
+	time_t snapshot_at;
+	SnapshotWriter snapshot_writer;
+	time_t saved_claims_until;
+	Bot bot;
+	std::vector<BotMessage> bot_replies;
+
+	// Plugins, `current_line` is the raw line of the command being handled
+	ServiceRegistry services;
+	const std::string *current_line;
+
+	// MONITOR, the connections watching a nickname and the nicknames each one watches
+	std::map<std::string, std::set<int>, map_string_comparator> watchers;
+	std::map<int, MonitorList> monitoring;
+
+	// Operator managed content filter applied to PRIVMSG and NOTICE text
+	Filter filter;
+
+	// Reverse DNS lookups in flight, by connection, and the connections
+	// waiting on each lookup since one answers every client from an address
+	typedef struct DnsLookup
+	{
+		uint64_t id;
+		time_t deadline;
+	} DnsLookup;
+	Resolver resolver;
+	std::map<int, DnsLookup> dns_lookups;
+	std::map<uint64_t, std::set<int> > dns_lookup_fds;
+
+	// Metrics
+	Metrics metrics;
+	int metrics_fd;
+	// Scrapes in progress and what is left of each response
+	std::map<int, std::string> metrics_clients;
+	std::vector<CommandStats> command_stats;
+	size_t current_command;
+	uint64_t *bytes_queued;
+	uint64_t *connections_total;
+	uint64_t *connections_rejected;
+	uint64_t *link_messages;
+	uint64_t *link_writes;
+	uint64_t *tls_handshakes;
+	uint64_t *tls_resumed;
+	uint64_t *tls_kernel_send;
+	uint64_t *tls_failures;
+	uint64_t *filter_matches;
+	Histogram *loop_latency;
+	Histogram *parse_latency;
+	SlowLog slow_commands;
 
 public:
-	Server(const std::string &port, const std::string &pass);
+	Server(const std::string &port, const std::string &pass, bool detached = false);
 	~Server();
 	void run();
+	void tick();
+	int poll_timeout();
+	void start_services();
+	void start_shards();
+	void set_executable(const std::string &path);
+
+	UserList &get_users();
+	ChannelList &get_channels();
 
 	// Networking
-	void accept_connections();
-	void receive_data(int fd);
+	void accept_connections(int listener);
+	User *add_connection(int fd, sockaddr &addr);
+	bool admit_connection(int fd, sockaddr &addr);
+	bool receive_data(int fd);
+	bool flush_sendbuffer(int fd);
 	void process_events(int fd, int revents);
 	static pollfd make_pfd(int fd, int events, int revents);
-	void terminate_connection(int fd);
+	void terminate_connection(int fd, const std::string &reason = "Client closed connection");
+	void remove_pfd(int fd);
+
+	// TLS
+	void open_tls_listener();
+	bool tls_handshake(int fd);
+	bool receive_tls(int fd);
+	bool is_shardable(int fd);
+	void reshard(int fd);
+	void stop_shards();
+	void shard_join(const std::string &channel, int fd);
 
 	// Parsing
 	void parse_command(int fd, const std::string &cmd);
 	void parse_data(int fd);
+	void queue_input(int fd);
+	void process_input();
 
 	// Validation
 	bool verify_string(const std::string &str, int modes);
@@ -97,15 +314,126 @@ public:
 	int is_valid_command(const std::string &line);
 
 	// Broadcast
+	void enqueue(User *user, const std::string &ircmsg, size_t messages = 1);
+	void reset_tags();
+	const std::string &tag_prefix(uint32_t capabilities);
+	void set_tag_time(uint64_t ms);
+	void set_tag_batch(const std::string &batch);
+	void relay_client_tags();
+	std::string strip_tags(const std::string &line);
+	std::string link_tags();
+	std::string next_batch_id();
+	std::set<int> netsplit_watchers(const std::set<int> &split_users);
 	void send_message(int fd, const std::string &message);
-	void broadcast_message(Channel &channel, const std::string &message, User *except = NULL);
+	void broadcast_message(Channel &channel, const std::string &message, User *except = NULL, const std::string &skip = "", uint32_t capabilities = 0);
 	void server_broadcast_message(const std::string &message, User *except = NULL);
 	void broadcast_user_channels(int fd, const std::string &message, User *except = NULL);
 
 	// Helpers
 	void create_channel(const std::string &name, const std::string &key, const std::string &topic);
 	User *find_user_by_nickname(const std::string &nickname);
+	void set_nickname(User *user, const std::string &nickname);
+	void forget_nickname(User *user);
+	void remember_nickname(User *user);
+	std::string server_of(User *user);
+	void prerender_welcome();
 	void welcome(int fd);
+	void complete_registration(int fd);
+
+	// DNS
+	void resolve_host(User *user, sockaddr &addr);
+	void collect_dns_results();
+	void expire_dns_lookups();
+	void finish_dns_lookup(int fd, const std::string &host);
+	void forget_dns_lookup(int fd);
+
+	// Monitor
+	bool is_online(User *user);
+	void notify_watchers(User *user, bool online);
+	void send_nick_list(int fd, int numeric, const std::vector<std::string> &nicks, const std::string &target = "", char delim = ',');
+	void unmonitor(int fd, const std::string &nickname);
+	void clear_monitor(int fd);
+
+	// Metrics
+	void init_metrics();
+	void update_metrics();
+	void open_metrics_listener();
+	void accept_metrics_client();
+	void serve_metrics_client(int fd, int revents);
+	void close_metrics_client(int fd);
+
+	// Linking
+	void open_link_listener();
+	void accept_link();
+	void connect_link();
+	void check_links();
+	void process_link_events(int fd, int revents);
+	void receive_link(int fd);
+	void flush_link(int fd);
+	void flush_links();
+	void close_link(int fd, const std::string &reason);
+	void link_send(int fd, const std::string &line);
+	void propagate(const std::string &line);
+	void parse_link_line(int fd, const std::string &line);
+	void send_burst(int fd);
+	bool is_linked_user(User *user);
+	bool is_known_server(const std::string &name);
+	std::string known_servers(int except);
+	std::string uid_line(User *user);
+	std::string channel_state_line(Channel &channel);
+	std::string channel_mask_line(Channel &channel, char operation, int mode, const MaskList::Entry &entry);
+	void remove_remote_user(User *user, const std::string &reason);
+	bool resolve_collision(User *holder, time_t time, const std::string &userhost);
+
+	// Link Command Handlers
+	void LINK_SERVER(int fd, std::vector<std::string> &args);
+	void LINK_SERVERS(int fd, std::vector<std::string> &args);
+	void LINK_SQUIT(int fd, std::vector<std::string> &args);
+	void LINK_BURST(int fd, std::vector<std::string> &args);
+	void LINK_ENDBURST(int fd, std::vector<std::string> &args);
+	void LINK_UID(int fd, std::vector<std::string> &args);
+	void LINK_NICK(int fd, std::vector<std::string> &args);
+	void LINK_QUIT(int fd, std::vector<std::string> &args);
+	void LINK_CHAN(int fd, std::vector<std::string> &args);
+	void LINK_JOIN(int fd, std::vector<std::string> &args);
+	void LINK_PART(int fd, std::vector<std::string> &args);
+	void LINK_OP(int fd, std::vector<std::string> &args);
+	void LINK_INVITE(int fd, std::vector<std::string> &args);
+	void LINK_BCAST(int fd, std::vector<std::string> &args);
+	void LINK_MASK(int fd, std::vector<std::string> &args);
+	void LINK_AWAY(int fd, std::vector<std::string> &args);
+	void LINK_TO(int fd, std::vector<std::string> &args);
+	void LINK_ERROR(int fd, std::vector<std::string> &args);
+
+	// Hot restart
+	void open_signal_fd();
+	void handle_signals();
+	void hot_restart();
+	std::string serialize_state(std::vector<int> &fds);
+	std::vector<int> restore_state(const std::string &state, const std::vector<int> &fds);
+	void adopt_handoff(int sock);
+
+	// Snapshot
+	std::string encode_snapshot();
+	bool save_snapshot(const std::string &path);
+	void wait_snapshot();
+	bool load_snapshot(const std::string &path);
+
+	// Services
+	void load_services();
+	int service_command(int command, int fd, User *user, std::vector<std::string> &args);
+	int service_channel(int event, int fd, User *user, Channel &channel, std::vector<std::string> &args);
+	void apply_service_reply(int fd, Channel *channel, ServiceReply &reply);
+	void disconnect(int fd, const std::string &reason);
+	void send_closing_error(int fd, const std::string &reason);
+
+	// Filter
+	bool filter_message(int fd, User *user, const std::string &targets, const std::string &text, bool notice);
+
+	// History
+	void persist_channel(Channel &channel);
+	void send_mask_list(int fd, Channel &channel, int mode);
+	void recover_history();
 
 	// Operators
 	bool is_operator(int fd);
@@ -114,6 +442,7 @@ public:
 
 	// Errors
 	void need_more_params(int fd, const std::string &command);
+	void no_privileges(int fd);
 	void no_such_channel(int fd, const std::string &channel);
 	void not_on_channel(int fd, const std::string &channel);
 	void no_such_nick(int fd, const std::string &nickname);
@@ -126,11 +455,16 @@ public:
 	// Conf
 	bool load_config(const std::string &filename);
 	bool load_config_channel(std::ifstream &file);
+	void configure();
+	std::vector<std::string> create_configured_channels();
+	void reload_config();
 
 	// Bot
 	void initialize_bot();
-	bool bot_parse();
-	void bot_response(std::string message);
+	void bot_hear(const std::string &target, const std::string &sender, const std::string &text);
+	void bot_reply(const BotMessage &reply);
+	void collect_bot_replies();
+	void flush_bot_replies();
 
 	// Command Handlers
 	void PASS(int fd, User *user, std::vector<std::string> &args);
@@ -141,6 +475,8 @@ public:
 	void JOIN(int fd, User *user, std::vector<std::string> &args);
 	void WHO(int fd, User *user, std::vector<std::string> &args);
 	void PRIVMSG(int fd, User *user, std::vector<std::string> &args);
+	void NOTICE(int fd, User *user, std::vector<std::string> &args);
+	void message_targets(int fd, User *user, std::vector<std::string> &args);
 	void ISON(int fd, User *user, std::vector<std::string> &args);
 	void PART(int fd, User *user, std::vector<std::string> &args);
 	void PING(int fd, User *user, std::vector<std::string> &args);
@@ -149,5 +485,15 @@ public:
 	void INVITE(int fd, User *user, std::vector<std::string> &args);
 	void TOPIC(int fd, User *user, std::vector<std::string> &args);
 	void MODE(int fd, User *user, std::vector<std::string> &args);
+	void HISTORY(int fd, User *user, std::vector<std::string> &args);
+	void STATS(int fd, User *user, std::vector<std::string> &args);
+	void SLOWLOG(int fd, User *user, std::vector<std::string> &args);
+	void CAP(int fd, User *user, std::vector<std::string> &args);
+	void TAGMSG(int fd, User *user, std::vector<std::string> &args);
+	void MONITOR(int fd, User *user, std::vector<std::string> &args);
+	void FILTER(int fd, User *user, std::vector<std::string> &args);
+	void WHOIS(int fd, User *user, std::vector<std::string> &args);
+	void WHOWAS(int fd, User *user, std::vector<std::string> &args);
+	void AWAY(int fd, User *user, std::vector<std::string> &args);
 	void IGNORED(int fd, User *user, std::vector<std::string> &args);
 };
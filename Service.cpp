@@ -0,0 +1,135 @@
+#include "Service.hpp"
+
+#include <dlfcn.h>
+
+ServiceMessage::ServiceMessage(int fd, const std::string &nick, const std::string &line, const std::vector<std::string> &args, const std::string *channel)
+	: fd(fd), nick(nick), line(line), args(args), channel(channel) {}
+
+ServiceReply::ServiceReply(const std::string &server, const std::string &nick) : server(server), nick(nick) {}
+
+void ServiceReply::send(const std::string &line) { to_sender.push_back(line); }
+void ServiceReply::notice(const std::string &text) { to_sender.push_back(":" + server + " NOTICE " + nick + " :" + text); }
+void ServiceReply::numeric(const std::string &code, const std::string &params) { to_sender.push_back(":" + server + " " + code + " " + nick + " " + params); }
+void ServiceReply::broadcast(const std::string &line) { to_channel.push_back(line); }
+void ServiceReply::disconnect(const std::string &reason) { quit_reason = reason.empty() ? "Disconnected by service" : reason; }
+
+const std::vector<std::string> &ServiceReply::get_sender_lines() { return to_sender; }
+const std::vector<std::string> &ServiceReply::get_channel_lines() { return to_channel; }
+const std::string &ServiceReply::get_quit_reason() { return quit_reason; }
+bool ServiceReply::empty() { return to_sender.empty() && to_channel.empty() && quit_reason.empty(); }
+
+Service::~Service() {}
+
+int Service::on_command(const ServiceMessage &message, ServiceReply &reply)
+{
+	(void)message;
+	(void)reply;
+	return SERVICE_CONTINUE;
+}
+
+int Service::on_channel(int event, const ServiceMessage &message, ServiceReply &reply)
+{
+	(void)event;
+	(void)message;
+	(void)reply;
+	return SERVICE_CONTINUE;
+}
+
+ServiceRegistry::ServiceRegistry() {}
+
+ServiceRegistry::~ServiceRegistry()
+{
+	unload();
+}
+
+void ServiceRegistry::set_commands(const std::vector<std::string> &names)
+{
+	command_names = names;
+	command_hooks.assign(names.size(), std::vector<Service *>());
+}
+
+bool ServiceRegistry::load(const std::string &path, std::string &error)
+{
+	void *handle = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+	if (handle == NULL)
+	{
+		error = dlerror();
+		return false;
+	}
+
+	Service *(*create)() = NULL;
+	*(void **)&create = dlsym(handle, SERVICE_ENTRY);
+	Service *service = create ? create() : NULL;
+	if (service == NULL)
+	{
+		error = path + ": no " SERVICE_ENTRY " or it returned NULL";
+		dlclose(handle);
+		return false;
+	}
+
+	Loaded entry = {handle, service};
+	loaded.push_back(entry);
+	service->attach(*this);
+	return true;
+}
+
+// Services are deleted before their code is unmapped
+void ServiceRegistry::unload()
+{
+	for (size_t i = 0; i < command_hooks.size(); i++)
+		command_hooks[i].clear();
+	for (size_t i = 0; i < SERVICE_EVENTS; i++)
+		channel_hooks[i].clear();
+	for (size_t i = loaded.size(); i-- > 0;)
+	{
+		delete loaded[i].service;
+		dlclose(loaded[i].handle);
+	}
+	loaded.clear();
+}
+
+size_t ServiceRegistry::size() { return loaded.size(); }
+
+void ServiceRegistry::on_command(const std::string &command, Service *service)
+{
+	for (size_t i = 0; i < command_names.size(); i++)
+		if (command_names[i] == command)
+			command_hooks[i].push_back(service);
+}
+
+void ServiceRegistry::on_channel(int event, Service *service)
+{
+	if (event >= 0 && event < SERVICE_EVENTS)
+		channel_hooks[event].push_back(service);
+}
+
+bool ServiceRegistry::has_command(int command)
+{
+	return command >= 0 && (size_t)command < command_hooks.size() && !command_hooks[command].empty();
+}
+
+bool ServiceRegistry::has_channel(int event)
+{
+	return !channel_hooks[event].empty();
+}
+
+// Hooks run in load order, the first one to stop the message wins
+int ServiceRegistry::command(int command, const ServiceMessage &message, ServiceReply &reply)
+{
+	std::vector<Service *> &hooks = command_hooks[command];
+
+	for (size_t i = 0; i < hooks.size(); i++)
+		if (hooks[i]->on_command(message, reply) == SERVICE_STOP)
+			return SERVICE_STOP;
+	return SERVICE_CONTINUE;
+}
+
+int ServiceRegistry::channel(int event, const ServiceMessage &message, ServiceReply &reply)
+{
+	std::vector<Service *> &hooks = channel_hooks[event];
+
+	for (size_t i = 0; i < hooks.size(); i++)
+		if (hooks[i]->on_channel(event, message, reply) == SERVICE_STOP)
+			return SERVICE_STOP;
+	return SERVICE_CONTINUE;
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include "IRCserver.hpp"
+
+#define SERVICE_ENTRY "ircserv_service_create"
+#define SERVICE_ENTRY_POINT extern "C" Service *ircserv_service_create()
+
+class Service;
+
+// Hook verdicts, SERVICE_STOP keeps the server from acting on the message
+enum {
+	SERVICE_CONTINUE,
+	SERVICE_STOP
+};
+
+enum {
+	SERVICE_JOIN,
+	SERVICE_PART,
+	SERVICE_MESSAGE, // PRIVMSG, NOTICE and TAGMSG to a channel, TAGMSG has no text
+	SERVICE_EVENTS
+};
+
+// Borrowed view of the message being handled, only valid during the hook.
+// `args` is the server's own parse of `line`, `channel` is NULL for
+// command hooks.
+typedef struct ServiceMessage
+{
+	int fd;
+	const std::string &nick;
+	const std::string &line;
+	const std::vector<std::string> &args;
+	const std::string *channel;
+
+	ServiceMessage(int fd, const std::string &nick, const std::string &line, const std::vector<std::string> &args, const std::string *channel = NULL);
+} ServiceMessage;
+
+// Lines a hook wants sent, delivered by the server once the hook returns
+class ServiceReply
+{
+private:
+	const std::string &server;
+	const std::string &nick;
+	std::vector<std::string> to_sender;
+	std::vector<std::string> to_channel;
+	std::string quit_reason;
+
+public:
+	ServiceReply(const std::string &server, const std::string &nick);
+
+	void send(const std::string &line);
+	void notice(const std::string &text);
+	void numeric(const std::string &code, const std::string &params);
+	void broadcast(const std::string &line);
+	void disconnect(const std::string &reason);
+
+	const std::vector<std::string> &get_sender_lines();
+	const std::vector<std::string> &get_channel_lines();
+	const std::string &get_quit_reason();
+	bool empty();
+};
+
+class ServiceRegistry;
+
+// Implemented by plugins. A shared object exports SERVICE_ENTRY_POINT
+// returning a new instance; attach() then registers the hooks it wants.
+class Service
+{
+public:
+	virtual ~Service();
+
+	virtual const char *name() = 0;
+	virtual void attach(ServiceRegistry &registry) = 0;
+	virtual int on_command(const ServiceMessage &message, ServiceReply &reply);
+	virtual int on_channel(int event, const ServiceMessage &message, ServiceReply &reply);
+};
+
+// Loaded services and the hooks they registered. Command hooks are indexed
+// like the server's command table so dispatch is one vector lookup, and an
+// empty slot costs the core path a single branch.
+class ServiceRegistry
+{
+private:
+	typedef struct Loaded
+	{
+		void *handle;
+		Service *service;
+	} Loaded;
+
+	std::vector<std::string> command_names;
+	std::vector<std::vector<Service *> > command_hooks;
+	std::vector<Service *> channel_hooks[SERVICE_EVENTS];
+	std::vector<Loaded> loaded;
+
+public:
+	ServiceRegistry();
+	~ServiceRegistry();
+
+	void set_commands(const std::vector<std::string> &names);
+	bool load(const std::string &path, std::string &error);
+	void unload();
+	size_t size();
+
+	void on_command(const std::string &command, Service *service);
+	void on_channel(int event, Service *service);
+
+	bool has_command(int command);
+	bool has_channel(int event);
+	int command(int command, const ServiceMessage &message, ServiceReply &reply);
+	int channel(int event, const ServiceMessage &message, ServiceReply &reply);
+};
@@ -0,0 +1,559 @@
+#include "Shard.hpp"
+#include "Handoff.hpp"
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#define SHARD_FRONT 1
+#define SHARD_MAX_OWNERS (1 << 20)
+
+static void ring_copy_in(ShardRing *ring, uint64_t pos, const char *src, size_t len)
+{
+	size_t offset = pos % SHARD_RING_SIZE;
+	size_t first = std::min(len, (size_t)SHARD_RING_SIZE - offset);
+
+	std::memcpy(ring->data + offset, src, first);
+	std::memcpy(ring->data, src + first, len - first);
+}
+
+static void ring_copy_out(ShardRing *ring, uint64_t pos, char *dst, size_t len)
+{
+	size_t offset = pos % SHARD_RING_SIZE;
+	size_t first = std::min(len, (size_t)SHARD_RING_SIZE - offset);
+
+	std::memcpy(dst, ring->data + offset, first);
+	std::memcpy(dst + first, ring->data, len - first);
+}
+
+static pollfd make_pollfd(int fd, int events)
+{
+	pollfd pfd = initialized<pollfd>();
+
+	pfd.fd = fd;
+	pfd.events = events;
+	return pfd;
+}
+
+static void *map_shared(size_t size)
+{
+	void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	return map == MAP_FAILED ? NULL : map;
+}
+
+ShardSet::ShardSet() : owners(NULL), owner_count(0) {}
+
+ShardSet::~ShardSet()
+{
+	stop();
+}
+
+// Forks `count` workers, each closes the descriptors in `inherited` so
+// client sockets and listeners only stay open where they are used
+bool ShardSet::start(size_t count, const std::vector<pollfd> &inherited)
+{
+	rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == -1 || limit.rlim_cur == RLIM_INFINITY || limit.rlim_cur > SHARD_MAX_OWNERS)
+		limit.rlim_cur = SHARD_MAX_OWNERS;
+	owner_count = limit.rlim_cur;
+	owners = (volatile uint32_t *)map_shared(owner_count * sizeof(uint32_t));
+	if (owners == NULL)
+		return false;
+
+	pid_t parent = getpid();
+	for (size_t i = 0; i < count; i++)
+	{
+		Shard shard;
+		int sv[2];
+
+		shard.ring = (ShardRing *)map_shared(sizeof(ShardRing));
+		shard.dirty = false;
+		shard.backlog_bytes = 0;
+		shard.doorbell = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (shard.ring == NULL || shard.doorbell == -1 || socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1)
+		{
+			if (shard.ring)
+				munmap(shard.ring, sizeof(ShardRing));
+			if (shard.doorbell != -1)
+				close(shard.doorbell);
+			stop();
+			return false;
+		}
+
+		shard.pid = fork();
+		if (shard.pid == 0)
+		{
+			prctl(PR_SET_PDEATHSIG, SIGKILL);
+			if (getppid() != parent)
+				_exit(EXIT_SUCCESS);
+			for (size_t j = 0; j < inherited.size(); j++)
+				close(inherited[j].fd);
+			for (size_t j = 0; j < shards.size(); j++)
+			{
+				close(shards[j].sock);
+				close(shards[j].doorbell);
+			}
+			close(sv[0]);
+			worker(shard.ring, owners, owner_count, sv[1], shard.doorbell, i + SHARD_FRONT + 1);
+			_exit(EXIT_SUCCESS);
+		}
+		close(sv[1]);
+		shard.sock = sv[0];
+		shards.push_back(shard);
+		if (shard.pid == -1)
+		{
+			stop();
+			return false;
+		}
+	}
+	return true;
+}
+
+void ShardSet::stop()
+{
+	for (size_t i = 0; i < shards.size(); i++)
+	{
+		if (shards[i].pid > 0)
+		{
+			kill(shards[i].pid, SIGKILL);
+			waitpid(shards[i].pid, NULL, 0);
+		}
+		munmap(shards[i].ring, sizeof(ShardRing));
+		close(shards[i].sock);
+		close(shards[i].doorbell);
+	}
+	shards.clear();
+	if (owners)
+		munmap((void *)owners, owner_count * sizeof(uint32_t));
+	owners = NULL;
+	owner_count = 0;
+}
+
+// Stops every worker and collects the lines still in their rings and
+// backlogs, oldest first for each client. The caller sends them and then
+// calls stop(). What a worker had already read off its ring goes with it.
+std::vector<ShardLine> ShardSet::halt()
+{
+	std::vector<ShardLine> lines;
+	std::vector<char> record;
+
+	for (size_t i = 0; i < shards.size(); i++)
+	{
+		Shard &shard = shards[i];
+		if (shard.pid > 0)
+		{
+			kill(shard.pid, SIGKILL);
+			waitpid(shard.pid, NULL, 0);
+		}
+		shard.pid = -1;
+		for (uint64_t tail = shard.ring->tail; tail < shard.ring->head;)
+		{
+			char prefix[4];
+			ring_copy_out(shard.ring, tail, prefix, 4);
+			uint32_t length = ByteReader(prefix, 4).u32();
+			record.resize(length + 1);
+			ring_copy_out(shard.ring, tail + 4, &record[0], length);
+			tail += 4 + length;
+			take_line(lines, i, &record[0], length);
+		}
+		for (size_t j = 0; j < shard.backlog.size(); j++)
+			take_line(lines, i, shard.backlog[j].c_str(), shard.backlog[j].length());
+		shard.backlog.clear();
+		shard.backlog_bytes = 0;
+	}
+	return lines;
+}
+
+void ShardSet::take_line(std::vector<ShardLine> &lines, size_t shard, const char *record, size_t length)
+{
+	ByteReader reader(record, length);
+	ShardLine line;
+	int type = reader.u8();
+
+	line.shard = shard;
+	line.fd = (int)reader.u32();
+	if (type == SHARD_BCAST)
+		line.channel = reader.str();
+	else if (type != SHARD_SEND)
+		return;
+	line.message = reader.str();
+	if (reader.good())
+		lines.push_back(line);
+}
+
+bool ShardSet::is_running() { return !shards.empty(); }
+size_t ShardSet::size() { return shards.size(); }
+
+// False once a worker has exited, its channels can no longer be served
+bool ShardSet::check()
+{
+	for (size_t i = 0; i < shards.size(); i++)
+		if (shards[i].pid == -1 || waitpid(shards[i].pid, NULL, WNOHANG) != 0)
+		{
+			shards[i].pid = -1;
+			return false;
+		}
+	return true;
+}
+
+// Descriptors are handed out lowest first, consecutive clients land on different workers
+size_t ShardSet::shard_of(int fd)
+{
+	return fd % shards.size();
+}
+
+bool ShardSet::has_client(int fd)
+{
+	return !shards.empty() && shards[shard_of(fd)].clients.count(fd);
+}
+
+// False when the ring has no room for the record
+bool ShardSet::write_record(Shard &shard, const std::string &record)
+{
+	ShardRing *ring = shard.ring;
+	uint64_t head = ring->head;
+	size_t length = 4 + record.length();
+
+	if (head + length - ring->tail > SHARD_RING_SIZE)
+		return false;
+
+	std::string prefix;
+	put_u32(prefix, record.length());
+	ring_copy_in(ring, head, prefix.c_str(), 4);
+	ring_copy_in(ring, head + 4, record.c_str(), record.length());
+	__sync_synchronize();
+	ring->head = head + length;
+	shard.dirty = true;
+	return true;
+}
+
+// Records go to the backlog while one waits as well, or they would overtake
+// it. A worker that lets it grow past SHARD_BACKLOG_MAX is killed, check()
+// then reports it and its lines are sent by the front process.
+void ShardSet::push(Shard &shard, const std::string &record)
+{
+	if (shard.backlog.empty() && write_record(shard, record))
+		return;
+	shard.backlog.push_back(record);
+	shard.backlog_bytes += record.length();
+	if (shard.pid > 0 && shard.backlog_bytes > SHARD_BACKLOG_MAX && shard.backlog_bytes - record.length() <= SHARD_BACKLOG_MAX)
+	{
+		std::cout << GREY << "WARNING: shard worker " << shard.pid << " is " << shard.backlog_bytes << " bytes behind, stopping it" << RESET << std::endl;
+		kill(shard.pid, SIGKILL);
+	}
+}
+
+// The socket goes first so it is waiting when the worker reads the record,
+// the doorbell rings right away to keep the unix socket from filling up
+void ShardSet::add_client(Shard &shard, int fd)
+{
+	if (shard.clients.count(fd))
+		return;
+
+	std::string record;
+	put_u8(record, SHARD_ADD);
+	put_u32(record, fd);
+	if (!handoff_send(shard.sock, std::vector<int>(1, fd), ""))
+	{
+		kill(shard.pid, SIGKILL);
+		return;
+	}
+	push(shard, record);
+	shard.clients.insert(fd);
+	eventfd_write(shard.doorbell, 1);
+}
+
+void ShardSet::join(const std::string &channel, int fd)
+{
+	Shard &shard = shards[shard_of(fd)];
+	std::string record;
+
+	add_client(shard, fd);
+	put_u8(record, SHARD_JOIN);
+	put_u32(record, fd);
+	put_str(record, channel);
+	push(shard, record);
+}
+
+void ShardSet::part(const std::string &channel, int fd)
+{
+	Shard &shard = shards[shard_of(fd)];
+	std::string record;
+
+	if (!shard.clients.count(fd))
+		return;
+	put_u8(record, SHARD_PART);
+	put_u32(record, fd);
+	put_str(record, channel);
+	push(shard, record);
+}
+
+// The worker lets go of the connection once it has written out what it holds
+void ShardSet::drop(int fd)
+{
+	std::string record;
+
+	if (!has_client(fd))
+		return;
+	Shard &shard = shards[shard_of(fd)];
+	shard.clients.erase(fd);
+	put_u8(record, SHARD_DROP);
+	put_u32(record, fd);
+	push(shard, record);
+}
+
+// False when no worker writes to the client, the caller does
+bool ShardSet::send(int fd, const std::string &data)
+{
+	std::string record;
+
+	if (!has_client(fd))
+		return false;
+	put_u8(record, SHARD_SEND);
+	put_u32(record, fd);
+	put_str(record, data);
+	push(shards[shard_of(fd)], record);
+	return true;
+}
+
+// Fans out to the members of `channel` that `shard` writes to
+void ShardSet::broadcast(size_t shard, const std::string &channel, const std::string &message, int except)
+{
+	std::string record;
+
+	put_u8(record, SHARD_BCAST);
+	put_u32(record, except);
+	put_str(record, channel);
+	put_str(record, message);
+	push(shards[shard], record);
+}
+
+// Called once per event loop iteration, workers wake up once per batch. A
+// worker with a backlog is rung until it has read enough to take it all.
+void ShardSet::notify()
+{
+	for (size_t i = 0; i < shards.size(); i++)
+	{
+		Shard &shard = shards[i];
+		while (!shard.backlog.empty() && shard.pid != -1 && write_record(shard, shard.backlog.front()))
+		{
+			shard.backlog_bytes -= shard.backlog.front().length();
+			shard.backlog.pop_front();
+		}
+		if (shard.dirty || !shard.backlog.empty())
+		{
+			eventfd_write(shard.doorbell, 1);
+			shard.dirty = false;
+		}
+	}
+}
+
+bool ShardSet::is_backlogged()
+{
+	for (size_t i = 0; i < shards.size(); i++)
+		if (!shards[i].backlog.empty() && shards[i].pid != -1)
+			return true;
+	return false;
+}
+
+size_t ShardSet::get_backlog_bytes()
+{
+	size_t bytes = 0;
+
+	for (size_t i = 0; i < shards.size(); i++)
+		bytes += shards[i].backlog_bytes;
+	return bytes;
+}
+
+bool ShardSet::acquire(int fd)
+{
+	if (owners == NULL || (size_t)fd >= owner_count)
+		return true;
+	return __sync_bool_compare_and_swap(&owners[fd], 0, SHARD_FRONT);
+}
+
+void ShardSet::release(int fd)
+{
+	if (owners != NULL && (size_t)fd < owner_count)
+		__sync_lock_release(&owners[fd]);
+}
+
+typedef struct WorkerClient
+{
+	int fd;
+	bool owned;
+	bool dropped;
+	std::string pending;
+	std::set<std::string> channels;
+} WorkerClient;
+
+static void close_client(std::map<int, WorkerClient> &clients, int fd, volatile uint32_t *owners, size_t owner_count)
+{
+	WorkerClient &client = clients[fd];
+
+	if (client.owned && (size_t)fd < owner_count)
+		__sync_lock_release(&owners[fd]);
+	close(client.fd);
+	clients.erase(fd);
+}
+
+static bool same_socket(int a, int b)
+{
+	struct stat sa, sb;
+	return fstat(a, &sa) == 0 && fstat(b, &sb) == 0 && sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+}
+
+// Connections are keyed by their descriptor number in the front process,
+// which is also their index into the owner array
+void ShardSet::worker(ShardRing *ring, volatile uint32_t *owners, size_t owner_count, int sock, int doorbell, uint32_t id)
+{
+	std::map<int, WorkerClient> clients;
+	std::map<std::string, std::set<int> > members;
+	std::set<int> dirty;
+	std::vector<char> record;
+	uint64_t tail = ring->tail;
+	bool blocked = false;
+
+	while (true)
+	{
+		std::vector<pollfd> pfds(1, make_pollfd(doorbell, POLLIN));
+		for (std::set<int>::iterator it = dirty.begin(); it != dirty.end(); ++it)
+			if (clients[*it].owned)
+				pfds.push_back(make_pollfd(clients[*it].fd, POLLOUT));
+		if (poll(&pfds[0], pfds.size(), blocked ? 1 : -1) == -1 && errno != EINTR)
+			_exit(EXIT_FAILURE);
+
+		eventfd_t value;
+		eventfd_read(doorbell, &value);
+
+		uint64_t head = ring->head;
+		__sync_synchronize();
+		while (tail < head)
+		{
+			char prefix[4];
+			ring_copy_out(ring, tail, prefix, 4);
+			uint32_t length = ByteReader(prefix, 4).u32();
+			record.resize(length + 1);
+			ring_copy_out(ring, tail + 4, &record[0], length);
+			tail += 4 + length;
+
+			ByteReader reader(&record[0], length);
+			int type = reader.u8();
+			int fd = (int)reader.u32();
+			if (type == SHARD_ADD)
+			{
+				std::vector<int> fds;
+				std::string state;
+				if (!handoff_receive(sock, fds, state) || fds.size() != 1)
+					_exit(EXIT_FAILURE);
+				// Back before its last lines were out, those still go first. A
+				// new connection under the same number replaces a closed one.
+				if (clients.count(fd) && same_socket(clients[fd].fd, fds[0]))
+				{
+					close(fds[0]);
+					clients[fd].dropped = false;
+					continue;
+				}
+				if (clients.count(fd))
+				{
+					close_client(clients, fd, owners, owner_count);
+					dirty.erase(fd);
+				}
+				WorkerClient &client = clients[fd];
+				client.fd = fds[0];
+				client.owned = false;
+				client.dropped = false;
+			}
+			else if (type == SHARD_DROP && clients.count(fd))
+			{
+				WorkerClient &client = clients[fd];
+				for (std::set<std::string>::iterator it = client.channels.begin(); it != client.channels.end(); ++it)
+				{
+					members[*it].erase(fd);
+					if (members[*it].empty())
+						members.erase(*it);
+				}
+				client.channels.clear();
+				client.dropped = true;
+				if (client.pending.empty())
+				{
+					close_client(clients, fd, owners, owner_count);
+					dirty.erase(fd);
+				}
+			}
+			else if (type == SHARD_JOIN && clients.count(fd))
+			{
+				std::string channel = reader.str();
+				members[channel].insert(fd);
+				clients[fd].channels.insert(channel);
+			}
+			else if (type == SHARD_PART && clients.count(fd))
+			{
+				std::string channel = reader.str();
+				members[channel].erase(fd);
+				if (members[channel].empty())
+					members.erase(channel);
+				clients[fd].channels.erase(channel);
+			}
+			else if (type == SHARD_BCAST)
+			{
+				std::string channel = reader.str();
+				std::string message = reader.str();
+				std::map<std::string, std::set<int> >::iterator it = members.find(channel);
+				if (it == members.end())
+					continue;
+				for (std::set<int>::iterator mit = it->second.begin(); mit != it->second.end(); ++mit)
+				{
+					if (*mit == fd)
+						continue;
+					clients[*mit].pending += message;
+					dirty.insert(*mit);
+				}
+			}
+			else if (type == SHARD_SEND && clients.count(fd))
+			{
+				clients[fd].pending += reader.str();
+				dirty.insert(fd);
+			}
+		}
+		__sync_synchronize();
+		ring->tail = tail;
+
+		// A connection the front process is writing to is retried on a short timeout
+		blocked = false;
+		for (std::set<int>::iterator it = dirty.begin(); it != dirty.end();)
+		{
+			int fd = *it;
+			WorkerClient &client = clients[fd];
+			if (!client.owned)
+				client.owned = (size_t)fd >= owner_count || __sync_bool_compare_and_swap(&owners[fd], 0, id);
+			if (!client.owned)
+			{
+				blocked = true;
+				++it;
+				continue;
+			}
+			ssize_t ret = ::send(client.fd, client.pending.c_str(), client.pending.length(), MSG_NOSIGNAL | MSG_DONTWAIT);
+			if (ret > 0)
+				client.pending.erase(0, ret);
+			else if (ret == -1 && errno != EAGAIN && errno != EINTR)
+				client.pending.clear();
+			if (!client.pending.empty())
+			{
+				++it;
+				continue;
+			}
+			dirty.erase(it++);
+			if (client.dropped)
+			{
+				close_client(clients, fd, owners, owner_count);
+				continue;
+			}
+			if ((size_t)fd < owner_count)
+				__sync_lock_release(&owners[fd]);
+			client.owned = false;
+		}
+	}
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include "IRCserver.hpp"
+
+#include <deque>
+
+#define SHARD_RING_SIZE (4 * 1024 * 1024)
+#define SHARD_BACKLOG_MAX (16 * 1024 * 1024)
+
+enum {
+	SHARD_ADD,
+	SHARD_DROP,
+	SHARD_JOIN,
+	SHARD_PART,
+	SHARD_BCAST,
+	SHARD_SEND
+};
+
+// Single producer single consumer byte ring in shared memory. Records are a
+// u32 length followed by the payload and may wrap around the end. head and
+// tail only grow, each is written by one side and read by the other.
+typedef struct ShardRing
+{
+	volatile uint64_t head;
+	char head_pad[56];
+	volatile uint64_t tail;
+	char tail_pad[56];
+	char data[SHARD_RING_SIZE];
+} ShardRing;
+
+// A line a worker never read: for `fd` alone when `channel` is empty, else
+// for the members of `channel` on `shard` other than `fd`
+typedef struct ShardLine
+{
+	size_t shard;
+	int fd;
+	std::string channel;
+	std::string message;
+} ShardLine;
+
+// Channel fan-out on forked worker processes. The front process keeps all
+// state and reads from client connections. A client that joins a channel is
+// handed to the worker its descriptor hashes to, over a unix socket, and
+// from then on that worker is the only one writing to it: a channel line is
+// one record per worker with members in the channel, anything else for one
+// of its clients a record of its own, so each client sees its lines in the
+// order the front process sent them. Workers mirror the memberships of
+// their own clients from the records they read off their ring. Workers own
+// clients rather than channels, a client in channels owned by different
+// workers would have several writers.
+//
+// A client leaving its worker is written out before the worker lets go of
+// it. A per connection owner word in shared memory keeps the front process
+// from writing until then: whoever holds it writes, and a writer keeps it
+// until its buffer for that connection is drained.
+//
+// The front process never waits on a worker. Records that find the ring full
+// queue up in order in a backlog that is moved into the ring as room comes
+// back. A worker more than SHARD_BACKLOG_MAX behind is killed, and halt()
+// returns the lines no worker read so the front process can send them.
+class ShardSet
+{
+private:
+	typedef struct Shard
+	{
+		pid_t pid;
+		ShardRing *ring;
+		int sock;
+		int doorbell;
+		bool dirty;
+		std::set<int> clients;
+		std::deque<std::string> backlog;
+		size_t backlog_bytes;
+	} Shard;
+
+	std::vector<Shard> shards;
+	volatile uint32_t *owners;
+	size_t owner_count;
+
+	static void worker(ShardRing *ring, volatile uint32_t *owners, size_t owner_count, int sock, int doorbell, uint32_t id);
+	static bool write_record(Shard &shard, const std::string &record);
+	void push(Shard &shard, const std::string &record);
+	static void take_line(std::vector<ShardLine> &lines, size_t shard, const char *record, size_t length);
+	void add_client(Shard &shard, int fd);
+
+public:
+	ShardSet();
+	~ShardSet();
+
+	bool start(size_t count, const std::vector<pollfd> &inherited);
+	void stop();
+	std::vector<ShardLine> halt();
+	bool is_running();
+	bool check();
+	size_t size();
+	size_t shard_of(int fd);
+	bool has_client(int fd);
+
+	void join(const std::string &channel, int fd);
+	void part(const std::string &channel, int fd);
+	void drop(int fd);
+	bool send(int fd, const std::string &data);
+	void broadcast(size_t shard, const std::string &channel, const std::string &message, int except);
+	void notify();
+	bool is_backlogged();
+	size_t get_backlog_bytes();
+
+	bool acquire(int fd);
+	void release(int fd);
+};
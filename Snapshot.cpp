@@ -0,0 +1,210 @@
+#include "Snapshot.hpp"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SNAPSHOT_HEADER_SIZE (8 + 4 + 8)
+
+Snapshot::Snapshot() : map(NULL), size(0), version(0), created(0) {}
+
+Snapshot::~Snapshot()
+{
+	close();
+}
+
+bool Snapshot::save(const std::string &path, const std::string &body)
+{
+	std::string header(SNAPSHOT_MAGIC);
+	std::string tmp = path + ".tmp";
+
+	put_u32(header, SNAPSHOT_VERSION);
+	put_u64(header, std::time(NULL));
+
+	int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd == -1)
+		return false;
+	const std::string *parts[] = {&header, &body};
+	for (size_t i = 0; i < 2; i++)
+	{
+		size_t written = 0;
+		while (written < parts[i]->length())
+		{
+			ssize_t ret = write(fd, parts[i]->c_str() + written, parts[i]->length() - written);
+			if (ret <= 0)
+			{
+				if (ret == -1 && errno == EINTR)
+					continue;
+				::close(fd);
+				unlink(tmp.c_str());
+				return false;
+			}
+			written += ret;
+		}
+	}
+	if (fsync(fd) == -1)
+	{
+		::close(fd);
+		unlink(tmp.c_str());
+		return false;
+	}
+	::close(fd);
+	if (rename(tmp.c_str(), path.c_str()) == -1)
+		return false;
+
+	// The rename is only durable once the directory entry is
+	size_t slash = path.rfind('/');
+	std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+	int dir_fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dir_fd == -1)
+		return false;
+	bool synced = fsync(dir_fd) == 0;
+	::close(dir_fd);
+	return synced;
+}
+
+bool Snapshot::open(const std::string &path)
+{
+	close();
+	int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return false;
+
+	struct stat st;
+	if (fstat(fd, &st) == -1 || st.st_size < SNAPSHOT_HEADER_SIZE)
+	{
+		::close(fd);
+		return false;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (map == MAP_FAILED)
+	{
+		map = NULL;
+		return false;
+	}
+	size = st.st_size;
+	madvise(map, size, MADV_SEQUENTIAL);
+
+	ByteReader header((const char *)map, size);
+	header.skip(8);
+	version = header.u32();
+	created = header.u64();
+	if (std::memcmp(map, SNAPSHOT_MAGIC, 8) != 0 || version == 0 || version > SNAPSHOT_VERSION)
+	{
+		close();
+		return false;
+	}
+	return true;
+}
+
+void Snapshot::close()
+{
+	if (map)
+		munmap(map, size);
+	map = NULL;
+	size = 0;
+}
+
+uint32_t Snapshot::get_version() { return version; }
+time_t Snapshot::get_created() { return created; }
+
+ByteReader Snapshot::body()
+{
+	return ByteReader((const char *)map + SNAPSHOT_HEADER_SIZE, size - SNAPSHOT_HEADER_SIZE);
+}
+
+SnapshotWriter::SnapshotWriter() : threaded(false), queued(false), writing(false), stopping(false)
+{
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&cond, NULL);
+}
+
+SnapshotWriter::~SnapshotWriter()
+{
+	stop();
+	pthread_cond_destroy(&cond);
+	pthread_mutex_destroy(&lock);
+}
+
+void *SnapshotWriter::worker(void *arg)
+{
+	static_cast<SnapshotWriter *>(arg)->work();
+	return NULL;
+}
+
+void SnapshotWriter::work()
+{
+	pthread_mutex_lock(&lock);
+	while (true)
+	{
+		while (!queued && !stopping)
+			pthread_cond_wait(&cond, &lock);
+		if (!queued)
+			break;
+		std::string path, body;
+		path.swap(this->path);
+		body.swap(this->body);
+		queued = false;
+		writing = true;
+		pthread_mutex_unlock(&lock);
+
+		write(path, body);
+
+		pthread_mutex_lock(&lock);
+		writing = false;
+		pthread_cond_broadcast(&cond);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+bool SnapshotWriter::write(const std::string &path, const std::string &body)
+{
+	uint64_t start = monotonic_us();
+
+	if (!Snapshot::save(path, body))
+	{
+		std::cout << GREY << "WARNING: failed to write snapshot " << path << ": " << std::strerror(errno) << RESET << std::endl;
+		return false;
+	}
+	std::cout << "Saved " << body.length() << " bytes to " << path << " in " << (monotonic_us() - start) << "us" << std::endl;
+	return true;
+}
+
+// Takes over body. The thread is started on first use, without it the
+// snapshot is written inline.
+bool SnapshotWriter::queue(const std::string &path, std::string &body)
+{
+	if (!threaded)
+		threaded = pthread_create(&thread, NULL, &SnapshotWriter::worker, this) == 0;
+	if (!threaded)
+		return write(path, body);
+	pthread_mutex_lock(&lock);
+	this->path = path;
+	this->body.swap(body);
+	queued = true;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+	return true;
+}
+
+// Blocks until every queued snapshot is on disk
+void SnapshotWriter::wait()
+{
+	pthread_mutex_lock(&lock);
+	while (queued || writing)
+		pthread_cond_wait(&cond, &lock);
+	pthread_mutex_unlock(&lock);
+}
+
+void SnapshotWriter::stop()
+{
+	if (!threaded)
+		return;
+	pthread_mutex_lock(&lock);
+	stopping = true;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+	pthread_join(thread, NULL);
+	threaded = false;
+	stopping = false;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "IRCserver.hpp"
+
+#include <pthread.h>
+
+#define SNAPSHOT_MAGIC "IRCSNAP1"
+#define SNAPSHOT_VERSION 3
+
+// Versioned binary image of the persistent server state. The file is an
+// 8 byte magic, u32 version, u64 creation time and a body produced with the
+// put_* helpers. Saving goes through a temporary file that is synced before
+// it is renamed into place, and the directory after, so a crash leaves either
+// the old or the new snapshot, never a torn one; loading maps the file
+// read-only.
+class Snapshot
+{
+private:
+	void *map;
+	size_t size;
+	uint32_t version;
+	time_t created;
+
+public:
+	Snapshot();
+	~Snapshot();
+
+	static bool save(const std::string &path, const std::string &body);
+
+	bool open(const std::string &path);
+	void close();
+
+	uint32_t get_version();
+	time_t get_created();
+	ByteReader body();
+};
+
+// Writes snapshots on a thread of its own so the event loop only pays for
+// encoding. A snapshot queued while the previous one is still being written
+// replaces any other waiting one, only the newest state matters. Anything
+// still queued is written out when the writer stops.
+class SnapshotWriter
+{
+private:
+	bool threaded;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	std::string path;
+	std::string body;
+	bool queued;
+	bool writing;
+	bool stopping;
+
+	static void *worker(void *arg);
+	void work();
+	static bool write(const std::string &path, const std::string &body);
+
+public:
+	SnapshotWriter();
+	~SnapshotWriter();
+
+	bool queue(const std::string &path, std::string &body);
+	void wait();
+	void stop();
+};
@@ -0,0 +1,260 @@
+#include "Tls.hpp"
+
+#ifdef IRCSERV_TLS
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#endif
+
+Tls::Tls() : context(NULL) {}
+
+Tls::~Tls()
+{
+	while (!sessions.empty())
+		detach(sessions.begin()->first);
+#ifdef IRCSERV_TLS
+	if (context)
+		SSL_CTX_free(context);
+#endif
+}
+
+bool Tls::is_enabled() { return context != NULL; }
+bool Tls::is_tls(int fd) { return sessions.find(fd) != sessions.end(); }
+
+bool Tls::is_ready(int fd)
+{
+	std::map<int, Session>::iterator it = sessions.find(fd);
+	return it != sessions.end() && it->second.ready;
+}
+
+ssl_st *Tls::find(int fd)
+{
+	std::map<int, Session>::iterator it = sessions.find(fd);
+	return it == sessions.end() ? NULL : it->second.ssl;
+}
+
+#ifdef IRCSERV_TLS
+
+static std::string openssl_error()
+{
+	char buffer[256];
+	unsigned long code = ERR_get_error();
+
+	ERR_clear_error();
+	if (code == 0)
+		return "unknown error";
+	ERR_error_string_n(code, buffer, sizeof(buffer));
+	return buffer;
+}
+
+// Partial writes let the send buffer drain like a plain socket's would, and
+// since it is a std::string that may move, OpenSSL must not insist on the
+// same pointer when a write is retried
+bool Tls::init(const std::string &certificate, const std::string &key, std::string &error)
+{
+	context = SSL_CTX_new(TLS_server_method());
+	if (context == NULL)
+	{
+		error = openssl_error();
+		return false;
+	}
+	SSL_CTX_set_min_proto_version(context, TLS1_2_VERSION);
+	SSL_CTX_set_options(context, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE);
+	SSL_CTX_set_mode(context, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+	SSL_CTX_set_session_cache_mode(context, SSL_SESS_CACHE_SERVER);
+	SSL_CTX_set_num_tickets(context, 1);
+	if (SSL_CTX_use_certificate_chain_file(context, certificate.c_str()) != 1
+		|| SSL_CTX_use_PrivateKey_file(context, key.c_str(), SSL_FILETYPE_PEM) != 1
+		|| SSL_CTX_check_private_key(context) != 1)
+	{
+		error = openssl_error();
+		SSL_CTX_free(context);
+		context = NULL;
+		return false;
+	}
+	// The socket BIO writes with write(2), a peer gone mid-record must not kill us
+	signal(SIGPIPE, SIG_IGN);
+	return true;
+}
+
+std::string Tls::get_ticket_keys()
+{
+	unsigned char keys[TLS_TICKET_KEYS_SIZE];
+
+	if (context == NULL || SSL_CTX_get_tlsext_ticket_keys(context, keys, sizeof(keys)) != 1)
+		return "";
+	return std::string((char *)keys, sizeof(keys));
+}
+
+bool Tls::set_ticket_keys(const std::string &keys)
+{
+	if (context == NULL || keys.length() != TLS_TICKET_KEYS_SIZE)
+		return false;
+	return SSL_CTX_set_tlsext_ticket_keys(context, (void *)keys.data(), keys.length()) == 1;
+}
+
+bool Tls::attach(int fd)
+{
+	SSL *ssl = SSL_new(context);
+
+	if (ssl == NULL || SSL_set_fd(ssl, fd) != 1)
+	{
+		SSL_free(ssl);
+		ERR_clear_error();
+		return false;
+	}
+	SSL_set_accept_state(ssl);
+	Session session = {ssl, false};
+	sessions[fd] = session;
+	return true;
+}
+
+// Sends close_notify when it fits in the socket buffer, never waits for the peer's
+void Tls::detach(int fd)
+{
+	std::map<int, Session>::iterator it = sessions.find(fd);
+
+	if (it == sessions.end())
+		return;
+	if (it->second.ready)
+		SSL_shutdown(it->second.ssl);
+	SSL_free(it->second.ssl);
+	ERR_clear_error();
+	sessions.erase(it);
+}
+
+int Tls::handshake(int fd)
+{
+	std::map<int, Session>::iterator it = sessions.find(fd);
+
+	if (it == sessions.end())
+		return TLS_FAILED;
+	if (it->second.ready)
+		return TLS_DONE;
+	int ret = SSL_do_handshake(it->second.ssl);
+	if (ret == 1)
+	{
+		it->second.ready = true;
+		return TLS_DONE;
+	}
+	int err = SSL_get_error(it->second.ssl, ret);
+	if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+		return TLS_WANT;
+	ERR_clear_error();
+	return TLS_FAILED;
+}
+
+bool Tls::is_resumed(int fd)
+{
+	SSL *ssl = find(fd);
+	return ssl && SSL_session_reused(ssl);
+}
+
+bool Tls::is_kernel_send(int fd)
+{
+#ifndef OPENSSL_NO_KTLS
+	SSL *ssl = find(fd);
+	return ssl && BIO_get_ktls_send(SSL_get_wbio(ssl));
+#else
+	(void)fd;
+	return false;
+#endif
+}
+
+// Both return the byte count, -1 with errno set to EAGAIN when the record
+// layer needs the socket to become readable or writable first, and 0 once
+// the connection is closed or broken
+ssize_t Tls::read(int fd, char *buffer, size_t length)
+{
+	SSL *ssl = find(fd);
+	int ret = ssl ? SSL_read(ssl, buffer, length) : 0;
+
+	if (ret > 0)
+		return ret;
+	int err = ssl ? SSL_get_error(ssl, ret) : SSL_ERROR_SSL;
+	if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+	{
+		errno = EAGAIN;
+		return -1;
+	}
+	ERR_clear_error();
+	return 0;
+}
+
+ssize_t Tls::write(int fd, const char *buffer, size_t length)
+{
+	SSL *ssl = find(fd);
+	int ret = ssl ? SSL_write(ssl, buffer, length) : 0;
+
+	if (ret > 0)
+		return ret;
+	int err = ssl ? SSL_get_error(ssl, ret) : SSL_ERROR_SSL;
+	if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+	{
+		errno = EAGAIN;
+		return -1;
+	}
+	ERR_clear_error();
+	return 0;
+}
+
+#else
+
+bool Tls::init(const std::string &certificate, const std::string &key, std::string &error)
+{
+	(void)certificate;
+	(void)key;
+	error = "built without TLS support, rebuild with make re TLS=1";
+	return false;
+}
+
+std::string Tls::get_ticket_keys() { return ""; }
+
+bool Tls::set_ticket_keys(const std::string &keys)
+{
+	(void)keys;
+	return false;
+}
+
+bool Tls::attach(int fd)
+{
+	(void)fd;
+	return false;
+}
+
+void Tls::detach(int fd) { sessions.erase(fd); }
+
+int Tls::handshake(int fd)
+{
+	(void)fd;
+	return TLS_FAILED;
+}
+
+bool Tls::is_resumed(int fd)
+{
+	(void)fd;
+	return false;
+}
+
+bool Tls::is_kernel_send(int fd)
+{
+	(void)fd;
+	return false;
+}
+
+ssize_t Tls::read(int fd, char *buffer, size_t length)
+{
+	(void)fd;
+	(void)buffer;
+	(void)length;
+	return 0;
+}
+
+ssize_t Tls::write(int fd, const char *buffer, size_t length)
+{
+	(void)fd;
+	(void)buffer;
+	(void)length;
+	return 0;
+}
+
+#endif
@@ -0,0 +1,57 @@
+#pragma once
+
+#include "IRCserver.hpp"
+
+struct ssl_st;
+struct ssl_ctx_st;
+
+#define TLS_TICKET_KEYS_SIZE 80
+
+enum {
+	TLS_DONE,
+	TLS_WANT,
+	TLS_FAILED
+};
+
+// Server side TLS for the connections accepted on the TLS listener, keyed by
+// fd like the rest of the connection state. OpenSSL only exists in Tls.cpp and
+// only when built with `make TLS=1`, otherwise init() reports it unavailable.
+//
+// Stateless session tickets let a reconnecting client skip the certificate
+// exchange, and the ticket keys are carried over a hot restart. When the
+// kernel takes over record encryption (kTLS) the socket accepts plaintext
+// writes again, which is what lets shard workers write to it directly.
+class Tls
+{
+private:
+	typedef struct Session
+	{
+		ssl_st *ssl;
+		bool ready;
+	} Session;
+
+	ssl_ctx_st *context;
+	std::map<int, Session> sessions;
+
+	ssl_st *find(int fd);
+
+public:
+	Tls();
+	~Tls();
+
+	bool init(const std::string &certificate, const std::string &key, std::string &error);
+	bool is_enabled();
+	std::string get_ticket_keys();
+	bool set_ticket_keys(const std::string &keys);
+
+	bool attach(int fd);
+	void detach(int fd);
+	bool is_tls(int fd);
+	bool is_ready(int fd);
+	int handshake(int fd);
+	bool is_resumed(int fd);
+	bool is_kernel_send(int fd);
+
+	ssize_t read(int fd, char *buffer, size_t length);
+	ssize_t write(int fd, const char *buffer, size_t length);
+};
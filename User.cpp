@@ -2,10 +2,11 @@
 #include "Channel.hpp"
 #include "Server.hpp"
 
-User::User() : registered(false), authenticated(false), server_operator(false), fd(-1)
+User::User() : registered(false), authenticated(false), server_operator(false), welcome_pending(false), negotiating(false), capabilities(0), fd(-1), address(0), link(-1)
 {
 	last_activity = std::time(NULL);
 	last_ping = std::time(NULL);
+	nick_time = std::time(NULL);
 }
 
 User::~User()
@@ -33,18 +34,37 @@ const std::string &User::get_host() { return hostname; }
 void User::set_real(const std::string &real) { realname = real; }
 const std::string &User::get_real() { return realname; }
 
+void User::set_away(const std::string &message) { away = message; }
+const std::string &User::get_away() { return away; }
+
 void User::set_auth(bool auth) { authenticated = auth; }
 bool User::get_auth() { return authenticated; }
 
 void User::set_registered(bool reg) { registered = reg; }
 bool User::get_registered() { return registered; }
 
+void User::set_welcome_pending(bool pending) { welcome_pending = pending; }
+bool User::get_welcome_pending() { return welcome_pending; }
+
+void User::set_negotiating(bool negotiating) { this->negotiating = negotiating; }
+bool User::is_negotiating() { return negotiating; }
+
+void User::set_capabilities(uint32_t capabilities) { this->capabilities = capabilities; }
+uint32_t User::get_capabilities() { return capabilities; }
+
 void User::append_data(const std::string &data) { datastream += data; }
 std::string &User::get_data() { return datastream; }
 
 void User::set_fd(int fd) { this->fd = fd; }
 int User::get_fd() { return fd; }
 
+void User::set_address(uint32_t address) { this->address = address; }
+uint32_t User::get_address() { return address; }
+
+void User::set_link(int link) { this->link = link; }
+int User::get_link() { return link; }
+bool User::is_remote() { return link != -1; }
+
 bool User::is_server_operator() { return server_operator; }
 void User::set_server_operator(bool op) { server_operator = op; }
 
@@ -73,7 +93,12 @@ void User::clear_sendbuffer() { sendbuffer.clear(); }
 void User::append_sendbuffer(const std::string &buffer) { sendbuffer += buffer; }
 
 void User::set_last_activity() { last_activity = std::time(NULL); }
+void User::set_last_activity(time_t t) { last_activity = t; }
 time_t User::get_last_activity() { return last_activity; }
 
 void User::set_last_ping() { last_ping = std::time(NULL); }
+void User::set_last_ping(time_t t) { last_ping = t; }
 time_t User::get_last_ping() { return last_ping; }
+
+void User::set_nick_time(time_t t) { nick_time = t; }
+time_t User::get_nick_time() { return nick_time; }
@@ -13,14 +13,21 @@ private:
 	std::string username;
 	std::string hostname;
 	std::string realname;
+	std::string away;
 	std::string datastream;
 	std::string sendbuffer;
 	bool registered;
 	bool authenticated;
 	bool server_operator;
+	bool welcome_pending;
+	bool negotiating;
+	uint32_t capabilities;
 	time_t last_activity;
 	time_t last_ping;
+	time_t nick_time;
 	int fd;
+	uint32_t address;
+	int link;
 
 public:
 	User();
@@ -39,29 +46,53 @@ public:
 	void set_real(const std::string &real);
 	const std::string &get_real();
 
+	void set_away(const std::string &message);
+	const std::string &get_away();
+
 	void set_sendbuffer(const std::string &buffer);
 	std::string &get_sendbuffer();
 	void clear_sendbuffer();
 	void append_sendbuffer(const std::string &buffer);
 
 	void set_last_activity();
+	void set_last_activity(time_t t);
 	time_t get_last_activity();
 
 	void set_last_ping();
+	void set_last_ping(time_t t);
 	time_t get_last_ping();
 
+	void set_nick_time(time_t t);
+	time_t get_nick_time();
+
 	void set_auth(bool auth);
 	bool get_auth();
 
 	void set_registered(bool reg);
 	bool get_registered();
 
+	void set_welcome_pending(bool pending);
+	bool get_welcome_pending();
+
+	void set_negotiating(bool negotiating);
+	bool is_negotiating();
+
+	void set_capabilities(uint32_t capabilities);
+	uint32_t get_capabilities();
+
 	void append_data(const std::string &data);
 	std::string &get_data();
 
 	void set_fd(int fd);
 	int get_fd();
 
+	void set_address(uint32_t address);
+	uint32_t get_address();
+
+	void set_link(int link);
+	int get_link();
+	bool is_remote();
+
 	bool is_server_operator();
 	void set_server_operator(bool op);
 
@@ -0,0 +1,140 @@
+#include "Whowas.hpp"
+
+#include <cctype>
+
+#define WHOWAS_INDEX_MIN_SIZE 64
+
+Whowas::Whowas() : next(0), sequence(0) {}
+
+// Nicknames compare case insensitively, so they hash that way too
+static uint32_t hash_nick(const char *nick)
+{
+	uint32_t hash = 2166136261u;
+
+	for (size_t i = 0; nick[i]; i++)
+		hash = (hash ^ (unsigned char)std::toupper(nick[i])) * 16777619u;
+	return hash;
+}
+
+static bool same_nick(const char *a, const char *b)
+{
+	while (*a && std::toupper((unsigned char)*a) == std::toupper((unsigned char)*b))
+	{
+		a++;
+		b++;
+	}
+	return *a == *b;
+}
+
+static void copy_field(char *to, const std::string &from, size_t size)
+{
+	size_t length = std::min(from.length(), size - 1);
+
+	std::memcpy(to, from.data(), length);
+	to[length] = '\0';
+}
+
+// Drops the history, the only place that allocates
+void Whowas::resize(size_t capacity)
+{
+	Record empty;
+	std::memset(&empty, 0, sizeof(empty));
+	records.assign(capacity, empty);
+
+	size_t size = WHOWAS_INDEX_MIN_SIZE;
+	while (size < capacity * 2)
+		size *= 2;
+	index.assign(capacity ? size : 0, -1);
+	next = 0;
+}
+
+size_t Whowas::capacity() const { return records.size(); }
+
+// Index slot holding `nick`, or the empty slot where it would be inserted
+size_t Whowas::slot_of(const char *nick, uint32_t hash) const
+{
+	size_t mask = index.size() - 1;
+	size_t slot = hash & mask;
+
+	while (index[slot] != -1 && (records[index[slot]].hash != hash || !same_nick(records[index[slot]].nick, nick)))
+		slot = (slot + 1) & mask;
+	return slot;
+}
+
+void Whowas::unindex(size_t slot)
+{
+	size_t mask = index.size() - 1;
+	size_t hole = slot;
+
+	index[hole] = -1;
+	for (size_t probe = (hole + 1) & mask; index[probe] != -1; probe = (probe + 1) & mask)
+	{
+		size_t home = records[index[probe]].hash & mask;
+		if (((probe - home) & mask) >= ((probe - hole) & mask))
+		{
+			index[hole] = index[probe];
+			index[probe] = -1;
+			hole = probe;
+		}
+	}
+}
+
+void Whowas::add(const std::string &nick, const std::string &user, const std::string &host, const std::string &real, const std::string &server, time_t time)
+{
+	if (records.empty())
+		return;
+
+	Record &record = records[next];
+	if (record.sequence != 0)
+	{
+		size_t slot = slot_of(record.nick, record.hash);
+		if (index[slot] == (int32_t)next)
+			unindex(slot);
+	}
+
+	copy_field(record.nick, nick, sizeof(record.nick));
+	copy_field(record.user, user, sizeof(record.user));
+	copy_field(record.host, host, sizeof(record.host));
+	copy_field(record.real, real, sizeof(record.real));
+	copy_field(record.server, server, sizeof(record.server));
+	record.time = time;
+	record.sequence = ++sequence;
+	record.hash = hash_nick(record.nick);
+
+	size_t slot = slot_of(record.nick, record.hash);
+	record.older = index[slot];
+	index[slot] = next;
+	next = (next + 1) % records.size();
+}
+
+// Newest first, at most `max`, returns how many were found
+size_t Whowas::find(const std::string &nick, std::vector<const Record *> &out, size_t max) const
+{
+	char key[WHOWAS_NICK_SIZE];
+
+	out.clear();
+	if (records.empty())
+		return 0;
+	copy_field(key, nick, sizeof(key));
+	int32_t current = index[slot_of(key, hash_nick(key))];
+	while (current != -1 && out.size() < max)
+	{
+		const Record &record = records[current];
+		out.push_back(&record);
+		if (record.older != -1 && records[record.older].sequence > record.sequence)
+			break;
+		current = record.older;
+	}
+	return out.size();
+}
+
+void Whowas::oldest_first(std::vector<const Record *> &out) const
+{
+	out.clear();
+	for (size_t i = 0; i < records.size(); i++)
+	{
+		const Record &record = records[(next + i) % records.size()];
+		if (record.sequence != 0)
+			out.push_back(&record);
+	}
+}
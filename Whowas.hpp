@@ -0,0 +1,53 @@
+#pragma once
+
+#include "IRCserver.hpp"
+
+#define WHOWAS_NICK_SIZE 32
+#define WHOWAS_USER_SIZE 16
+#define WHOWAS_HOST_SIZE 64
+#define WHOWAS_REAL_SIZE 64
+#define WHOWAS_SERVER_SIZE 64
+
+// The last `capacity` nicknames that went away, by quit or nick change, for
+// WHOWAS. Records are fixed size and overwritten oldest first, longer fields
+// are truncated, so once sized nothing is allocated.
+//
+// An open addressing index (linear probing, backward shift deletion) maps a
+// case folded nickname to its newest record, which links to the older ones.
+// A record only ever gets overwritten while it is the oldest of all, so a
+// link is stale exactly when it leads to a newer record, and the index entry
+// goes away with the last record of its nickname.
+class Whowas
+{
+public:
+	typedef struct Record
+	{
+		char nick[WHOWAS_NICK_SIZE];
+		char user[WHOWAS_USER_SIZE];
+		char host[WHOWAS_HOST_SIZE];
+		char real[WHOWAS_REAL_SIZE];
+		char server[WHOWAS_SERVER_SIZE];
+		time_t time;
+		uint64_t sequence;
+		uint32_t hash;
+		int32_t older;
+	} Record;
+
+private:
+	std::vector<Record> records;
+	std::vector<int32_t> index;
+	size_t next;
+	uint64_t sequence;
+
+	size_t slot_of(const char *nick, uint32_t hash) const;
+	void unindex(size_t slot);
+
+public:
+	Whowas();
+
+	void resize(size_t capacity);
+	size_t capacity() const;
+	void add(const std::string &nick, const std::string &user, const std::string &host, const std::string &real, const std::string &server, time_t time);
+	size_t find(const std::string &nick, std::vector<const Record *> &out, size_t max) const;
+	void oldest_first(std::vector<const Record *> &out) const;
+};
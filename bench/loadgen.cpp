@@ -0,0 +1,682 @@
+// Multi-connection load generator for ircserv.
+//
+// Registers many synthetic clients, spreads them over channels following a
+// uniform or zipf size distribution, then drives a PRIVMSG/JOIN/PART/NICK
+// mix while measuring throughput, delivery latency and server RSS.
+// Channel creation must be enabled (channel_creation: 1) on the server.
+//
+// -f adds one client that keeps that many PRIVMSGs pipelined to a channel of
+// its own during the measured phase, the latency figures then show what a
+// flood does to everyone else's deliveries.
+//
+// Built with TLS=1, -S runs the same load over the server's TLS listener
+// and -H measures handshakes per second, full and resumed from a ticket.
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sstream>
+#include <stdint.h>
+#include <string>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#ifdef IRCSERV_TLS
+#include <openssl/ssl.h>
+#endif
+
+struct Options
+{
+	std::string host;
+	int port;
+	std::string password;
+	size_t clients;
+	size_t channels;
+	size_t joins;
+	bool zipf;
+	double duration;
+	double rate;
+	int mix[4];
+	int pid;
+	size_t batch;
+	bool tls;
+	size_t handshakes;
+	size_t flood;
+};
+
+struct Client
+{
+	int fd;
+#ifdef IRCSERV_TLS
+	SSL *ssl;
+#endif
+	std::string nick;
+	std::string inbuf;
+	std::string outbuf;
+	bool registered;
+	std::vector<size_t> channels;
+};
+
+enum
+{
+	ACTION_PRIVMSG,
+	ACTION_JOIN,
+	ACTION_PART,
+	ACTION_NICK
+};
+
+static std::vector<Client> clients;
+static std::vector<double> channel_weights;
+static std::vector<uint32_t> latencies;
+static uint64_t deliveries = 0;
+static uint64_t registered = 0;
+static uint64_t joined = 0;
+static uint64_t disconnected = 0;
+static uint64_t nick_counter = 0;
+static uint64_t flooded = 0;
+
+static uint64_t now_us()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void usage(const char *name)
+{
+	std::cerr << "Usage: " << name << " [options]\n"
+			  << "  -a host       server address (127.0.0.1)\n"
+			  << "  -p port       server port (6667)\n"
+			  << "  -w password   connection password\n"
+			  << "  -c clients    number of synthetic clients (1000)\n"
+			  << "  -n channels   number of channels (50)\n"
+			  << "  -j joins      channels joined per client (1)\n"
+			  << "  -d dist       channel size distribution: uniform or zipf (zipf)\n"
+			  << "  -t seconds    duration of the measured phase (10)\n"
+			  << "  -r rate       total actions per second (2000)\n"
+			  << "  -m p:j:l:n    PRIVMSG:JOIN:PART:NICK weights (90:4:4:2)\n"
+			  << "  -s pid        server pid for RSS reporting (auto detected)\n"
+			  << "  -b batch      connections opened per batch (50)\n"
+			  << "  -S            connect over TLS, -p is then the server's tls_port\n"
+			  << "  -H count      only time count full and count resumed TLS handshakes\n"
+			  << "  -f lines      one more client floods, keeping lines PRIVMSGs in flight (0)\n"
+			  << "Run the server with stdout redirected to /dev/null for meaningful numbers." << std::endl;
+}
+
+static bool parse_options(int argc, char **argv, Options &opt)
+{
+	int c;
+
+	opt.host = "127.0.0.1";
+	opt.port = 6667;
+	opt.clients = 1000;
+	opt.channels = 50;
+	opt.joins = 1;
+	opt.zipf = true;
+	opt.duration = 10;
+	opt.rate = 2000;
+	opt.mix[ACTION_PRIVMSG] = 90;
+	opt.mix[ACTION_JOIN] = 4;
+	opt.mix[ACTION_PART] = 4;
+	opt.mix[ACTION_NICK] = 2;
+	opt.pid = 0;
+	opt.batch = 50;
+	opt.tls = false;
+	opt.handshakes = 0;
+	opt.flood = 0;
+
+	while ((c = getopt(argc, argv, "a:p:w:c:n:j:d:t:r:m:s:b:SH:f:h")) != -1)
+	{
+		switch (c)
+		{
+		case 'a': opt.host = optarg; break;
+		case 'p': opt.port = std::atoi(optarg); break;
+		case 'w': opt.password = optarg; break;
+		case 'c': opt.clients = std::strtoul(optarg, NULL, 10); break;
+		case 'n': opt.channels = std::strtoul(optarg, NULL, 10); break;
+		case 'j': opt.joins = std::strtoul(optarg, NULL, 10); break;
+		case 'd': opt.zipf = std::string(optarg) == "zipf"; break;
+		case 't': opt.duration = std::atof(optarg); break;
+		case 'r': opt.rate = std::atof(optarg); break;
+		case 's': opt.pid = std::atoi(optarg); break;
+		case 'b': opt.batch = std::strtoul(optarg, NULL, 10); break;
+		case 'S': opt.tls = true; break;
+		case 'H': opt.tls = true; opt.handshakes = std::strtoul(optarg, NULL, 10); break;
+		case 'f': opt.flood = std::strtoul(optarg, NULL, 10); break;
+		case 'm':
+			if (std::sscanf(optarg, "%d:%d:%d:%d", &opt.mix[0], &opt.mix[1], &opt.mix[2], &opt.mix[3]) != 4)
+				return false;
+			break;
+		default:
+			return false;
+		}
+	}
+	return opt.clients > 0 && opt.channels > 0 && opt.batch > 0 && opt.rate > 0;
+}
+
+static int find_server_pid()
+{
+	DIR *dir = opendir("/proc");
+	int pid = 0;
+
+	if (!dir)
+		return 0;
+	while (dirent *entry = readdir(dir))
+	{
+		std::ifstream comm((std::string("/proc/") + entry->d_name + "/comm").c_str());
+		std::string name;
+		if (comm && std::getline(comm, name) && name == "ircserv")
+		{
+			pid = std::atoi(entry->d_name);
+			break;
+		}
+	}
+	closedir(dir);
+	return pid;
+}
+
+static long read_rss_kb(int pid)
+{
+	std::stringstream path;
+	path << "/proc/" << pid << "/status";
+	std::ifstream status(path.str().c_str());
+	std::string line;
+
+	while (std::getline(status, line))
+		if (line.compare(0, 6, "VmRSS:") == 0)
+			return std::atol(line.c_str() + 6);
+	return -1;
+}
+
+static void raise_fd_limit()
+{
+	rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0)
+	{
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+}
+
+static std::string channel_name(size_t idx)
+{
+	std::stringstream ss;
+	ss << "#bench" << idx;
+	return ss.str();
+}
+
+static std::string next_nick()
+{
+	static const char digits[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+	std::string nick;
+	uint64_t n = nick_counter++;
+
+	do {
+		nick = digits[n % 36] + nick;
+		n /= 36;
+	} while (n);
+	return "b" + nick;
+}
+
+static size_t pick_channel(const Options &opt)
+{
+	if (!opt.zipf)
+		return std::rand() % opt.channels;
+	double r = (double)std::rand() / RAND_MAX * channel_weights.back();
+	return std::lower_bound(channel_weights.begin(), channel_weights.end(), r) - channel_weights.begin();
+}
+
+static void queue(Client &client, const std::string &line)
+{
+	client.outbuf += line + "\r\n";
+}
+
+static int connect_client(const Options &opt)
+{
+	sockaddr_in addr;
+	int fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	int on = 1;
+
+	if (fd == -1)
+		return -1;
+	std::memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(opt.port);
+	inet_pton(AF_INET, opt.host.c_str(), &addr.sin_addr);
+	if (connect(fd, (sockaddr *)&addr, sizeof(addr)) == -1)
+	{
+		close(fd);
+		return -1;
+	}
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	return fd;
+}
+
+#ifdef IRCSERV_TLS
+static SSL_CTX *tls_context = NULL;
+
+// Waits out the handshake on the non-blocking socket, the server's
+// certificate is not verified
+static SSL *tls_connect(int fd, SSL_SESSION *session)
+{
+	SSL *ssl = SSL_new(tls_context);
+	int ret;
+
+	SSL_set_fd(ssl, fd);
+	if (session)
+		SSL_set_session(ssl, session);
+	while ((ret = SSL_connect(ssl)) != 1)
+	{
+		int err = SSL_get_error(ssl, ret);
+		pollfd pfd = {fd, (short)(err == SSL_ERROR_WANT_WRITE ? POLLOUT : POLLIN), 0};
+		if ((err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) || poll(&pfd, 1, 5000) != 1)
+		{
+			SSL_free(ssl);
+			return NULL;
+		}
+	}
+	return ssl;
+}
+
+// TLS 1.3 tickets arrive after the handshake, one read takes them in
+static SSL_SESSION *tls_ticket(SSL *ssl, int fd)
+{
+	pollfd pfd = {fd, POLLIN, 0};
+	char byte;
+
+	if (poll(&pfd, 1, 1000) == 1)
+		SSL_read(ssl, &byte, 1);
+	return SSL_get1_session(ssl);
+}
+
+// TLS 1.3 tickets are single use, each resumption keeps the fresh ticket it
+// was sent for the next one. Only connect and handshake are timed.
+static void bench_handshakes(const Options &opt)
+{
+	SSL_SESSION *session = NULL;
+
+	for (int resumed = 0; resumed < 2; resumed++)
+	{
+		uint64_t spent = 0;
+		size_t done = 0, reused = 0;
+
+		for (size_t i = 0; i < opt.handshakes; i++)
+		{
+			uint64_t start = now_us();
+			int fd = connect_client(opt);
+			SSL *ssl = fd == -1 ? NULL : tls_connect(fd, resumed ? session : NULL);
+			spent += now_us() - start;
+			if (ssl)
+			{
+				done++;
+				reused += SSL_session_reused(ssl);
+				if (resumed || !session)
+				{
+					SSL_SESSION *ticket = tls_ticket(ssl, fd);
+					if (session)
+						SSL_SESSION_free(session);
+					session = ticket;
+				}
+				SSL_shutdown(ssl);
+				SSL_free(ssl);
+			}
+			if (fd != -1)
+				close(fd);
+		}
+		double seconds = spent / 1e6;
+		std::cout << std::fixed << std::setprecision(1)
+				  << (resumed ? "resumed:    " : "full:       ") << done << "/" << opt.handshakes << " handshakes in "
+				  << spent / 1000 << "ms (" << (seconds > 0 ? done / seconds : 0) << "/s), " << reused << " reused a session" << std::endl;
+	}
+	if (session)
+		SSL_SESSION_free(session);
+}
+#endif
+
+static ssize_t client_send(Client &client)
+{
+#ifdef IRCSERV_TLS
+	if (client.ssl)
+	{
+		int ret = SSL_write(client.ssl, client.outbuf.c_str(), client.outbuf.length());
+		return ret > 0 ? ret : -1;
+	}
+#endif
+	return send(client.fd, client.outbuf.c_str(), client.outbuf.length(), MSG_NOSIGNAL);
+}
+
+// Same contract as recv, a TLS read that needs more bytes reports EAGAIN
+static ssize_t client_recv(Client &client, char *buffer, size_t length)
+{
+#ifdef IRCSERV_TLS
+	if (client.ssl)
+	{
+		int ret = SSL_read(client.ssl, buffer, length);
+		if (ret > 0)
+			return ret;
+		int err = SSL_get_error(client.ssl, ret);
+		if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE)
+			return 0;
+		errno = EAGAIN;
+		return -1;
+	}
+#endif
+	return recv(client.fd, buffer, length, 0);
+}
+
+static void close_client(Client &client)
+{
+#ifdef IRCSERV_TLS
+	if (client.ssl)
+		SSL_free(client.ssl);
+	client.ssl = NULL;
+#endif
+	close(client.fd);
+	client.fd = -1;
+}
+
+static void handle_line(Client &client, const std::string &line, uint64_t now)
+{
+	std::vector<std::string> words;
+	std::istringstream iss(line);
+	std::string word;
+
+	while (words.size() < 3 && iss >> word)
+		words.push_back(word);
+	if (words.size() >= 2 && words[0] == "PING")
+		queue(client, "PONG " + words[1]);
+	if (words.size() < 2)
+		return;
+	if (words[1] == "001" && !client.registered)
+	{
+		client.registered = true;
+		registered++;
+	}
+	else if (words[1] == "JOIN" && words[0].compare(1, client.nick.length() + 1, client.nick + "!") == 0)
+		joined++;
+	else if (words[1] == "PRIVMSG")
+	{
+		size_t pos = line.find(" :lg ");
+		if (pos == std::string::npos)
+			return;
+		uint64_t sent = std::strtoull(line.c_str() + pos + 5, NULL, 10);
+		if (sent && now >= sent)
+		{
+			latencies.push_back(now - sent);
+			deliveries++;
+		}
+	}
+}
+
+// One poll round over every client: flushes pending output and consumes input
+static void pump(int timeout_ms)
+{
+	std::vector<pollfd> pfds(clients.size());
+
+	for (size_t i = 0; i < clients.size(); i++)
+	{
+		pfds[i].fd = clients[i].fd;
+		pfds[i].events = POLLIN | (clients[i].outbuf.empty() ? 0 : POLLOUT);
+		pfds[i].revents = 0;
+	}
+	if (poll(&pfds[0], pfds.size(), timeout_ms) <= 0)
+		return;
+
+	uint64_t now = now_us();
+	char buffer[65536];
+	for (size_t i = 0; i < clients.size(); i++)
+	{
+		Client &client = clients[i];
+		if (client.fd == -1)
+			continue;
+		if (pfds[i].revents & POLLOUT)
+		{
+			ssize_t ret = client_send(client);
+			if (ret > 0)
+				client.outbuf.erase(0, ret);
+		}
+		if (pfds[i].revents & (POLLIN | POLLHUP | POLLERR))
+		{
+			ssize_t ret;
+			while ((ret = client_recv(client, buffer, sizeof(buffer))) > 0)
+				client.inbuf.append(buffer, ret);
+			if (ret == 0 || (ret == -1 && errno != EAGAIN && errno != EWOULDBLOCK))
+			{
+				close_client(client);
+				disconnected++;
+				continue;
+			}
+			size_t start = 0, end;
+			while ((end = client.inbuf.find("\r\n", start)) != std::string::npos)
+			{
+				handle_line(client, client.inbuf.substr(start, end - start), now);
+				start = end + 2;
+			}
+			client.inbuf.erase(0, start);
+		}
+	}
+}
+
+static void drain(uint64_t us)
+{
+	uint64_t until = now_us() + us;
+	while (now_us() < until)
+		pump(10);
+}
+
+static int pick_action(const Options &opt)
+{
+	int total = opt.mix[0] + opt.mix[1] + opt.mix[2] + opt.mix[3];
+	int r = std::rand() % std::max(total, 1);
+
+	for (int i = 0; i < 4; i++)
+	{
+		if (r < opt.mix[i])
+			return i;
+		r -= opt.mix[i];
+	}
+	return ACTION_PRIVMSG;
+}
+
+static uint64_t perform(const Options &opt, Client &client, uint64_t now)
+{
+	std::stringstream ss;
+	size_t channel;
+
+	switch (pick_action(opt))
+	{
+	case ACTION_JOIN:
+		channel = pick_channel(opt);
+		queue(client, "JOIN " + channel_name(channel));
+		client.channels.push_back(channel);
+		return 0;
+	case ACTION_PART:
+		if (client.channels.size() <= 1)
+			return 0;
+		queue(client, "PART " + channel_name(client.channels.back()) + " :bye");
+		client.channels.pop_back();
+		return 0;
+	case ACTION_NICK:
+		client.nick = next_nick();
+		queue(client, "NICK " + client.nick);
+		return 0;
+	default:
+		if (client.channels.empty())
+			return 0;
+		ss << "PRIVMSG " << channel_name(client.channels[std::rand() % client.channels.size()]) << " :lg " << now;
+		queue(client, ss.str());
+		return 1;
+	}
+}
+
+static uint32_t percentile(double p)
+{
+	if (latencies.empty())
+		return 0;
+	return latencies[std::min(latencies.size() - 1, (size_t)(latencies.size() * p))];
+}
+
+int main(int argc, char **argv)
+{
+	Options opt;
+
+	if (!parse_options(argc, argv, opt))
+	{
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	raise_fd_limit();
+	std::srand(42);
+#ifdef IRCSERV_TLS
+	if (opt.tls)
+	{
+		tls_context = SSL_CTX_new(TLS_client_method());
+		SSL_CTX_set_mode(tls_context, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+		SSL_CTX_set_session_cache_mode(tls_context, SSL_SESS_CACHE_CLIENT);
+	}
+	if (opt.handshakes)
+	{
+		bench_handshakes(opt);
+		SSL_CTX_free(tls_context);
+		return EXIT_SUCCESS;
+	}
+#else
+	if (opt.tls)
+	{
+		std::cerr << "built without TLS support, rebuild with make re TLS=1" << std::endl;
+		return EXIT_FAILURE;
+	}
+#endif
+	if (!opt.pid)
+		opt.pid = find_server_pid();
+
+	channel_weights.resize(opt.channels);
+	for (size_t i = 0; i < opt.channels; i++)
+		channel_weights[i] = (i ? channel_weights[i - 1] : 0) + 1.0 / (i + 1);
+
+	long rss_before = opt.pid ? read_rss_kb(opt.pid) : -1;
+	uint64_t start = now_us();
+
+	// Connect and register in batches so the listen backlog never overflows,
+	// the flooder is the last client and never picked for actions
+	size_t total = opt.clients + (opt.flood ? 1 : 0);
+	for (size_t i = 0; i < total; i++)
+	{
+		Client client;
+		client.fd = connect_client(opt);
+		if (client.fd == -1)
+		{
+			std::cerr << "connect failed after " << i << " clients: " << std::strerror(errno) << std::endl;
+			break;
+		}
+#ifdef IRCSERV_TLS
+		client.ssl = opt.tls ? tls_connect(client.fd, NULL) : NULL;
+		if (opt.tls && !client.ssl)
+		{
+			std::cerr << "TLS handshake failed after " << i << " clients" << std::endl;
+			close(client.fd);
+			break;
+		}
+#endif
+		client.nick = next_nick();
+		client.registered = false;
+		if (!opt.password.empty())
+			queue(client, "PASS " + opt.password);
+		queue(client, "NICK " + client.nick);
+		queue(client, "USER " + client.nick + " 0 * :Load Generator");
+		clients.push_back(client);
+		if (clients.size() % opt.batch == 0)
+			pump(0);
+	}
+	while (registered < clients.size() && now_us() - start < 30000000)
+		pump(10);
+	std::cout << "registered " << registered << "/" << clients.size() << " clients in " << (now_us() - start) / 1000 << "ms" << std::endl;
+
+	start = now_us();
+	uint64_t expected_joins = 0;
+	size_t actors = std::min(clients.size(), opt.clients);
+	Client *flooder = actors < clients.size() ? &clients.back() : NULL;
+	if (flooder)
+	{
+		queue(*flooder, "JOIN #flood");
+		expected_joins++;
+	}
+	for (size_t i = 0; i < actors; i++)
+	{
+		for (size_t j = 0; j < opt.joins; j++)
+		{
+			size_t channel = pick_channel(opt);
+			if (std::find(clients[i].channels.begin(), clients[i].channels.end(), channel) != clients[i].channels.end())
+				continue;
+			clients[i].channels.push_back(channel);
+			queue(clients[i], "JOIN " + channel_name(channel));
+			expected_joins++;
+		}
+		if (i % opt.batch == 0)
+			pump(0);
+	}
+	while (joined < expected_joins && now_us() - start < 30000000)
+		pump(10);
+	std::cout << "joined " << joined << "/" << expected_joins << " channels in " << (now_us() - start) / 1000 << "ms" << std::endl;
+
+	latencies.clear();
+	deliveries = 0;
+	uint64_t actions = 0, messages = 0;
+	start = now_us();
+	uint64_t end = start + (uint64_t)(opt.duration * 1000000);
+	for (uint64_t now = start; now < end; now = now_us())
+	{
+		uint64_t due = (uint64_t)((now - start) / 1e6 * opt.rate);
+		for (; actions < due; actions++)
+		{
+			Client &client = clients[std::rand() % actors];
+			if (client.fd != -1)
+				messages += perform(opt, client, now);
+		}
+		if (flooder && flooder->fd != -1 && flooder->outbuf.empty())
+			for (size_t i = 0; i < opt.flood; i++, flooded++)
+				queue(*flooder, "PRIVMSG #flood :flood flood flood flood flood flood flood flood");
+		pump(1);
+	}
+	uint64_t elapsed = now_us() - start;
+	drain(500000);
+
+	std::sort(latencies.begin(), latencies.end());
+	double seconds = elapsed / 1e6;
+	std::cout << std::fixed << std::setprecision(1)
+			  << "actions:    " << actions << " (" << actions / seconds << "/s)\n"
+			  << "privmsg:    " << messages << " sent (" << messages / seconds << "/s)\n"
+			  << "deliveries: " << deliveries << " (" << deliveries / seconds << " msgs/s)\n"
+			  << "latency:    p50 " << percentile(0.5) << "us, p99 " << percentile(0.99) << "us, max " << (latencies.empty() ? 0 : latencies.back()) << "us\n"
+			  << "dropped:    " << disconnected << " connections" << std::endl;
+	if (flooder)
+		std::cout << "flood:      " << flooded << " lines queued (" << flooded / seconds << "/s), flooder " << (flooder->fd == -1 ? "disconnected" : "connected") << std::endl;
+	if (opt.pid)
+		std::cout << "server rss: " << rss_before << "kB before, " << read_rss_kb(opt.pid) << "kB after (pid " << opt.pid << ")" << std::endl;
+
+	for (size_t i = 0; i < clients.size(); i++)
+		if (clients[i].fd != -1)
+			close_client(clients[i]);
+#ifdef IRCSERV_TLS
+	if (tls_context)
+		SSL_CTX_free(tls_context);
+#endif
+	return EXIT_SUCCESS;
+}
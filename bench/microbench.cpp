@@ -0,0 +1,373 @@
+// In-process microbenchmarks for the parser, dispatch and fan-out hot paths.
+//
+// A detached Server is populated with synthetic users attached to fake fds.
+// Those fds are never polled, output only accumulates in the users' send
+// buffers, which the harness drains periodically in place of the socket layer.
+// Reports ns/op and heap allocations/op for each function.
+
+#include "../Server.hpp"
+#include "../Channel.hpp"
+#include "../User.hpp"
+
+#include <new>
+
+static uint64_t allocations = 0;
+
+void *operator new(size_t size) throw(std::bad_alloc)
+{
+	allocations++;
+	void *ptr = std::malloc(size ? size : 1);
+	if (!ptr)
+		throw std::bad_alloc();
+	return ptr;
+}
+
+void operator delete(void *ptr) throw()
+{
+	std::free(ptr);
+}
+
+#define FIRST_FD 1000
+#define MIN_RUNTIME_US 200000
+
+static Server *server;
+static std::vector<User *> bench_users;
+static std::vector<std::string> bench_lines;
+static uint64_t sink = 0;
+
+static void drain_sendbuffers()
+{
+	UserList &users = server->get_users();
+	for (UserList::iterator it = users.begin(); it != users.end(); ++it)
+		it->second->clear_sendbuffer();
+}
+
+static User *connect_user(int fd, const std::string &nick)
+{
+	sockaddr_in addr = initialized<sockaddr_in>();
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	User *user = server->add_connection(fd, (sockaddr &)addr);
+	user->append_data("PASS pw\r\nNICK " + nick + "\r\nUSER " + nick + " 0 * :Bench User\r\n");
+	server->parse_data(fd);
+	return user;
+}
+
+static std::string nick_for(size_t i)
+{
+	return "u" + to_string(i);
+}
+
+// Attaches users until `count` exist, joins the first `members` of them to #bench
+static void populate(size_t count, size_t members)
+{
+	while (bench_users.size() < count)
+	{
+		size_t i = bench_users.size();
+		bench_users.push_back(connect_user(FIRST_FD + i, nick_for(i)));
+	}
+	Channel &channel = server->get_channels()["#bench"];
+	for (size_t i = 0; i < count; i++)
+	{
+		if (i < members)
+			channel.add_user(bench_users[i]->get_fd(), bench_users[i], "");
+		else
+			channel.remove_user(bench_users[i]->get_fd());
+	}
+	drain_sendbuffers();
+}
+
+static void bench_split(size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		sink += split("PRIVMSG #bench :the quick brown fox jumps over the lazy dog\r", ' ', true).size();
+}
+
+static void bench_is_valid_command_first(size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		sink += server->is_valid_command("PASS secret\r");
+}
+
+static void bench_is_valid_command_privmsg(size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		sink += server->is_valid_command("PRIVMSG #bench :hello\r");
+}
+
+static void bench_is_valid_command_unknown(size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		sink += server->is_valid_command("FOOBAR baz\r");
+}
+
+static void bench_parse_data(size_t n)
+{
+	User *user = bench_users[0];
+	for (size_t i = 0; i < n; i++)
+	{
+		user->append_data(bench_lines[0]);
+		server->parse_data(user->get_fd());
+		if ((i & 63) == 63)
+			drain_sendbuffers();
+	}
+}
+
+static void bench_broadcast(size_t n)
+{
+	Channel &channel = server->get_channels()["#bench"];
+	for (size_t i = 0; i < n; i++)
+	{
+		server->broadcast_message(channel, bench_lines[0], bench_users[0]);
+		if ((i & 63) == 63)
+			drain_sendbuffers();
+	}
+}
+
+static void bench_welcome(size_t n)
+{
+	User *user = bench_users[0];
+	for (size_t i = 0; i < n; i++)
+	{
+		server->welcome(user->get_fd());
+		if ((i & 63) == 63)
+			drain_sendbuffers();
+	}
+}
+
+static void bench_find_user_hit(size_t n)
+{
+	std::string nick = nick_for(bench_users.size() / 2);
+	for (size_t i = 0; i < n; i++)
+		sink += server->find_user_by_nickname(nick) != NULL;
+}
+
+static void bench_find_user_miss(size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		sink += server->find_user_by_nickname("nobody") != NULL;
+}
+
+static void bench_comparator(size_t n)
+{
+	Server::map_string_comparator less;
+	std::string a("#SomeLongChannelName"), b("#somelongchannelnamf");
+	for (size_t i = 0; i < n; i++)
+		sink += less(a, b);
+}
+
+static void bench_channel_lookup(size_t n)
+{
+	Server::ChannelList &channels = server->get_channels();
+	for (size_t i = 0; i < n; i++)
+		sink += channels.find(bench_lines[i % bench_lines.size()]) != channels.end();
+}
+
+// Fills #bench's ban list with host and nick bans, none of which match the bench users
+static void ban_masks(size_t count)
+{
+	MaskList &bans = server->get_channels()["#bench"].get_masks(MODE_BAN);
+	for (size_t i = bans.size(); i < count; i++)
+		bans.add(MaskList::normalize(i % 4 ? "*!*@host" + to_string(i) + ".example.org" : "spammer" + to_string(i)), "bench", 0);
+}
+
+static void bench_is_banned(size_t n)
+{
+	Channel &channel = server->get_channels()["#bench"];
+	for (size_t i = 0; i < n; i++)
+		sink += channel.is_banned(bench_users[i % bench_users.size()]);
+}
+
+// Made up words of 5 to 12 letters, chat text practically never contains one,
+// which is the worst case for both since the whole line gets scanned
+static Filter bench_filter;
+
+static void filter_words(size_t count)
+{
+	std::vector<Filter::Entry> entries;
+	uint32_t seed = 1;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		Filter::Entry entry = {"", FILTER_BLOCK, "bench", 0};
+		for (size_t j = 0; j < 5 + i % 8; j++)
+		{
+			seed = seed * 1103515245 + 12345;
+			entry.pattern += 'a' + (seed >> 16) % 26;
+		}
+		entries.push_back(entry);
+	}
+	bench_filter.assign(entries);
+}
+
+static void bench_filter_match(size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		sink += bench_filter.match(bench_lines[i % bench_lines.size()]) != NULL;
+}
+
+// What a loop of std::string::find over the same list costs
+static void bench_filter_find(size_t n)
+{
+	const std::vector<Filter::Entry> &entries = bench_filter.get_entries();
+	for (size_t i = 0; i < n; i++)
+	{
+		std::string folded = Filter::normalize(bench_lines[i % bench_lines.size()]);
+		for (size_t j = 0; j < entries.size(); j++)
+			if (folded.find(entries[j].pattern) != std::string::npos)
+			{
+				sink++;
+				break;
+			}
+	}
+}
+
+static Whowas bench_whowas;
+
+static void bench_whowas_add(size_t n)
+{
+	static const std::string user("user"), host("host.example.org"), real("Real Name"), origin("bench");
+	for (size_t i = 0; i < n; i++)
+		bench_whowas.add(bench_lines[i % bench_lines.size()], user, host, real, origin, i);
+}
+
+static void bench_whowas_find(size_t n)
+{
+	std::vector<const Whowas::Record *> found;
+	for (size_t i = 0; i < n; i++)
+		sink += bench_whowas.find(bench_lines[i % bench_lines.size()], found, 10);
+}
+
+#define SNAPSHOT_PATH "/tmp/ircserv-microbench.snap"
+
+static void bench_snapshot_save(size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		sink += server->save_snapshot(SNAPSHOT_PATH);
+}
+
+static void bench_snapshot_load(size_t n)
+{
+	// Startup path, the server has no channels yet
+	server->wait_snapshot();
+	for (size_t i = 0; i < n; i++)
+	{
+		server->get_channels().clear();
+		sink += server->load_snapshot(SNAPSHOT_PATH);
+	}
+}
+
+static void run(const std::string &name, void (*fn)(size_t))
+{
+	size_t n = 1;
+	uint64_t elapsed = 0, allocs = 0;
+
+	fn(1); // warm up buffers and caches
+	while (true)
+	{
+		uint64_t before = allocations;
+		uint64_t start = monotonic_us();
+		fn(n);
+		elapsed = monotonic_us() - start;
+		allocs = allocations - before;
+		if (elapsed >= MIN_RUNTIME_US || n >= ((size_t)1 << 30))
+			break;
+		n *= elapsed < MIN_RUNTIME_US / 16 ? 8 : 2;
+	}
+	drain_sendbuffers();
+	std::cerr << std::left << std::setw(40) << name << std::right
+			  << std::setw(12) << std::fixed << std::setprecision(1) << elapsed * 1000.0 / n << " ns/op"
+			  << std::setw(10) << std::setprecision(2) << (double)allocs / n << " allocs/op"
+			  << std::setw(12) << n << " iterations" << std::endl;
+}
+
+int main()
+{
+	// Logging is part of every send path, silence it so the numbers reflect the work itself
+	std::cout.setstate(std::ios::failbit);
+
+	try {
+		server = new Server("6667", "pw", true);
+	} catch (std::exception &e) {
+		std::cerr << "failed to start server: " << e.what() << " (run from the repository root)" << std::endl;
+		return EXIT_FAILURE;
+	}
+	server->get_channels()["#bench"] = Channel("#bench", "", "");
+
+	run("split", bench_split);
+	run("is_valid_command/first", bench_is_valid_command_first);
+	run("is_valid_command/privmsg", bench_is_valid_command_privmsg);
+	run("is_valid_command/unknown", bench_is_valid_command_unknown);
+	run("map_string_comparator", bench_comparator);
+
+	size_t counts[] = {100, 1000, 10000};
+	for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++)
+	{
+		std::string suffix = "/" + to_string(counts[i]);
+		populate(counts[i], 0);
+		run("find_user_by_nickname/hit" + suffix, bench_find_user_hit);
+		run("find_user_by_nickname/miss" + suffix, bench_find_user_miss);
+	}
+	run("welcome", bench_welcome);
+
+	size_t sizes[] = {10, 100, 1000};
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+	{
+		std::string suffix = "/" + to_string(sizes[i]);
+		populate(sizes[i], sizes[i]);
+		bench_lines.assign(1, ":u0!u0@localhost PRIVMSG #bench :the quick brown fox jumps over the lazy dog");
+		run("broadcast_message" + suffix, bench_broadcast);
+		bench_lines.assign(1, "PRIVMSG #bench :the quick brown fox jumps over the lazy dog\r\n");
+		run("parse_data/privmsg" + suffix, bench_parse_data);
+	}
+
+	size_t bans[] = {10, 1000, 10000};
+	for (size_t i = 0; i < sizeof(bans) / sizeof(bans[0]); i++)
+	{
+		ban_masks(bans[i]);
+		run("is_banned/" + to_string(bans[i]), bench_is_banned);
+	}
+	MaskList none;
+	std::swap(server->get_channels()["#bench"].get_masks(MODE_BAN), none);
+
+	bench_lines.clear();
+	bench_lines.push_back("the quick brown fox jumps over the lazy dog");
+	bench_lines.push_back("Anyone around who knows why my build fails with -Werror on the new compiler?");
+	bench_lines.push_back("brb, meeting in 5 minutes. Ping me if the deploy goes sideways :)");
+	bench_lines.push_back("https://example.org/some/rather/long/path?with=query&and=parameters#fragment");
+	size_t patterns[] = {10, 1000};
+	for (size_t i = 0; i < sizeof(patterns) / sizeof(patterns[0]); i++)
+	{
+		filter_words(patterns[i]);
+		run("filter/match/" + to_string(patterns[i]), bench_filter_match);
+		run("filter/find/" + to_string(patterns[i]), bench_filter_find);
+	}
+
+	bench_whowas.resize(1000);
+	bench_lines.clear();
+	for (size_t i = 0; i < 4096; i++)
+		bench_lines.push_back(nick_for(i % 1500));
+	run("whowas/add/1000", bench_whowas_add);
+	run("whowas/find/1000", bench_whowas_find);
+
+	for (size_t i = server->get_channels().size(); i < 1000; i++)
+		server->get_channels()["#chan" + to_string(i)] = Channel("#chan" + to_string(i), "", "");
+	bench_lines.clear();
+	for (size_t i = 0; i < 64; i++)
+		bench_lines.push_back("#CHAN" + to_string(i * 13));
+	run("channel_lookup/1000", bench_channel_lookup);
+
+	for (size_t i = server->get_channels().size(); i < 100000; i++)
+	{
+		Channel &channel = server->get_channels()["#chan" + to_string(i)] = Channel("#chan" + to_string(i), i % 7 ? "" : "key", "topic of channel " + to_string(i));
+		channel.set_limit(i % 50);
+	}
+	run("snapshot/save/100000", bench_snapshot_save);
+	run("snapshot/load/100000", bench_snapshot_load);
+	unlink(SNAPSHOT_PATH);
+
+	std::cerr << "(checksum " << sink << ")" << std::endl;
+	delete server;
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,167 @@
+// Deterministic replay of a traffic capture (see capture_file in irc.yaml).
+//
+// Feeds the recorded connects, lines and disconnects into a detached Server
+// through an in-memory transport: connections live on their recorded fds
+// shifted above any real descriptor, so they are never polled nor closed for
+// real, and after every record the queued output of each connection is
+// drained into a transcript instead of a socket. Records are replayed at
+// their original pace, accelerated, or back to back, and the resulting
+// transcript and timings can be compared against another build.
+
+#include "../Server.hpp"
+#include "../Channel.hpp"
+#include "../User.hpp"
+
+#define FD_OFFSET (1 << 20)
+
+static void usage(const char *name)
+{
+	std::cerr << "Usage: " << name << " <capture> [options]\n"
+			  << "  -p password   server password the capture was recorded with\n"
+			  << "  -s speed      1 = original pace, N = N times faster, 0 = back to back (0)\n"
+			  << "  -o file       write the output transcript to file\n"
+			  << "  -c file       compare the transcript against a previous one\n"
+			  << "Run from a directory holding the irc.yaml the capture was recorded with." << std::endl;
+}
+
+static void drain(Server &server, std::ofstream &transcript, std::vector<std::string> &lines)
+{
+	UserList &users = server.get_users();
+
+	for (UserList::iterator it = users.begin(); it != users.end(); ++it)
+	{
+		std::string &buffer = it->second->get_sendbuffer();
+		if (it->first < 0 || buffer.empty())
+			continue;
+		std::vector<std::string> out = split(buffer, '\n');
+		for (size_t i = 0; i < out.size(); i++)
+		{
+			std::string line = to_string(it->first - FD_OFFSET) + " " + out[i].substr(0, out[i].length() - 1);
+			lines.push_back(line);
+			if (transcript.is_open())
+				transcript << line << "\n";
+		}
+		it->second->clear_sendbuffer();
+	}
+}
+
+static int compare(const std::vector<std::string> &lines, const std::string &filename)
+{
+	std::ifstream file(filename.c_str());
+	std::string line;
+	size_t idx = 0, mismatches = 0;
+
+	if (!file.is_open())
+	{
+		std::cerr << "cannot open " << filename << std::endl;
+		return EXIT_FAILURE;
+	}
+	while (std::getline(file, line))
+	{
+		if (idx >= lines.size() || lines[idx] != line)
+		{
+			if (mismatches++ == 0)
+				std::cerr << "first difference at line " << idx + 1 << ":\n  expected: " << line << "\n  replayed: " << (idx < lines.size() ? lines[idx] : "<end of output>") << std::endl;
+		}
+		idx++;
+	}
+	if (idx < lines.size())
+		mismatches += lines.size() - idx;
+	std::cerr << "compare: " << mismatches << " differing lines (" << idx << " expected, " << lines.size() << " replayed)" << std::endl;
+	return mismatches ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv)
+{
+	std::string password, output, reference;
+	double speed = 0;
+	int c;
+
+	while ((c = getopt(argc, argv, "p:s:o:c:h")) != -1)
+	{
+		switch (c)
+		{
+		case 'p': password = optarg; break;
+		case 's': speed = std::atof(optarg); break;
+		case 'o': output = optarg; break;
+		case 'c': reference = optarg; break;
+		default: usage(argv[0]); return EXIT_FAILURE;
+		}
+	}
+	if (optind != argc - 1)
+	{
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	std::vector<CaptureRecord> records;
+	if (!Capture::load(argv[optind], records))
+	{
+		std::cerr << "cannot read capture " << argv[optind] << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	std::cout.setstate(std::ios::failbit);
+	Server *server;
+	try {
+		server = new Server("6667", password, true);
+		server->initialize_bot();
+	} catch (std::exception &e) {
+		std::cerr << "failed to start server: " << e.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	std::ofstream transcript;
+	if (!output.empty())
+		transcript.open(output.c_str());
+
+	std::vector<std::string> lines;
+	uint64_t start = monotonic_us(), busy = 0, lag = 0;
+	for (size_t i = 0; i < records.size(); i++)
+	{
+		CaptureRecord &record = records[i];
+
+		if (speed > 0)
+		{
+			uint64_t due = start + (uint64_t)(record.time / speed);
+			uint64_t now = monotonic_us();
+			if (due > now)
+				usleep(due - now);
+			else
+				lag = std::max(lag, now - due);
+		}
+
+		uint64_t before = monotonic_us();
+		UserList &users = server->get_users();
+		int fd = record.fd + FD_OFFSET;
+		if (record.type == CAPTURE_CONNECT)
+		{
+			sockaddr_in addr = initialized<sockaddr_in>();
+			addr.sin_family = AF_INET;
+			inet_pton(AF_INET, record.payload.c_str(), &addr.sin_addr);
+			server->add_connection(fd, (sockaddr &)addr);
+		}
+		else if (record.type == CAPTURE_DATA && users.find(fd) != users.end())
+		{
+			users[fd]->append_data(record.payload + "\n");
+			server->parse_data(fd);
+		}
+		else if (record.type == CAPTURE_DISCONNECT)
+			server->terminate_connection(fd);
+		server->tick();
+		busy += monotonic_us() - before;
+		drain(*server, transcript, lines);
+	}
+	uint64_t elapsed = monotonic_us() - start;
+	uint64_t recorded = records.empty() ? 0 : records.back().time;
+
+	std::cerr << std::fixed << std::setprecision(1)
+			  << "replayed " << records.size() << " records in " << elapsed / 1000.0 << "ms (recorded span " << recorded / 1000.0 << "ms)\n"
+			  << "server time " << busy / 1000.0 << "ms, " << (records.empty() ? 0 : (double)busy / records.size()) << "us/record, max lag " << lag / 1000.0 << "ms\n"
+			  << "output " << lines.size() << " lines" << std::endl;
+
+	delete server;
+	if (!reference.empty())
+		return compare(lines, reference);
+	return EXIT_SUCCESS;
+}
@@ -9,7 +9,14 @@ int main(int argc, char **argv)
 	}
 	try
 	{
-		Server server(argv[1], argv[2]);
+		const char *handoff = getenv(HANDOFF_ENV);
+		Server server(argv[1], argv[2], handoff != NULL);
+		if (handoff)
+		{
+			unsetenv(HANDOFF_ENV);
+			server.adopt_handoff(to_number_safe<int>(handoff));
+		}
+		server.set_executable(argv[0]);
 		std::cout << "Server running on port " << argv[1] << std::endl;
 		server.initialize_bot();
 		server.run();
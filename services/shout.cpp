@@ -0,0 +1,41 @@
+// Example moderation service: holds back channel messages written mostly in
+// capitals and tells the sender why. Build with `make services` and list the
+// shared object under `services:` in irc.yaml.
+
+#include "../Service.hpp"
+
+#define SHOUT_MIN_LETTERS 8
+
+class Shout : public Service
+{
+public:
+	const char *name() { return "shout"; }
+
+	void attach(ServiceRegistry &registry)
+	{
+		registry.on_channel(SERVICE_MESSAGE, this);
+	}
+
+	// args is the server's parse of "PRIVMSG <channel> :<words...>"
+	int on_channel(int event, const ServiceMessage &message, ServiceReply &reply)
+	{
+		size_t letters = 0, capitals = 0;
+
+		(void)event;
+		for (size_t i = 2; i < message.args.size(); i++)
+			for (size_t j = 0; j < message.args[i].length(); j++)
+			{
+				letters += std::isalpha((unsigned char)message.args[i][j]) != 0;
+				capitals += std::isupper((unsigned char)message.args[i][j]) != 0;
+			}
+		if (letters < SHOUT_MIN_LETTERS || capitals * 4 < letters * 3)
+			return SERVICE_CONTINUE;
+		reply.notice("Message to " + *message.channel + " not sent, please don't shout");
+		return SERVICE_STOP;
+	}
+};
+
+SERVICE_ENTRY_POINT
+{
+	return new Shout();
+}
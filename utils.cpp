@@ -84,3 +84,97 @@ std::string join(const std::string arr[], size_t size, const std::string& separa
     }
     return result;
 }
+
+void put_u8(std::string &buf, uint8_t v)
+{
+	buf += (char)v;
+}
+
+void put_u32(std::string &buf, uint32_t v)
+{
+	for (int i = 0; i < 4; i++)
+		buf += (char)((v >> (i * 8)) & 0xff);
+}
+
+void put_u64(std::string &buf, uint64_t v)
+{
+	for (int i = 0; i < 8; i++)
+		buf += (char)((v >> (i * 8)) & 0xff);
+}
+
+void put_str(std::string &buf, const std::string &str)
+{
+	put_u32(buf, str.length());
+	buf += str;
+}
+
+ByteReader::ByteReader(const char *data, size_t size) : data(data), size(size), pos(0), ok(true) {}
+
+uint8_t ByteReader::u8()
+{
+	if (!ok || size - pos < 1)
+	{
+		ok = false;
+		return 0;
+	}
+	return (uint8_t)data[pos++];
+}
+
+uint32_t ByteReader::u32()
+{
+	uint32_t v = 0;
+	if (!ok || size - pos < 4)
+	{
+		ok = false;
+		return 0;
+	}
+	for (int i = 0; i < 4; i++)
+		v |= (uint32_t)(uint8_t)data[pos++] << (i * 8);
+	return v;
+}
+
+uint64_t ByteReader::u64()
+{
+	uint64_t v = 0;
+	if (!ok || size - pos < 8)
+	{
+		ok = false;
+		return 0;
+	}
+	for (int i = 0; i < 8; i++)
+		v |= (uint64_t)(uint8_t)data[pos++] << (i * 8);
+	return v;
+}
+
+std::string ByteReader::str()
+{
+	uint32_t len = u32();
+	if (!ok || size - pos < len)
+	{
+		ok = false;
+		return "";
+	}
+	std::string s(data + pos, len);
+	pos += len;
+	return s;
+}
+
+size_t ByteReader::offset() { return pos; }
+size_t ByteReader::remaining() { return size - pos; }
+
+void ByteReader::skip(size_t n)
+{
+	if (size - pos < n)
+		ok = false;
+	else
+		pos += n;
+}
+
+bool ByteReader::good() { return ok; }
+
+uint64_t monotonic_us()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
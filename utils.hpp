@@ -67,3 +67,33 @@ std::string join(const std::string arr[], size_t size, const std::string& separa
 #define JN(...) join((const std::string[]){__VA_ARGS__}, sizeof((const std::string[]){__VA_ARGS__})/sizeof(std::string), " ")
 
 std::vector<std::string> split(const std::string &str, char delim, bool trim = false);
+
+void put_u8(std::string &buf, uint8_t v);
+void put_u32(std::string &buf, uint32_t v);
+void put_u64(std::string &buf, uint64_t v);
+void put_str(std::string &buf, const std::string &str);
+
+// Bounds checked reader over a binary buffer written with the put_* helpers
+class ByteReader
+{
+private:
+	const char *data;
+	size_t size;
+	size_t pos;
+	bool ok;
+
+public:
+	ByteReader(const char *data, size_t size);
+
+	uint8_t u8();
+	uint32_t u32();
+	uint64_t u64();
+	std::string str();
+
+	size_t offset();
+	size_t remaining();
+	void skip(size_t n);
+	bool good();
+};
+
+uint64_t monotonic_us();